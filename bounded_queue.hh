@@ -0,0 +1,155 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include "mt_ring_queue.hh"
+
+
+/* This is a bounded multiple producers multiple consumers queue with
+ * a sequence number in every slot (the design of Dmitry Vyukov's bounded
+ * MPMC queue). Unlike RingPtrQueue it never spins over the ring: every
+ * operation makes at most BOUNDED_QUEUE_ATTEMPTS attempts to claim its
+ * slot and gives up after that, so the number of steps is bounded even
+ * when threads are preempted in the middle of an operation.
+ *
+ * The price is that an operation may fail although the queue is neither
+ * full nor empty: enqueue fails if the slot it needs is still being
+ * emptied by a preempted consumer, dequeue fails if the element in its
+ * slot is still being written by a preempted producer, and both fail
+ * under heavy contention. The caller must have a fallback, e.g. a thread
+ * keeps its chunk instead of returning it to the queue.
+ *
+ * Memory ordering: the slot sequence number is stored with release after
+ * the element is written (taken) and loaded with acquire, so everything
+ * a producer did with the pointed object before enqueue is visible to
+ * the consumer. Head and Tail only hand out positions. */
+
+
+namespace memorylog {
+
+
+constexpr size_t BOUNDED_QUEUE_ATTEMPTS = 64;
+
+
+template <typename PTR_TYPE>
+class BoundedPtrQueue {
+public:
+    /* the size is rounded up to a power of two */
+    BoundedPtrQueue(size_t size)
+        : Mask(round_up_to_power_of_2(size) - 1)
+        , Cells(new Cell[Mask + 1])
+    {
+        for (size_t i = 0; i <= Mask; ++i) {
+            Cells[i].Sequence.store(i, std::memory_order_relaxed);
+            Cells[i].Elem = nullptr;
+        }
+    }
+
+
+    bool enqueue(PTR_TYPE elem) {
+        size_t pos = Tail.load(std::memory_order_relaxed);
+        for (size_t attempt = 0; attempt < BOUNDED_QUEUE_ATTEMPTS; ++attempt) {
+            Cell& cell = Cells[pos & Mask];
+            size_t sequence = cell.Sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (Tail.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.Elem = elem;
+                    cell.Sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                /* the element of the previous round is still there */
+                return false;
+            } else {
+                pos = Tail.load(std::memory_order_relaxed);
+            }
+        }
+        return false;
+    }
+
+
+    PTR_TYPE dequeue() {
+        size_t pos = Head.load(std::memory_order_relaxed);
+        for (size_t attempt = 0; attempt < BOUNDED_QUEUE_ATTEMPTS; ++attempt) {
+            Cell& cell = Cells[pos & Mask];
+            size_t sequence = cell.Sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (Head.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed))
+                {
+                    PTR_TYPE elem = cell.Elem;
+                    cell.Sequence.store(
+                        pos + Mask + 1, std::memory_order_release);
+                    return elem;
+                }
+            } else if (diff < 0) {
+                /* the element of this round is not there yet */
+                return nullptr;
+            } else {
+                pos = Head.load(std::memory_order_relaxed);
+            }
+        }
+        return nullptr;
+    }
+
+
+    size_t capacity() const {
+        return Mask + 1;
+    }
+
+
+private:
+    static size_t round_up_to_power_of_2(size_t size) {
+        size_t result = 2;
+        while (result < size)
+            result *= 2;
+        return result;
+    }
+
+
+    struct Cell {
+        std::atomic<size_t> Sequence;
+        PTR_TYPE Elem;
+    };
+
+    using Counter = std::atomic<size_t>;
+
+    size_t const Mask;
+    std::unique_ptr<Cell[]> const Cells;
+    char Padding0[CACHE_LINE_SIZE];
+    Counter Head = {0};
+    char Padding1[CACHE_LINE_SIZE - sizeof(Counter)];
+    Counter Tail = {0};
+    char Padding2[CACHE_LINE_SIZE - sizeof(Counter)];
+};
+
+
+} // namespace memorylog
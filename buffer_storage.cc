@@ -0,0 +1,306 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "buffer_storage.hh"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include <system_error>
+
+
+namespace memorylog {
+
+
+constexpr size_t PAGE_SIZE = 4096;
+constexpr int MPOL_PREFERRED = 1;
+
+
+static size_t round_up(size_t value, size_t granularity) {
+    return (value + granularity - 1) / granularity * granularity;
+}
+
+
+std::vector<int> parse_node_list(const char* list) {
+    std::vector<int> nodes;
+    const char* pos = list;
+    for (;;) {
+        char* end;
+        long first = strtol(pos, &end, 10);
+        if (end == pos)
+            break;
+        long last = first;
+        if (*end == '-') {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+            if (end == pos)
+                break;
+        }
+        for (long node = first; node <= last; ++node)
+            nodes.push_back(node);
+        if (*end != ',')
+            break;
+        pos = end + 1;
+    }
+    return nodes;
+}
+
+
+std::vector<int> numa_nodes() {
+    std::vector<int> nodes;
+    FILE* online = fopen("/sys/devices/system/node/online", "r");
+    if (online != nullptr) {
+        char list[256];
+        if (fgets(list, sizeof(list), online) != nullptr)
+            nodes = parse_node_list(list);
+        fclose(online);
+    }
+    if (nodes.empty())
+        nodes.push_back(0);
+    return nodes;
+}
+
+
+/* The memory policy is a hint, if the kernel refuses it (no NUMA support,
+ * restricted container) the pages are still allocated, just not local */
+static void prefer_node(char* begin, size_t len, int node) {
+    std::vector<unsigned long> mask(node / (8 * sizeof(unsigned long)) + 1);
+    mask[node / (8 * sizeof(unsigned long))] |=
+        1ul << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, begin, len, MPOL_PREFERRED, mask.data(),
+            mask.size() * 8 * sizeof(unsigned long) + 1, 0);
+}
+
+
+BufferStorage::BufferStorage(
+    size_t size, const char* mapped_file,
+    const std::vector<int>& nodes, size_t node_part_size,
+    size_t huge_page_size)
+    : Size(size)
+    , PageSize(PAGE_SIZE)
+{
+    if (mapped_file != nullptr) {
+        map_file(mapped_file, nodes.empty());
+    } else if (huge_page_size > PAGE_SIZE) {
+        if (!map_hugetlb(huge_page_size, nodes.empty())) {
+            map_transparent();
+            if (nodes.empty())
+                touch_pages();
+        }
+    } else if (!nodes.empty()) {
+        map_anonymous();
+    } else {
+        Memory = new char[size];
+
+        /* let's pre-allocate all memory pages */
+        for (size_t i = 0; i < size; i += PAGE_SIZE)
+            Memory[i] = 0;
+        return;
+    }
+
+    if (!nodes.empty())
+        place_on_nodes(nodes, node_part_size);
+}
+
+
+void BufferStorage::touch_pages() {
+    for (size_t i = 0; i < MappedSize; i += PAGE_SIZE)
+        Memory[i] = 0;
+}
+
+
+void BufferStorage::map_anonymous() {
+    /* a memory policy can be set only on page aligned memory */
+    size_t mapped_size = round_up(Size, PAGE_SIZE);
+    void* memory = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::system_error(errno, std::generic_category(), "mmap");
+
+    Memory = static_cast<char*>(memory);
+    MappedSize = mapped_size;
+    Backing = BACKING_ANONYMOUS;
+}
+
+
+/* Fails if there are not enough hugetlb pages of the size reserved */
+bool BufferStorage::map_hugetlb(size_t huge_page_size, bool populate) {
+    size_t mapped_size = round_up(Size, huge_page_size);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+        __builtin_ctzll(huge_page_size) << MAP_HUGE_SHIFT;
+    if (populate)
+        flags |= MAP_POPULATE;
+    void* memory = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                        flags, -1, 0);
+    if (memory == MAP_FAILED)
+        return false;
+
+    Memory = static_cast<char*>(memory);
+    MappedSize = mapped_size;
+    Backing = BACKING_HUGETLB;
+    PageSize = huge_page_size;
+    return true;
+}
+
+
+/* Size of transparent huge pages or 0 if they are disabled */
+static size_t transparent_huge_page_size() {
+    char mode[128] = "";
+    FILE* enabled = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (enabled == nullptr)
+        return 0;
+    bool read = fgets(mode, sizeof(mode), enabled) != nullptr;
+    fclose(enabled);
+    if (!read || strstr(mode, "[never]") != nullptr)
+        return 0;
+
+    size_t size = 2 * 1024 * 1024;
+    FILE* pmd_size =
+        fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+    if (pmd_size != nullptr) {
+        unsigned long value;
+        if (fscanf(pmd_size, "%lu", &value) == 1 && value > PAGE_SIZE)
+            size = value;
+        fclose(pmd_size);
+    }
+    return size;
+}
+
+
+/* Regular anonymous memory aligned to the transparent huge page size and
+ * advised to be backed by them */
+void BufferStorage::map_transparent() {
+    size_t huge_page_size = transparent_huge_page_size();
+    if (huge_page_size == 0) {
+        map_anonymous();
+        return;
+    }
+
+    /* map more to cut an aligned part out of it */
+    size_t mapped_size = round_up(Size, huge_page_size);
+    size_t reserved_size = mapped_size + huge_page_size;
+    void* memory = mmap(nullptr, reserved_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::system_error(errno, std::generic_category(), "mmap");
+
+    char* reserved = static_cast<char*>(memory);
+    size_t head = round_up((uintptr_t)reserved, huge_page_size)
+        - (uintptr_t)reserved;
+    if (head != 0)
+        munmap(reserved, head);
+    if (reserved_size - head - mapped_size != 0)
+        munmap(reserved + head + mapped_size,
+               reserved_size - head - mapped_size);
+
+    Memory = reserved + head;
+    MappedSize = mapped_size;
+    Backing = BACKING_ANONYMOUS;
+    if (madvise(Memory, MappedSize, MADV_HUGEPAGE) == 0) {
+        Backing = BACKING_TRANSPARENT_HUGE_PAGES;
+        PageSize = huge_page_size;
+    }
+}
+
+
+void BufferStorage::place_on_nodes(
+    const std::vector<int>& nodes, size_t node_part_size)
+{
+    for (size_t k = 0; k < nodes.size(); ++k) {
+        size_t begin = k * node_part_size;
+        if (begin >= MappedSize)
+            break;
+        size_t end = k + 1 == nodes.size()
+            ? MappedSize : (k + 1) * node_part_size;
+        if (end > MappedSize)
+            end = MappedSize;
+        begin = begin / PageSize * PageSize;
+        prefer_node(Memory + begin, end - begin, nodes[k]);
+    }
+
+    /* pages are allocated on the first touch according to the policy */
+    touch_pages();
+}
+
+
+void BufferStorage::map_file(const char* mapped_file, bool populate) {
+    int fd = open(mapped_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw std::system_error(errno, std::generic_category(), "open");
+
+    /* hugetlbfs files must be a multiple of the huge page size, it is
+     * reported as the block size of the file system */
+    struct statfs fs_stat;
+    size_t granularity = PAGE_SIZE;
+    if (fstatfs(fd, &fs_stat) == 0 && (size_t)fs_stat.f_bsize > granularity)
+        granularity = fs_stat.f_bsize;
+    size_t mapped_size = round_up(Size, granularity);
+
+    if (ftruncate(fd, mapped_size) == -1) {
+        int error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), "ftruncate");
+    }
+
+    /* the kernel populates page tables at once, there is no need to touch
+     * every page; a fresh file is zero filled */
+    int flags = MAP_SHARED;
+    if (populate)
+        flags |= MAP_POPULATE;
+    void* memory = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                        flags, fd, 0);
+    int error = errno;
+    close(fd);
+    if (memory == MAP_FAILED)
+        throw std::system_error(error, std::generic_category(), "mmap");
+
+    Memory = static_cast<char*>(memory);
+    MappedSize = mapped_size;
+    Backing = BACKING_FILE;
+    PageSize = granularity;
+}
+
+
+BufferStorage::~BufferStorage() {
+    if (MappedSize != 0)
+        munmap(Memory, MappedSize);
+    else
+        delete[] Memory;
+}
+
+
+bool BufferStorage::sync() const {
+    if (!mapped())
+        return false;
+    return msync(Memory, MappedSize, MS_SYNC) == 0;
+}
+
+
+} // namespace memorylog
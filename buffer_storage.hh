@@ -0,0 +1,104 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+#include "memorylog.hh"
+#include <stddef.h>
+#include <vector>
+
+
+namespace memorylog {
+
+
+/* Returns ids of online NUMA nodes, a single node 0 if the system does
+ * not report NUMA topology */
+std::vector<int> numa_nodes();
+
+/* Parses a list of nodes in the sysfs format (e.g. "0-3,6") */
+std::vector<int> parse_node_list(const char* list);
+
+
+/* Memory of the log buffer. It is either allocated on the heap or it is
+ * a shared mapping of a file, in the last case the kernel keeps
+ * the content of the buffer in the file (page cache) after the process
+ * dies. Throws std::bad_alloc or std::system_error on failure.
+ *
+ * If nodes are given, the memory is split into parts of node_part_size
+ * bytes, the part k is placed on nodes[k] and the last node gets
+ * the rest of the memory.
+ *
+ * If huge_page_size is given, anonymous memory is mapped with hugetlb
+ * pages of that size or, if there are no such pages reserved, with
+ * transparent huge pages or just regular pages (see backing()). */
+class BufferStorage {
+public:
+    BufferStorage(size_t size, const char* mapped_file,
+                  const std::vector<int>& nodes = {},
+                  size_t node_part_size = 0,
+                  size_t huge_page_size = 0);
+    ~BufferStorage();
+
+    BufferStorage(const BufferStorage&) = delete;
+    BufferStorage& operator=(const BufferStorage&) = delete;
+
+    char* get() const {
+        return Memory;
+    }
+
+    size_t size() const {
+        return Size;
+    }
+
+    bool mapped() const {
+        return Backing == BACKING_FILE;
+    }
+
+    BufferBacking backing() const {
+        return Backing;
+    }
+
+    size_t page_size() const {
+        return PageSize;
+    }
+
+    /* Writes dirty pages of a mapped buffer back to the file */
+    bool sync() const;
+
+private:
+    void map_file(const char* mapped_file, bool populate);
+    void map_anonymous();
+    bool map_hugetlb(size_t huge_page_size, bool populate);
+    void map_transparent();
+    void touch_pages();
+    void place_on_nodes(const std::vector<int>& nodes, size_t node_part_size);
+
+    char* Memory = nullptr;
+    size_t const Size;
+    size_t MappedSize = 0;
+    BufferBacking Backing = BACKING_HEAP;
+    size_t PageSize;
+};
+
+
+} // namespace memorylog
@@ -0,0 +1,198 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "chunk_dumper.hh"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+
+namespace memorylog {
+
+
+constexpr size_t DUMP_STAGING_SIZE = 4 * 1024 * 1024;
+/* a chunk reused more times during the copies is dumped as empty */
+constexpr int COPY_ATTEMPTS = 3;
+/* a gap this small between two written ranges is written as zeros, so
+ * the ranges stay in one pwritev call */
+constexpr size_t ZERO_GAP_SIZE = 4096;
+
+
+static bool pwrite_all(int fd, struct iovec* iov, size_t count, off_t offset) {
+    while (count != 0) {
+        ssize_t written =
+            pwritev(fd, iov, std::min<size_t>(count, IOV_MAX), offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        offset += written;
+        size_t left = written;
+        while (count != 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count != 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+
+ChunkDumper::ChunkDumper(GlobalContext& ctx)
+    : Ctx(ctx)
+    , States(new ChunkState[ctx.chunks()])
+{}
+
+
+bool ChunkDumper::dump(const char* filename, bool incremental) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    bool full = !incremental || LastFile != filename;
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (full ? O_TRUNC : 0);
+    int fd = open(filename, flags, 0644);
+    if (fd < 0)
+        return false;
+    LastFile.clear();
+
+    if (!Staging) {
+        StagingSize = std::max(DUMP_STAGING_SIZE, Ctx.MaxChunkSize);
+        Staging.reset(new char[StagingSize]);
+        Zeros.reset(new char[std::max(ZERO_GAP_SIZE, Ctx.MaxChunkSize)]());
+    }
+    if (full)
+        for (size_t i = 0; i < Ctx.chunks(); ++i)
+            States[i] = ChunkState{0, 0};
+
+    Failed = ftruncate(fd, Ctx.BigBuffer.size()) != 0;
+    for (size_t i = 0; i < Ctx.chunks(); ++i)
+        dump_chunk(fd, i);
+
+    /* the format arena follows the chunks */
+    Ctx.Formats.refresh_calibration();
+    const char* arena = Ctx.Formats.arena();
+    add_to_run(fd, arena - Ctx.BigBuffer.get(), arena,
+               Ctx.Formats.published(0));
+    /* and the compressed blocks follow the arena, a block written during
+     * the copy fails its checksum */
+    add_to_run(fd, Ctx.CompressedRegion - Ctx.BigBuffer.get(),
+               Ctx.CompressedRegion, Ctx.CompressedSize);
+    flush_run(fd);
+
+    bool result = !Failed;
+    if (close(fd) != 0)
+        result = false;
+    if (result)
+        LastFile = filename;
+    return result;
+}
+
+
+void ChunkDumper::dump_chunk(int fd, size_t index) {
+    auto chunk = Ctx.chunk(index);
+    auto& state = States[index];
+
+    uint64_t generation = chunk->get_generation();
+    size_t size = chunk->end_point() - chunk->start_point();
+    if (size == state.Size && (size == 0 || generation == state.Generation)) {
+        /* the file has this chunk already */
+        flush_run(fd);
+        return;
+    }
+
+    if (StagingFill + Ctx.chunk_size(chunk) > StagingSize)
+        flush_run(fd);
+    size = copy_chunk(chunk, generation);
+
+    /* the file reads as zeros past the records written to it before,
+     * only the records of a previous dump beyond the new ones are wiped */
+    off_t offset = chunk->start_point() - Ctx.BigBuffer.get();
+    add_to_run(fd, offset, Staging.get() + StagingFill, size);
+    if (state.Size > size)
+        add_to_run(fd, offset + size, Zeros.get(), state.Size - size);
+    StagingFill += size;
+
+    state.Generation = generation;
+    state.Size = size;
+}
+
+
+/* Copies the records of the chunk to the staging buffer, returns their
+ * size. The copy is consistent if the chunk was not reset meanwhile. */
+size_t ChunkDumper::copy_chunk(MemoryBufferChunk* chunk, uint64_t& generation) {
+    for (int attempt = 0; attempt < COPY_ATTEMPTS; ++attempt) {
+        generation = chunk->get_generation();
+        size_t size = chunk->end_point() - chunk->start_point();
+        memcpy(Staging.get() + StagingFill, chunk->start_point(), size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (chunk->get_generation() == generation)
+            return size;
+    }
+    return 0;
+}
+
+
+void ChunkDumper::add_to_run(
+    int fd, off_t offset, const void* data, size_t size)
+{
+    if (size == 0)
+        return;
+    off_t run_end = RunOffset + RunSize;
+    if (!Run.empty() && run_end != offset) {
+        /* the gap is the tail of a chunk or the header of the next one,
+         * both are zeros in the file */
+        if (offset > run_end && offset - run_end <= (off_t)ZERO_GAP_SIZE)
+            add_to_run(fd, run_end, Zeros.get(), offset - run_end);
+        else
+            flush_run(fd);
+    }
+    if (Run.empty())
+        RunOffset = offset;
+
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(data);
+    iov.iov_len = size;
+    Run.push_back(iov);
+    RunSize += size;
+}
+
+
+void ChunkDumper::flush_run(int fd) {
+    if (!Run.empty() && !pwrite_all(fd, Run.data(), Run.size(), RunOffset))
+        Failed = true;
+    Run.clear();
+    RunSize = 0;
+    StagingFill = 0;
+}
+
+
+} // namespace memorylog
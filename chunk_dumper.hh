@@ -0,0 +1,90 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "memorylog_internal.hh"
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+namespace memorylog {
+
+
+/* Writes consistent snapshots of the buffer (see dump_chunks). Only
+ * the records below the fill point of each chunk are copied, a chunk that
+ * is reset while it is copied is copied again. The copies are written to
+ * the file at the offsets of the chunks in the buffer with pwritev, one
+ * call per run of adjacent chunks. The file is created with the size of
+ * the buffer and reads as zeros elsewhere, so the headers and the unused
+ * tails of the chunks are not written (small gaps between the records of
+ * a run are written as zeros to keep the run in one call).
+ *
+ * The generation and the fill point of every chunk written to the file are
+ * remembered, an incremental dump to the same file skips the chunks that
+ * have not changed since and wipes only the records of a previous dump
+ * that a chunk no longer has. */
+class ChunkDumper {
+public:
+    ChunkDumper(GlobalContext& ctx);
+
+    ChunkDumper(const ChunkDumper&) = delete;
+    ChunkDumper& operator=(const ChunkDumper&) = delete;
+
+    bool dump(const char* filename, bool incremental);
+
+private:
+    struct ChunkState {
+        uint64_t Generation;
+        /* bytes of records of the chunk in the file */
+        size_t Size;
+    };
+
+    void dump_chunk(int fd, size_t index);
+    size_t copy_chunk(MemoryBufferChunk* chunk, uint64_t& generation);
+    void add_to_run(int fd, off_t offset, const void* data, size_t size);
+    void flush_run(int fd);
+
+    GlobalContext& Ctx;
+    std::mutex Lock;
+    std::unique_ptr<ChunkState[]> const States;
+    /* the file of the last dump, it is empty if the dump failed */
+    std::string LastFile;
+
+    /* records of the chunks of the current run are copied here */
+    std::unique_ptr<char[]> Staging;
+    size_t StagingSize = 0;
+    size_t StagingFill = 0;
+    std::unique_ptr<char[]> Zeros;
+
+    std::vector<struct iovec> Run;
+    off_t RunOffset = 0;
+    size_t RunSize = 0;
+    /* a write of the current dump has failed */
+    bool Failed = false;
+};
+
+
+} // namespace memorylog
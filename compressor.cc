@@ -0,0 +1,184 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "compressor.hh"
+#include "lz_codec.hh"
+#include <string.h>
+#include <time.h>
+
+
+namespace memorylog {
+
+
+constexpr size_t BLOCK_HEADER_SIZE =
+    RECORD_PREFIX_SIZE + sizeof(CompressedBlockHeader);
+
+
+Compressor::Compressor(GlobalContext& ctx, char* region, size_t region_size)
+    : Ctx(ctx)
+    , Region(region)
+    , RegionSize(region_size)
+    , Sealed(ctx.chunks())
+    , Scratch(new char[ctx.MaxChunkSize])
+{
+    /* the memory may have blocks of a previous log */
+    memset(Region, 0, RegionSize);
+    Thread = std::thread(&Compressor::run, this);
+}
+
+
+Compressor::~Compressor() {
+    Stop.store(true, std::memory_order_release);
+    Thread.join();
+}
+
+
+bool Compressor::seal(MemoryBufferChunk* chunk) {
+    for (size_t attempt = 0; attempt < SEAL_ATTEMPTS; ++attempt)
+        if (Sealed.enqueue(chunk))
+            return true;
+    /* the records of the chunk are not compressed */
+    DroppedChunks.fetch_add(1, std::memory_order_relaxed);
+    return Ctx.free_chunk(chunk);
+}
+
+
+MemoryBufferChunk* Compressor::steal() {
+    auto chunk = Sealed.dequeue();
+    if (chunk != nullptr)
+        DroppedChunks.fetch_add(1, std::memory_order_relaxed);
+    return chunk;
+}
+
+
+void Compressor::get_stats(Stats& stats) const {
+    stats.CompressedChunks = CompressedChunks.load(std::memory_order_relaxed);
+    stats.CompressedRawBytes =
+        CompressedRawBytes.load(std::memory_order_relaxed);
+    stats.CompressedBytes = CompressedBytes.load(std::memory_order_relaxed);
+    stats.EvictedBlocks = EvictedBlocks.load(std::memory_order_relaxed);
+    stats.DroppedChunks += DroppedChunks.load(std::memory_order_relaxed);
+}
+
+
+void Compressor::run() {
+    for (;;) {
+        /* the chunks sealed before the stop are compressed anyway */
+        bool stop = Stop.load(std::memory_order_acquire);
+        /* the chunks of a crashed log stay where the crash handler
+         * finds them */
+        if (Ctx.Crashed.load(std::memory_order_relaxed) && !stop) {
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, nullptr);
+            continue;
+        }
+        Ctx.free_held(Unfreed, Ctx.chunks());
+        auto chunk = Sealed.dequeue();
+        if (chunk != nullptr) {
+            compress(chunk);
+            if (!Ctx.free_chunk(chunk))
+                Ctx.hold_chunk(Unfreed, chunk);
+            continue;
+        }
+        if (stop)
+            break;
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, nullptr);
+    }
+}
+
+
+/* Moves the records of the chunk into a new block; the records are wiped
+ * from the chunk, so the decoder does not find them twice */
+void Compressor::compress(MemoryBufferChunk* chunk) {
+    char* start = chunk->start_point();
+    size_t raw_size = chunk->get_fill_point() - start;
+
+    CompressedBlockHeader header;
+    header.RawSize = raw_size;
+    header.Size = lz_compress(start, raw_size, Scratch.get(), raw_size);
+    header.Method = COMPRESSION_LZ77;
+    if (header.Size == 0) {
+        memcpy(Scratch.get(), start, raw_size);
+        header.Size = raw_size;
+        header.Method = COMPRESSION_NONE;
+    }
+    for (size_t i = 0; i < header.Size; ++i)
+        Scratch[i] ^= COMPRESSED_BYTES_MASK;
+    header.Checksum = record_checksum(Scratch.get(), header.Size);
+
+    /* readers see the chunk empty before its records disappear */
+    chunk->reset();
+    memset(start, 0, raw_size);
+
+    char* place = allocate(
+        ptr_align_up<RECORD_ALIGNMENT>(BLOCK_HEADER_SIZE + header.Size));
+    if (place == nullptr) {
+        DroppedChunks.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    memcpy(place + RECORD_PREFIX_SIZE, &header, sizeof(header));
+    memcpy(place + BLOCK_HEADER_SIZE, Scratch.get(), header.Size);
+    /* like a record, the prefix is published the last */
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(place, COMPRESSED_BLOCK_PREFIX, RECORD_PREFIX_SIZE);
+
+    CompressedChunks.fetch_add(1, std::memory_order_relaxed);
+    CompressedRawBytes.fetch_add(raw_size, std::memory_order_relaxed);
+    CompressedBytes.fetch_add(header.Size, std::memory_order_relaxed);
+}
+
+
+/* A place for a block of the size at the fill point of the ring, the
+ * blocks it overlaps are evicted; nullptr if the region is too small */
+char* Compressor::allocate(size_t size) {
+    if (size > RegionSize)
+        return nullptr;
+    if (Fill + size > RegionSize) {
+        /* the blocks between the fill point and the end are the oldest */
+        while (!Blocks.empty() && Blocks.front().Offset >= Fill)
+            evict();
+        Fill = 0;
+    }
+    while (!Blocks.empty() && Blocks.front().Offset >= Fill &&
+           Blocks.front().Offset < Fill + size)
+        evict();
+
+    char* place = Region + Fill;
+    Blocks.push_back(Block{Fill, size});
+    Fill += size;
+    return place;
+}
+
+
+/* Wipes the oldest block, a partly overwritten block must not leave
+ * a valid prefix behind */
+void Compressor::evict() {
+    const Block& block = Blocks.front();
+    memset(Region + block.Offset, 0, block.Size);
+    Blocks.pop_front();
+    EvictedBlocks.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+} // namespace memorylog
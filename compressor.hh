@@ -0,0 +1,109 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "memorylog_internal.hh"
+#include "bounded_queue.hh"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <thread>
+
+
+namespace memorylog {
+
+
+/* Background compressor of full chunks. Threads seal chunks they are done
+ * with instead of returning them to the queue of free chunks, the
+ * compressor thread compresses the records of a sealed chunk into a block
+ * of the compressed region (after the format arena in the same buffer),
+ * wipes the chunk and returns it to the queue. The region is a ring:
+ * a new block overwrites the oldest ones, so the buffer keeps the raw
+ * recent records in the chunks and several times more history in the
+ * blocks. The decoder finds the blocks in a dump or a coredump and
+ * decompresses them.
+ *
+ * A thread never waits for the compressor: if the queue of free chunks
+ * is empty, it steals the oldest sealed chunk and the records in it are
+ * lost (counted as dropped). */
+class Compressor {
+public:
+    Compressor(GlobalContext& ctx, char* region, size_t region_size);
+    /* compresses the chunks sealed so far and stops the thread */
+    ~Compressor();
+
+    Compressor(const Compressor&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+
+    /* fails only if the queue of free chunks is congested; a chunk the
+     * queue of sealed chunks refuses is returned uncompressed and counted
+     * as dropped */
+    bool seal(MemoryBufferChunk* chunk);
+
+    /* the oldest sealed chunk or nullptr */
+    MemoryBufferChunk* steal();
+
+    /* counts a full chunk a thread wrote over without sealing it */
+    void drop() {
+        DroppedChunks.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void get_stats(Stats& stats) const;
+
+private:
+    struct Block {
+        size_t Offset;
+        size_t Size;
+    };
+
+    void run();
+    void compress(MemoryBufferChunk* chunk);
+    char* allocate(size_t size);
+    void evict();
+
+    GlobalContext& Ctx;
+    char* const Region;
+    size_t const RegionSize;
+
+    BoundedPtrQueue<MemoryBufferChunk*> Sealed;
+    /* compressed chunks the queue of free chunks refused, they are freed
+     * before the next one (see GlobalContext::hold_chunk) */
+    MemoryBufferChunk* Unfreed = nullptr;
+
+    /* the blocks in the region from the oldest one */
+    std::deque<Block> Blocks;
+    size_t Fill = 0;
+    std::unique_ptr<char[]> Scratch;
+
+    std::atomic<bool> Stop = {false};
+    std::atomic<size_t> CompressedChunks = {0};
+    std::atomic<size_t> CompressedRawBytes = {0};
+    std::atomic<size_t> CompressedBytes = {0};
+    std::atomic<size_t> EvictedBlocks = {0};
+    std::atomic<size_t> DroppedChunks = {0};
+
+    std::thread Thread;
+};
+
+
+} // namespace memorylog
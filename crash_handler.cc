@@ -0,0 +1,183 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "crash_handler.hh"
+#include <errno.h>
+#include <string.h>
+#include <mutex>
+#include <signal.h>
+#include <sys/uio.h>
+#include <time.h>
+
+
+namespace memorylog {
+
+
+/* iovecs of one writev, kept static: the stack of a signal handler may
+ * be a small alternate one */
+constexpr size_t CRASH_IOV_BATCH = 64;
+static struct iovec CrashIov[CRASH_IOV_BATCH];
+
+static const int CRASH_SIGNALS[] = {SIGSEGV, SIGABRT, SIGBUS};
+constexpr size_t CRASH_SIGNAL_COUNT =
+    sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0]);
+static struct sigaction PreviousActions[CRASH_SIGNAL_COUNT];
+
+enum CrashState : int {
+    CRASH_NONE,
+    CRASH_WRITING,
+    CRASH_WRITTEN,
+};
+
+static std::atomic<int> State(CRASH_NONE);
+
+
+static bool writev_all(int fd, struct iovec* iov, size_t count) {
+    while (count != 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        size_t left = written;
+        while (count != 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count != 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+
+/* Collects regions into batches of CrashIov */
+struct CrashWriter {
+    int Fd;
+    size_t Count;
+    bool Failed;
+
+    void add(const char* start, size_t size) {
+        if (size == 0)
+            return;
+        if (Count == CRASH_IOV_BATCH)
+            flush();
+        CrashIov[Count].iov_base = const_cast<char*>(start);
+        CrashIov[Count].iov_len = size;
+        ++Count;
+    }
+
+    void flush() {
+        if (Count != 0 && !writev_all(Fd, CrashIov, Count))
+            Failed = true;
+        Count = 0;
+    }
+};
+
+
+bool write_crash_image(GlobalContext& ctx, int fd) {
+    ctx.Crashed.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    CrashWriter writer = {fd, 0, false};
+    /* records below the fill point of a chunk are complete and stay as
+     * they are until the chunk is reset, which a sealed log does not do */
+    for (size_t i = 0; i < ctx.chunks(); ++i) {
+        auto chunk = ctx.chunk(i);
+        const char* start = chunk->start_point();
+        writer.add(start, chunk->end_point() - start);
+    }
+    ctx.Formats.refresh_calibration();
+    writer.add(ctx.Formats.arena(), ctx.Formats.published(0));
+    /* a block written by the compressor meanwhile fails its checksum */
+    writer.add(ctx.CompressedRegion, ctx.CompressedSize);
+    writer.flush();
+    return !writer.Failed;
+}
+
+
+static void crash_handler(int signo) {
+    int state = CRASH_NONE;
+    if (State.compare_exchange_strong(state, CRASH_WRITING)) {
+        for (size_t slot = 0; slot < MAX_LOGS; ++slot) {
+            GlobalContext* ctx = log_in_slot(slot);
+            if (ctx == nullptr)
+                continue;
+            int fd = ctx->CrashFd.load(std::memory_order_relaxed);
+            if (fd >= 0)
+                write_crash_image(*ctx, fd);
+        }
+        State.store(CRASH_WRITTEN);
+    } else {
+        /* another thread crashed too, the first one writes the logs */
+        while (State.load() == CRASH_WRITING) {
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, nullptr);
+        }
+    }
+
+    /* the signal is blocked until the handler returns, then the previous
+     * handler (or the default action) gets it; a fault repeats anyway */
+    for (size_t i = 0; i < CRASH_SIGNAL_COUNT; ++i)
+        if (CRASH_SIGNALS[i] == signo)
+            sigaction(signo, &PreviousActions[i], nullptr);
+    raise(signo);
+}
+
+
+bool install_crash_handlers() {
+    static std::mutex lock;
+    static bool installed = false;
+    std::lock_guard<std::mutex> guard(lock);
+    if (installed)
+        return true;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = crash_handler;
+    /* a stack overflow is handled if the thread has an alternate stack */
+    action.sa_flags = SA_ONSTACK;
+    /* a fault in the handler itself kills the process instead of
+     * waiting for the handler to finish */
+    sigemptyset(&action.sa_mask);
+    for (int signo : CRASH_SIGNALS)
+        sigaddset(&action.sa_mask, signo);
+
+    for (size_t i = 0; i < CRASH_SIGNAL_COUNT; ++i) {
+        if (sigaction(CRASH_SIGNALS[i], &action, &PreviousActions[i]) != 0) {
+            for (size_t j = 0; j < i; ++j)
+                sigaction(CRASH_SIGNALS[j], &PreviousActions[j], nullptr);
+            return false;
+        }
+    }
+    installed = true;
+    return true;
+}
+
+
+} // namespace memorylog
@@ -0,0 +1,48 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "memorylog_internal.hh"
+
+
+namespace memorylog {
+
+
+/* Writes the records of the log to fd with writev: the filled part of
+ * every chunk, the format arena and the compressed region, one after
+ * another without the gaps of the buffer. Records keep their alignment,
+ * so the output is decoded like a dump. The log is sealed first: writers
+ * of other threads keep their current chunks but get no new ones, so no
+ * chunk is reused while it is written out. Only async-signal-safe calls,
+ * no locks and no allocations. Returns false if a write fails. */
+bool write_crash_image(GlobalContext& ctx, int fd);
+
+/* Installs the handlers of SIGSEGV, SIGABRT and SIGBUS once per process.
+ * A handler writes every log with a crash fd (GlobalContext::CrashFd)
+ * and then re-raises the signal with the handler installed before it,
+ * so the default action (a coredump or the termination) still happens.
+ * Returns false if sigaction fails. */
+bool install_crash_handlers();
+
+
+} // namespace memorylog
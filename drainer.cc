@@ -0,0 +1,211 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "drainer.hh"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <system_error>
+
+
+namespace memorylog {
+
+
+/* chunks written with one writev call */
+constexpr size_t DRAIN_BATCH = 64;
+/* but not more than this share of the chunks: the writers have to find
+ * a free or a sealed chunk while the batch is being written */
+constexpr size_t DRAIN_BATCH_SHARE = 4;
+
+
+Drainer::Drainer(GlobalContext& ctx, const Options& options)
+    : Ctx(ctx)
+    , Path(options.DrainPath)
+    , FileSize(options.DrainFileSize)
+    , Files(options.DrainFiles)
+    , Sealed(options.TotalBufferSize / options.ChunkSize)
+    , BatchSize(std::max<size_t>(
+        1, std::min(DRAIN_BATCH, ctx.chunks() / DRAIN_BATCH_SHARE)))
+{
+    if (!open_file())
+        throw std::system_error(errno, std::generic_category(), Path);
+    Thread = std::thread(&Drainer::run, this);
+}
+
+
+Drainer::~Drainer() {
+    Stop.store(true, std::memory_order_release);
+    Thread.join();
+    if (Fd >= 0)
+        close(Fd);
+}
+
+
+bool Drainer::seal(MemoryBufferChunk* chunk) {
+    for (size_t attempt = 0; attempt < SEAL_ATTEMPTS; ++attempt)
+        if (Sealed.enqueue(chunk))
+            return true;
+    /* the records of the chunk are not drained */
+    DroppedChunks.fetch_add(1, std::memory_order_relaxed);
+    return Ctx.free_chunk(chunk);
+}
+
+
+MemoryBufferChunk* Drainer::steal() {
+    auto chunk = Sealed.dequeue();
+    if (chunk != nullptr)
+        DroppedChunks.fetch_add(1, std::memory_order_relaxed);
+    return chunk;
+}
+
+
+void Drainer::get_stats(Stats& stats) const {
+    stats.DrainedChunks = DrainedChunks.load(std::memory_order_relaxed);
+    stats.DrainedBytes = DrainedBytes.load(std::memory_order_relaxed);
+    stats.DroppedChunks = DroppedChunks.load(std::memory_order_relaxed);
+}
+
+
+void Drainer::run() {
+    for (;;) {
+        /* the chunks sealed before the stop are drained anyway */
+        bool stop = Stop.load(std::memory_order_acquire);
+        if (drain_batch())
+            continue;
+        if (stop)
+            break;
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, nullptr);
+    }
+}
+
+
+/* Returns false if there was nothing to drain */
+bool Drainer::drain_batch() {
+    MemoryBufferChunk* batch[DRAIN_BATCH];
+    struct iovec iov[DRAIN_BATCH];
+    size_t count = 0;
+    size_t bytes = 0;
+
+    Ctx.free_held(Unfreed, Ctx.chunks());
+    for (; count < BatchSize; ++count) {
+        auto chunk = Sealed.dequeue();
+        if (chunk == nullptr)
+            break;
+        batch[count] = chunk;
+        iov[count].iov_base = chunk->start_point();
+        iov[count].iov_len = chunk->get_fill_point() - chunk->start_point();
+        bytes += iov[count].iov_len;
+    }
+    if (count == 0)
+        return false;
+
+    bool written = (Fd >= 0 && FileFill < FileSize) || open_file();
+    written = written && write_formats() && write_all(iov, count);
+    if (written) {
+        FileFill += bytes;
+        DrainedChunks.fetch_add(count, std::memory_order_relaxed);
+        DrainedBytes.fetch_add(bytes, std::memory_order_relaxed);
+    } else {
+        DroppedChunks.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    for (size_t i = 0; i < count; ++i)
+        if (!Ctx.free_chunk(batch[i]))
+            Ctx.hold_chunk(Unfreed, batch[i]);
+    return true;
+}
+
+
+/* Switches to the next file and removes the oldest one */
+bool Drainer::open_file() {
+    if (Fd >= 0)
+        close(Fd);
+    Fd = -1;
+
+    auto name = Path + "." + std::to_string(FileIndex);
+    int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    if (fd < 0)
+        return false;
+
+    if (Files != 0 && FileIndex >= Files)
+        unlink((Path + "." + std::to_string(FileIndex - Files)).c_str());
+
+    ++FileIndex;
+    Fd = fd;
+    FileFill = 0;
+    FormatsWritten = 0;
+    /* every file starts with a fresh calibration of the clock */
+    Ctx.Formats.refresh_calibration();
+    return true;
+}
+
+
+/* Appends the format arena entries the file does not have yet */
+bool Drainer::write_formats() {
+    size_t published = Ctx.Formats.published(FormatsWritten);
+    if (published == FormatsWritten)
+        return true;
+
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(Ctx.Formats.arena() + FormatsWritten);
+    iov.iov_len = published - FormatsWritten;
+    if (!write_all(&iov, 1))
+        return false;
+
+    FileFill += published - FormatsWritten;
+    FormatsWritten = published;
+    return true;
+}
+
+
+bool Drainer::write_all(struct iovec* iov, size_t count) {
+    while (count != 0) {
+        ssize_t written = writev(Fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        size_t left = written;
+        while (count != 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count != 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+
+} // namespace memorylog
@@ -0,0 +1,108 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "memorylog_internal.hh"
+#include "bounded_queue.hh"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <sys/uio.h>
+
+
+namespace memorylog {
+
+
+/* Background consumer of full chunks. Threads seal chunks they are done
+ * with instead of returning them to the queue of free chunks, the drain
+ * thread writes sealed chunks to files <DrainPath>.<N> with large vector
+ * writes and then returns them to the queue. The files mirror the layout
+ * of the buffer: records keep their alignment and the format arena
+ * entries (format strings, clock calibration) are written to each file
+ * before the records that need them, so a file is decoded just like
+ * a dump.
+ *
+ * A thread never waits for the drainer: if the queue of free chunks is
+ * empty, it steals the oldest sealed chunk and the records in it are
+ * lost (counted as dropped). A batch takes at most a quarter of the
+ * chunks, and if the drainer holds the rest anyway, the thread writes
+ * over its own chunk (also counted as dropped). Throws std::system_error if the first file
+ * cannot be created. */
+class Drainer {
+public:
+    Drainer(GlobalContext& ctx, const Options& options);
+    /* drains the chunks sealed so far and stops the thread */
+    ~Drainer();
+
+    Drainer(const Drainer&) = delete;
+    Drainer& operator=(const Drainer&) = delete;
+
+    /* fails only if the queue of free chunks is congested; a chunk the
+     * queue of sealed chunks refuses is returned undrained and counted
+     * as dropped */
+    bool seal(MemoryBufferChunk* chunk);
+
+    /* the oldest sealed chunk or nullptr */
+    MemoryBufferChunk* steal();
+
+    /* counts a full chunk a thread wrote over without sealing it */
+    void drop() {
+        DroppedChunks.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void get_stats(Stats& stats) const;
+
+private:
+    void run();
+    bool drain_batch();
+    bool open_file();
+    bool write_formats();
+    bool write_all(struct iovec* iov, size_t count);
+
+    GlobalContext& Ctx;
+    std::string const Path;
+    size_t const FileSize;
+    size_t const Files;
+
+    BoundedPtrQueue<MemoryBufferChunk*> Sealed;
+    size_t const BatchSize;
+    /* written chunks the queue of free chunks refused, they are freed
+     * before the next batch (see GlobalContext::hold_chunk) */
+    MemoryBufferChunk* Unfreed = nullptr;
+
+    int Fd = -1;
+    size_t FileIndex = 0;
+    size_t FileFill = 0;
+    /* format arena bytes already written to the current file */
+    size_t FormatsWritten = 0;
+
+    std::atomic<bool> Stop = {false};
+    std::atomic<size_t> DrainedChunks = {0};
+    std::atomic<size_t> DroppedChunks = {0};
+    std::atomic<size_t> DrainedBytes = {0};
+
+    std::thread Thread;
+};
+
+
+} // namespace memorylog
@@ -0,0 +1,63 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "memorylog_decode.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+/* Prints the records from a dump file or a coredump as text, the file is
+ * scanned by several threads in parallel */
+int main(int ac, char** av) {
+    unsigned threads = 0;
+    int option;
+    while ((option = getopt(ac, av, "j:")) != -1) {
+        if (option != 'j') {
+            optind = ac;
+            break;
+        }
+        threads = strtoul(optarg, nullptr, 10);
+    }
+
+    if (optind != ac - 1) {
+        fprintf(stderr, "usage: %s [-j threads] <dump file or coredump>\n",
+                av[0]);
+        return 2;
+    }
+
+    /* the records are written by a single thread, a big buffer saves
+     * system calls */
+    static char buffer[1 << 20];
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+    if (!memorylog::extract_file(av[optind], stdout, threads)) {
+        perror(av[optind]);
+        return 1;
+    }
+    if (fflush(stdout) != 0) {
+        perror("stdout");
+        return 1;
+    }
+    return 0;
+}
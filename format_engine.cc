@@ -0,0 +1,746 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "format_engine.hh"
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+
+namespace memorylog {
+
+
+namespace {
+
+
+/* Larger precisions of floating point conversions are left to vsnprintf */
+constexpr int MAX_FLOAT_PRECISION = 400;
+/* A double below 2^64 with at most this many bits after the binary point
+ * has its integer part and its fraction in 64 bits, the fraction stays
+ * in 64 bits when multiplied by 10 for each of its digits */
+constexpr int FRACTION_BITS = 60;
+/* the digits (20 of the integer part, 60 of the fraction and the one
+ * for the rest) and the room in front of them for the leading zeros of
+ * %f and a carry of the rounding */
+constexpr size_t DIGITS_FRONT = 32;
+constexpr size_t DIGITS_SIZE = DIGITS_FRONT + 96;
+/* the text of a floating point conversion without the sign and padding */
+constexpr size_t FLOAT_TEXT_SIZE = 320 + MAX_FLOAT_PRECISION;
+
+
+const char DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+
+struct Spec {
+    bool Left = false;
+    bool Plus = false;
+    bool Space = false;
+    bool Alt = false;
+    bool Zero = false;
+    size_t Width = 0;
+    int Precision = -1;
+    /* 'H' is hh and 'q' is ll */
+    char Length = 0;
+};
+
+
+/* Writes the text up to End and counts all of its bytes */
+struct BoundedSink {
+    char* Place;
+    char* End;
+    size_t Size = 0;
+
+    BoundedSink(char* place, size_t size) : Place(place), End(place + size) {}
+
+    void put(const char* data, size_t size) {
+        Size += size;
+        size_t room = End - Place;
+        if (size > room)
+            size = room;
+        if (size != 0)
+            memcpy(Place, data, size);
+        Place += size;
+    }
+
+    void fill(char c, size_t count) {
+        Size += count;
+        size_t room = End - Place;
+        if (count > room)
+            count = room;
+        if (count != 0)
+            memset(Place, c, count);
+        Place += count;
+    }
+};
+
+
+/* Writes the text */
+struct PlaceSink {
+    char* Place;
+
+    void put(const char* data, size_t size) {
+        if (size != 0)
+            memcpy(Place, data, size);
+        Place += size;
+    }
+
+    void fill(char c, size_t count) {
+        memset(Place, c, count);
+        Place += count;
+    }
+};
+
+
+template <typename UINT>
+char* pair_digits(UINT value, char* end) {
+    while (value >= 100) {
+        unsigned pair = value % 100;
+        value /= 100;
+        end -= 2;
+        memcpy(end, DIGIT_PAIRS + 2 * pair, 2);
+    }
+    if (value >= 10) {
+        end -= 2;
+        memcpy(end, DIGIT_PAIRS + 2 * value, 2);
+    } else {
+        *--end = '0' + value;
+    }
+    return end;
+}
+
+
+/* The digits of a value are written backwards ending at end, two
+ * decimal digits per division; returns the first digit */
+char* decimal_digits(uint64_t value, char* end) {
+    /* the divisions of 32 bits are cheaper */
+    if (value <= UINT32_MAX)
+        return pair_digits(static_cast<uint32_t>(value), end);
+    return pair_digits(value, end);
+}
+
+
+char* hex_digits(uint64_t value, char* end, bool upper) {
+    const char* alphabet = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    do {
+        *--end = alphabet[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+    return end;
+}
+
+
+char* octal_digits(uint64_t value, char* end) {
+    do {
+        *--end = '0' + (value & 7);
+        value >>= 3;
+    } while (value != 0);
+    return end;
+}
+
+
+/* Pads the field to the width: spaces before it, zeros between the
+ * prefix (a sign or "0x") and the body if zero_pad, spaces after it
+ * with '-'. zeros are the zeros a precision adds before the body. */
+template <typename SINK>
+void emit_field(
+    SINK& sink, const Spec& spec, const char* prefix, size_t prefix_size,
+    size_t zeros, const char* body, size_t body_size, bool zero_pad)
+{
+    size_t size = prefix_size + zeros + body_size;
+    size_t pad = spec.Width > size ? spec.Width - size : 0;
+    zero_pad = zero_pad && spec.Zero && !spec.Left;
+    if (!spec.Left && !zero_pad)
+        sink.fill(' ', pad);
+    sink.put(prefix, prefix_size);
+    if (zero_pad)
+        sink.fill('0', pad);
+    sink.fill('0', zeros);
+    sink.put(body, body_size);
+    if (spec.Left)
+        sink.fill(' ', pad);
+}
+
+
+template <typename SINK>
+void emit_integer(
+    SINK& sink, const Spec& spec, char conversion, uint64_t value,
+    const char* prefix, size_t prefix_size)
+{
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    char* begin = end;
+    /* a zero with zero precision has no digits */
+    if (value != 0 || spec.Precision != 0) {
+        if (conversion == 'x' || conversion == 'X' || conversion == 'p')
+            begin = hex_digits(value, end, conversion == 'X');
+        else if (conversion == 'o')
+            begin = octal_digits(value, end);
+        else
+            begin = decimal_digits(value, end);
+    }
+    size_t digits = end - begin;
+    size_t zeros = spec.Precision > (int)digits ? spec.Precision - digits : 0;
+    /* '#' makes the first digit of an octal number a zero */
+    if (conversion == 'o' && spec.Alt && zeros == 0 &&
+        (digits == 0 || *begin != '0'))
+        zeros = 1;
+    emit_field(sink, spec, prefix, prefix_size, zeros, begin, digits,
+               spec.Precision < 0);
+}
+
+
+/* The decimal digits of a double: Count digits, the first Point of them
+ * before the decimal point (Point may be negative or larger than Count);
+ * digits past Count are zeros. The digits are exact as far as the
+ * conversion needs them, a '1' after them stands for the rest of the
+ * value if it is not zero, so the rounding comes out as with all of the
+ * exact digits. */
+struct Decimal {
+    char Buffer[DIGITS_SIZE];
+    char* Digits;
+    int Count;
+    int Point;
+
+    bool assign(double value, int fraction, int significant);
+
+    char digit(int index) const {
+        return index < Count ? Digits[index] : '0';
+    }
+
+    void prepend(char digit, int count) {
+        Digits -= count;
+        memset(Digits, digit, count);
+        Count += count;
+        Point += count;
+    }
+
+    void round(int keep);
+};
+
+
+/* Takes the digits of the value up to fraction digits after the decimal
+ * point and significant digits from the first non-zero one, whichever
+ * are more. Returns false for a value out of the fixed point range. */
+bool Decimal::assign(double value, int fraction, int significant) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint64_t mantissa = bits & ((1ull << 52) - 1);
+    int exponent = (bits >> 52) & 0x7ff;
+    if (exponent == 0)
+        exponent = -1074;
+    else {
+        mantissa |= 1ull << 52;
+        exponent -= 1075;
+    }
+
+    Digits = Buffer + DIGITS_FRONT;
+    if (mantissa == 0) {
+        Digits[0] = '0';
+        Count = 1;
+        Point = 1;
+        return true;
+    }
+    while ((mantissa & 1) == 0) {
+        mantissa >>= 1;
+        ++exponent;
+    }
+
+    uint64_t integer = mantissa;
+    int point_bits = 0;
+    if (exponent >= 0) {
+        if (exponent >= 64 || mantissa > UINT64_MAX >> exponent)
+            return false;
+        integer = mantissa << exponent;
+    } else {
+        if (exponent < -FRACTION_BITS)
+            return false;
+        point_bits = -exponent;
+        integer = mantissa >> point_bits;
+    }
+    uint64_t mask = (1ull << point_bits) - 1;
+    uint64_t rest = mantissa & mask;
+
+    Count = 0;
+    Point = 0;
+    if (integer != 0) {
+        char buf[24];
+        char* end = buf + sizeof(buf);
+        char* begin = decimal_digits(integer, end);
+        Count = end - begin;
+        Point = Count;
+        memcpy(Digits, begin, Count);
+    }
+    for (int taken = 0; rest != 0; ++taken) {
+        if (taken >= fraction && Count >= significant) {
+            Digits[Count++] = '1';
+            break;
+        }
+        rest *= 10;
+        char digit = '0' + (rest >> point_bits);
+        rest &= mask;
+        if (Count == 0 && digit == '0')
+            --Point;
+        else
+            Digits[Count++] = digit;
+    }
+    return true;
+}
+
+
+/* Keeps the first keep >= 1 digits, rounding half to even like glibc
+ * in the default rounding mode; a carry out of the first digit puts
+ * a '1' in front */
+void Decimal::round(int keep) {
+    if (keep >= Count)
+        return;
+    char first = Digits[keep];
+    bool up = first > '5';
+    if (first == '5') {
+        for (int i = keep + 1; i < Count && !up; ++i)
+            up = Digits[i] != '0';
+        if (!up)
+            up = (Digits[keep - 1] - '0') % 2 == 1;
+    }
+    Count = keep;
+    if (!up)
+        return;
+
+    int i = keep - 1;
+    while (i >= 0 && Digits[i] == '9')
+        Digits[i--] = '0';
+    if (i >= 0)
+        ++Digits[i];
+    else
+        prepend('1', 1);
+}
+
+
+/* %f with the given precision, returns the end of the text */
+char* fixed_text(Decimal& decimal, int precision, bool alt, char* out) {
+    if (decimal.Point < 1)
+        decimal.prepend('0', 1 - decimal.Point);
+    decimal.round(decimal.Point + precision);
+    for (int i = 0; i < decimal.Point; ++i)
+        *out++ = decimal.digit(i);
+    if (precision > 0 || alt)
+        *out++ = '.';
+    for (int i = 0; i < precision; ++i)
+        *out++ = decimal.digit(decimal.Point + i);
+    return out;
+}
+
+
+/* %e with the given precision, the digits are rounded already */
+char* exponent_text(
+    const Decimal& decimal, int precision, bool alt, bool upper, char* out)
+{
+    *out++ = decimal.digit(0);
+    if (precision > 0 || alt)
+        *out++ = '.';
+    for (int i = 1; i <= precision; ++i)
+        *out++ = decimal.digit(i);
+    *out++ = upper ? 'E' : 'e';
+
+    int exponent = decimal.Digits[0] == '0' ? 0 : decimal.Point - 1;
+    *out++ = exponent < 0 ? '-' : '+';
+    unsigned magnitude = exponent < 0 ? -exponent : exponent;
+    if (magnitude < 10)
+        *out++ = '0';
+    char buf[8];
+    char* end = buf + sizeof(buf);
+    char* begin = decimal_digits(magnitude, end);
+    memcpy(out, begin, end - begin);
+    return out + (end - begin);
+}
+
+
+/* Returns false if the conversion is left to vsnprintf */
+template <typename SINK>
+bool emit_float(SINK& sink, const Spec& spec, char conversion, double value) {
+    char lower = conversion | 0x20;
+    bool upper = conversion != lower;
+    int precision = spec.Precision < 0 ? 6 : spec.Precision;
+    if (precision > MAX_FLOAT_PRECISION)
+        return false;
+
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    char sign = 0;
+    if (bits >> 63)
+        sign = '-';
+    else if (spec.Plus)
+        sign = '+';
+    else if (spec.Space)
+        sign = ' ';
+
+    if (value != value || value - value != 0) {
+        const char* text = value != value
+            ? (upper ? "NAN" : "nan") : (upper ? "INF" : "inf");
+        emit_field(sink, spec, &sign, sign != 0, 0, text, 3, false);
+        return true;
+    }
+
+    /* rounding looks at one digit past the ones the text shows; the
+     * exact digits of a value far from 1 take a big number arithmetic,
+     * such a value is left to vsnprintf */
+    Decimal decimal;
+    bool fixed = lower == 'f';
+    if (!decimal.assign(value, fixed ? precision + 1 : 0,
+                        fixed ? 1 : precision + 2))
+        return false;
+    char text[FLOAT_TEXT_SIZE];
+    char* end;
+    if (fixed) {
+        end = fixed_text(decimal, precision, spec.Alt, text);
+    } else if (lower == 'e') {
+        decimal.round(precision + 1);
+        end = exponent_text(decimal, precision, spec.Alt, upper, text);
+    } else {
+        /* %g: %e or %f with precision significant digits, whichever
+         * suits the exponent, without the trailing zeros */
+        if (precision == 0)
+            precision = 1;
+        decimal.round(precision);
+        int exponent = decimal.Digits[0] == '0' ? 0 : decimal.Point - 1;
+        char* exponent_start;
+        if (exponent < precision && exponent >= -4) {
+            end = fixed_text(
+                decimal, precision - 1 - exponent, spec.Alt, text);
+            exponent_start = end;
+        } else {
+            end = exponent_text(
+                decimal, precision - 1, spec.Alt, upper, text);
+            exponent_start = static_cast<char*>(
+                memchr(text, upper ? 'E' : 'e', end - text));
+        }
+        if (!spec.Alt && memchr(text, '.', exponent_start - text)) {
+            char* last = exponent_start;
+            while (last[-1] == '0')
+                --last;
+            if (last[-1] == '.')
+                --last;
+            memmove(last, exponent_start, end - exponent_start);
+            end -= exponent_start - last;
+        }
+    }
+    emit_field(sink, spec, &sign, sign != 0, 0, text, end - text, true);
+    return true;
+}
+
+
+int64_t signed_value(char length, va_list* args) {
+    switch (length) {
+    case 'H':
+        return static_cast<signed char>(va_arg(*args, int));
+    case 'h':
+        return static_cast<short>(va_arg(*args, int));
+    case 'l':
+        return va_arg(*args, long);
+    case 'q':
+        return va_arg(*args, long long);
+    case 'j':
+        return va_arg(*args, intmax_t);
+    case 'z':
+        return va_arg(*args, ssize_t);
+    case 't':
+        return va_arg(*args, ptrdiff_t);
+    default:
+        return va_arg(*args, int);
+    }
+}
+
+
+uint64_t unsigned_value(char length, va_list* args) {
+    switch (length) {
+    case 'H':
+        return static_cast<unsigned char>(va_arg(*args, unsigned));
+    case 'h':
+        return static_cast<unsigned short>(va_arg(*args, unsigned));
+    case 'l':
+        return va_arg(*args, unsigned long);
+    case 'q':
+        return va_arg(*args, unsigned long long);
+    case 'j':
+        return va_arg(*args, uintmax_t);
+    case 'z':
+        return va_arg(*args, size_t);
+    case 't':
+        return static_cast<uint64_t>(va_arg(*args, ptrdiff_t));
+    default:
+        return va_arg(*args, unsigned);
+    }
+}
+
+
+/* A width or a precision: digits or '*'. Returns false for a positional
+ * argument. */
+bool parse_number(const char*& pos, va_list* args, int& value, bool& star) {
+    star = *pos == '*';
+    if (star) {
+        ++pos;
+        value = va_arg(*args, int);
+        return *pos != '$' && !(*pos >= '0' && *pos <= '9');
+    }
+    value = 0;
+    while (*pos >= '0' && *pos <= '9')
+        value = value * 10 + (*pos++ - '0');
+    return *pos != '$';
+}
+
+
+/* A conversion without flags, width and precision, which most of the
+ * conversions of log formats are: d i u x of an int, a long or a size_t
+ * and s. Returns false for any other, pos is not moved then. */
+template <typename SINK>
+bool emit_plain(SINK& sink, const char*& pos, va_list* args) {
+    const char* conversion = pos;
+    char length = 0;
+    if (*conversion == 'l' || *conversion == 'z')
+        length = *conversion++;
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    char* begin;
+    switch (*conversion) {
+    case 'd':
+    case 'i': {
+        int64_t value = signed_value(length, args);
+        begin = decimal_digits(
+            value < 0 ? 0 - static_cast<uint64_t>(value) : value, end);
+        if (value < 0)
+            *--begin = '-';
+        break;
+    }
+    case 'u':
+        begin = decimal_digits(unsigned_value(length, args), end);
+        break;
+    case 'x':
+        begin = hex_digits(unsigned_value(length, args), end, false);
+        break;
+    case 's': {
+        if (length != 0)
+            return false;
+        const char* value = va_arg(*args, const char*);
+        if (value == nullptr)
+            value = "(null)";
+        sink.put(value, strlen(value));
+        pos = conversion + 1;
+        return true;
+    }
+    default:
+        return false;
+    }
+    sink.put(begin, end - begin);
+    pos = conversion + 1;
+    return true;
+}
+
+
+/* Returns false at the first conversion the engine does not do, the
+ * text is incomplete then */
+template <typename SINK>
+bool format_with(SINK& sink, const char* format, va_list* args) {
+    const char* pos = format;
+    for (;;) {
+        /* the literal runs between conversions are short, a loop finds
+         * their end faster than strchr and strlen calls */
+        const char* literal = pos;
+        while (*pos != '%' && *pos != '\0')
+            ++pos;
+        sink.put(literal, pos - literal);
+        if (*pos++ == '\0')
+            return true;
+        if (*pos == '%') {
+            sink.put(pos++, 1);
+            continue;
+        }
+
+        /* the spec is parsed only if there is more to it */
+        if (emit_plain(sink, pos, args))
+            continue;
+
+        Spec spec;
+        for (;; ++pos) {
+            if (*pos == '-')
+                spec.Left = true;
+            else if (*pos == '+')
+                spec.Plus = true;
+            else if (*pos == ' ')
+                spec.Space = true;
+            else if (*pos == '#')
+                spec.Alt = true;
+            else if (*pos == '0')
+                spec.Zero = true;
+            else
+                break;
+        }
+
+        int width;
+        bool star;
+        if (!parse_number(pos, args, width, star))
+            return false;
+        if (width < 0) {
+            /* a negative '*' width is the '-' flag */
+            spec.Left = true;
+            width = -width;
+        }
+        spec.Width = width;
+        if (*pos == '.') {
+            ++pos;
+            if (!parse_number(pos, args, spec.Precision, star))
+                return false;
+            if (spec.Precision < 0)
+                spec.Precision = -1;
+        }
+
+        switch (*pos) {
+        case 'h':
+            spec.Length = *++pos == 'h' ? (++pos, 'H') : 'h';
+            break;
+        case 'l':
+            spec.Length = *++pos == 'l' ? (++pos, 'q') : 'l';
+            break;
+        case 'q':
+        case 'j':
+        case 'z':
+        case 't':
+            spec.Length = *pos++;
+            break;
+        case 'Z':
+            spec.Length = 'z';
+            ++pos;
+            break;
+        case 'L':
+            /* long double */
+            return false;
+        }
+
+        char conversion = *pos++;
+        switch (conversion) {
+        case 'd':
+        case 'i': {
+            int64_t value = signed_value(spec.Length, args);
+            uint64_t magnitude = value < 0
+                ? 0 - static_cast<uint64_t>(value) : value;
+            char sign = 0;
+            if (value < 0)
+                sign = '-';
+            else if (spec.Plus)
+                sign = '+';
+            else if (spec.Space)
+                sign = ' ';
+            emit_integer(sink, spec, 'd', magnitude, &sign, sign != 0);
+            break;
+        }
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X': {
+            uint64_t value = unsigned_value(spec.Length, args);
+            const char* prefix = conversion == 'X' ? "0X" : "0x";
+            bool alt_prefix = spec.Alt && value != 0 &&
+                (conversion == 'x' || conversion == 'X');
+            emit_integer(sink, spec, conversion, value,
+                         prefix, alt_prefix ? 2 : 0);
+            break;
+        }
+        case 'c': {
+            if (spec.Length == 'l')
+                return false;
+            char value = static_cast<char>(va_arg(*args, int));
+            emit_field(sink, spec, nullptr, 0, 0, &value, 1, false);
+            break;
+        }
+        case 's': {
+            if (spec.Length == 'l')
+                return false;
+            const char* value = va_arg(*args, const char*);
+            if (value == nullptr)
+                value = spec.Precision < 0 || spec.Precision >= 6
+                    ? "(null)" : "";
+            size_t size = spec.Precision < 0
+                ? strlen(value) : strnlen(value, spec.Precision);
+            emit_field(sink, spec, nullptr, 0, 0, value, size, false);
+            break;
+        }
+        case 'p': {
+            const void* value = va_arg(*args, const void*);
+            if (value == nullptr) {
+                emit_field(sink, spec, nullptr, 0, 0, "(nil)", 5, false);
+                break;
+            }
+            emit_integer(sink, spec, 'p', reinterpret_cast<uintptr_t>(value),
+                         "0x", 2);
+            break;
+        }
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+            if (!emit_float(sink, spec, conversion, va_arg(*args, double)))
+                return false;
+            break;
+        default:
+            return false;
+        }
+    }
+}
+
+
+} // anonymous namespace
+
+
+ptrdiff_t format_text(char* place, size_t size, const char* format,
+                      va_list args)
+{
+    va_list local;
+    va_copy(local, args);
+    BoundedSink sink(place, size);
+    bool done = format_with(sink, format, &local);
+    va_end(local);
+    return done ? static_cast<ptrdiff_t>(sink.Size) : -1;
+}
+
+
+char* format_to(char* place, const char* format, va_list args) {
+    va_list local;
+    va_copy(local, args);
+    PlaceSink sink = {place};
+    format_with(sink, format, &local);
+    va_end(local);
+    return sink.Place;
+}
+
+
+} // namespace memorylog
@@ -0,0 +1,53 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include <stdarg.h>
+#include <stddef.h>
+
+
+namespace memorylog {
+
+
+/* printf formatting of log records without the libc stdio. The engine
+ * does the conversions d i u o x X c s p and f F e E g G (of doubles
+ * below 2^64 with up to 60 bits after the binary point, which covers
+ * about 0.004 and up, correctly rounded like glibc does) with the flags
+ * "-+ #0", width, precision (also '*') and the length modifiers
+ * hh h l ll q j z Z t. A format with anything else (other doubles,
+ * positional arguments, %a, %n, %m, long double, wide characters, the '
+ * flag) is not done, the caller falls back to vsnprintf. */
+
+/* Writes up to size bytes of the text, without a terminating zero, and
+ * returns the size of the whole text like vsnprintf does, so the text
+ * is measured and, if it fits, formatted in one pass. Returns -1 if the
+ * format is not done by the engine. */
+ptrdiff_t format_text(char* place, size_t size, const char* format,
+                      va_list args);
+
+/* Writes the whole text measured by format_text, without a terminating
+ * zero; returns the end of the text */
+char* format_to(char* place, const char* format, va_list args);
+
+
+} // namespace memorylog
@@ -0,0 +1,219 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "lz_codec.hh"
+#include <stdint.h>
+#include <string.h>
+
+
+namespace memorylog {
+
+
+constexpr unsigned LZ_HASH_BITS = 12;
+constexpr size_t LZ_MAX_OFFSET = 65535;
+/* a match never covers the last bytes, so the stream always ends with
+ * literals and the match search never reads past the input */
+constexpr size_t LZ_LAST_LITERALS = 5;
+
+
+static uint32_t read32(const unsigned char* pos) {
+    uint32_t value;
+    memcpy(&value, pos, sizeof(value));
+    return value;
+}
+
+
+static unsigned lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+
+namespace {
+
+
+class LzWriter {
+public:
+    LzWriter(char* dst, size_t capacity)
+        : Pos(reinterpret_cast<unsigned char*>(dst))
+        , End(Pos + capacity)
+    {}
+
+    /* literals and, if match_length is not 0, a match */
+    bool sequence(const unsigned char* literals, size_t literals_length,
+                  size_t offset, size_t match_length)
+    {
+        if (Pos == End)
+            return false;
+        unsigned char* token = Pos++;
+        size_t match_code =
+            match_length == 0 ? 0 : match_length - LZ_MIN_MATCH;
+        *token = (literals_length < 15 ? literals_length : 15) << 4 |
+            (match_code < 15 ? match_code : 15);
+
+        if (literals_length >= 15 && !length(literals_length - 15))
+            return false;
+        if ((size_t)(End - Pos) < literals_length)
+            return false;
+        memcpy(Pos, literals, literals_length);
+        Pos += literals_length;
+
+        if (match_length == 0)
+            return true;
+        if (End - Pos < 2)
+            return false;
+        *Pos++ = offset & 0xff;
+        *Pos++ = offset >> 8;
+        return match_code < 15 || length(match_code - 15);
+    }
+
+    unsigned char* position() const {
+        return Pos;
+    }
+
+private:
+    bool length(size_t value) {
+        for (;;) {
+            if (Pos == End)
+                return false;
+            if (value < 255) {
+                *Pos++ = value;
+                return true;
+            }
+            *Pos++ = 255;
+            value -= 255;
+        }
+    }
+
+    unsigned char* Pos;
+    unsigned char* const End;
+};
+
+
+} // anonymous namespace
+
+
+size_t lz_compress(const char* src, size_t size, char* dst, size_t capacity) {
+    auto input = reinterpret_cast<const unsigned char*>(src);
+    LzWriter writer(dst, capacity);
+    size_t anchor = 0;
+
+    if (size > LZ_MIN_MATCH + LZ_LAST_LITERALS) {
+        /* positions + 1, 0 is an empty slot */
+        uint32_t table[1 << LZ_HASH_BITS] = {};
+        const size_t match_limit = size - LZ_LAST_LITERALS;
+        size_t pos = 0;
+
+        while (pos + LZ_MIN_MATCH <= match_limit) {
+            uint32_t sequence = read32(input + pos);
+            uint32_t& slot = table[lz_hash(sequence)];
+            size_t candidate = slot;
+            slot = pos + 1;
+            if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_OFFSET ||
+                read32(input + candidate - 1) != sequence)
+            {
+                /* skip faster through data that does not compress */
+                pos += 1 + ((pos - anchor) >> 6);
+                continue;
+            }
+
+            size_t match = candidate - 1;
+            size_t length = LZ_MIN_MATCH;
+            while (pos + length < match_limit &&
+                   input[match + length] == input[pos + length])
+                ++length;
+            if (!writer.sequence(input + anchor, pos - anchor,
+                                 pos - match, length))
+                return 0;
+            pos += length;
+            anchor = pos;
+        }
+    }
+
+    if (!writer.sequence(input + anchor, size - anchor, 0, 0))
+        return 0;
+    return writer.position() - reinterpret_cast<unsigned char*>(dst);
+}
+
+
+static bool read_length(
+    const unsigned char*& pos, const unsigned char* end, size_t& value)
+{
+    for (;;) {
+        if (pos == end)
+            return false;
+        unsigned char byte = *pos++;
+        value += byte;
+        if (byte != 255)
+            return true;
+    }
+}
+
+
+bool lz_decompress(const char* src, size_t size, char* dst, size_t raw_size) {
+    const unsigned char* pos = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* const end = pos + size;
+    unsigned char* const out_start = reinterpret_cast<unsigned char*>(dst);
+    unsigned char* const out_end = out_start + raw_size;
+    unsigned char* out = out_start;
+
+    while (pos < end) {
+        unsigned token = *pos++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !read_length(pos, end, literals))
+            return false;
+        if ((size_t)(end - pos) < literals ||
+            (size_t)(out_end - out) < literals)
+            return false;
+        memcpy(out, pos, literals);
+        pos += literals;
+        out += literals;
+        if (pos == end)
+            break;
+
+        if (end - pos < 2)
+            return false;
+        size_t offset = pos[0] | (size_t)pos[1] << 8;
+        pos += 2;
+        size_t length = token & 15;
+        if (length == 15 && !read_length(pos, end, length))
+            return false;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(out - out_start) ||
+            (size_t)(out_end - out) < length)
+            return false;
+
+        /* the match may overlap the bytes it produces */
+        const unsigned char* match = out - offset;
+        if (offset >= length) {
+            memcpy(out, match, length);
+            out += length;
+        } else {
+            for (size_t i = 0; i < length; ++i)
+                *out++ = match[i];
+        }
+    }
+    return out == out_end;
+}
+
+
+} // namespace memorylog
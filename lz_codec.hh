@@ -0,0 +1,56 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+
+
+/* A small LZ77 codec for chunks of log records in the spirit of LZ4:
+ * byte oriented, a hash table of 4 bytes sequences and no entropy coding,
+ * so both directions run at hundreds of MB/s and the repeated parts of
+ * log records (prefixes, format strings, field names) shrink a lot.
+ *
+ * The compressed stream is a list of sequences. A sequence is a token
+ * byte (the number of literals in the high 4 bits, the match length minus
+ * LZ_MIN_MATCH in the low 4 bits, 15 means that bytes of 255 and a final
+ * byte below 255 are added to it), the literals, a 2 bytes little endian
+ * offset of the match back from the current position and the additional
+ * bytes of the match length. The last sequence has literals only. */
+
+
+namespace memorylog {
+
+
+constexpr size_t LZ_MIN_MATCH = 4;
+
+
+/* Compresses size bytes of src into dst, returns the size of the result
+ * or 0 if it does not fit into capacity bytes */
+size_t lz_compress(const char* src, size_t size, char* dst, size_t capacity);
+
+/* Decompresses a whole stream of size bytes, returns false if the stream
+ * is malformed or does not give exactly raw_size bytes */
+bool lz_decompress(const char* src, size_t size, char* dst, size_t raw_size);
+
+
+} // namespace memorylog
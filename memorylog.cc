@@ -23,160 +23,763 @@ SOFTWARE.
 
 #include "memorylog.hh"
 #include <new>
-#include "mt_ring_queue.hh"
+#include "memorylog_internal.hh"
+#include "drainer.hh"
+#include "compressor.hh"
+#include "chunk_dumper.hh"
+#include "crash_handler.hh"
+#include "format_engine.hh"
+#include "tsc_clock.hh"
+#include <algorithm>
 #include <memory>
+#include <mutex>
 #include <stdarg.h>
+#include <stdexcept>
+#include <string>
 #include <stdio.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 
 namespace memorylog {
 
 
-constexpr size_t PAGE_SIZE = 4096;
-constexpr size_t RECORD_PREFIX_SIZE = 16;
-constexpr size_t RECORD_ALIGNMENT = 16;
-
-/* This is a magic string at the begining of each record */
-static const char RECORD_PREFIX[RECORD_PREFIX_SIZE] = {
-   '\n', 'i', 'P', 'a', 'o', '2', 'i', 'j',
-    'S', 'a', 'h', 'b', 'e', '0', 'F', ' ',
-};
+FormatRegistry::FormatRegistry(char* arena, size_t arena_size)
+    : Arena(arena)
+    , ArenaSize(arena_size)
+    , Slots(new std::atomic<uintptr_t>[FORMAT_REGISTRY_SLOTS])
+{
+    for (size_t i = 0; i < FORMAT_REGISTRY_SLOTS; ++i)
+        Slots[i].store(0, std::memory_order_relaxed);
+}
 
 
-template <uintptr_t ALIGNMENT, typename PTR_TYPE>
-static PTR_TYPE ptr_align_up(PTR_TYPE value) {
-    constexpr uintptr_t MASK = ALIGNMENT - 1;
-    static_assert((ALIGNMENT & MASK) == 0, "invalid alignment");
-    uintptr_t cvalue = reinterpret_cast<uintptr_t>(value);
-    return reinterpret_cast<PTR_TYPE>((cvalue + MASK) & ~MASK);
+void FormatRegistry::add(const char* format) {
+    uintptr_t address = reinterpret_cast<uintptr_t>(format);
+    size_t slot = (address >> 3) * 0x9E3779B97F4A7C15ull;
+
+    for (size_t probe = 0; probe < FORMAT_REGISTRY_SLOTS; ++probe, ++slot) {
+        auto& entry = Slots[slot % FORMAT_REGISTRY_SLOTS];
+        uintptr_t known = entry.load(std::memory_order_relaxed);
+        if (known == address)
+            return;
+        if (known != 0)
+            continue;
+        if (entry.compare_exchange_strong(known, address)) {
+            store(format);
+            return;
+        }
+        if (known == address)
+            return;
+    }
+    /* the registry is full, records with this format will be decoded
+     * without the format string */
 }
 
 
-class MemoryBufferChunk {
-public:
-    void reset() {
-        fill_point = ptr_align_up<RECORD_ALIGNMENT>(
-            reinterpret_cast<char*>(this) + sizeof(*this));
+const char* FormatRegistry::find(uint64_t address) const {
+    if (address == 0)
+        return nullptr;
+    size_t slot = (address >> 3) * 0x9E3779B97F4A7C15ull;
+
+    /* add takes the first free slot on the way, so the format is not
+     * added if a free slot comes before it */
+    for (size_t probe = 0; probe < FORMAT_REGISTRY_SLOTS; ++probe, ++slot) {
+        uintptr_t known =
+            Slots[slot % FORMAT_REGISTRY_SLOTS].load(std::memory_order_acquire);
+        if (known == address)
+            return reinterpret_cast<const char*>(known);
+        if (known == 0)
+            return nullptr;
     }
+    return nullptr;
+}
 
-    bool out_of_space(size_t chunk_size, size_t record_len) const {
-        size_t space_left =
-            chunk_size + reinterpret_cast<const char*>(this) - fill_point;
-        return record_len + RECORD_PREFIX_SIZE > space_left;
+
+void FormatRegistry::store(const char* format) {
+    size_t length = strlen(format);
+    FormatEntryHeader header;
+    header.Address = reinterpret_cast<uintptr_t>(format);
+    header.Length = length;
+    header.Reserved = 0;
+    append(FORMAT_ENTRY_PREFIX, &header, sizeof(header), format, length + 1);
+}
+
+
+bool FormatRegistry::add_schema(
+    uint32_t id, const detail::SchemaInfo& schema)
+{
+    size_t length = strlen(schema.Format);
+    SchemaEntryHeader header;
+    header.Id = id;
+    header.Fields = schema.FieldCount;
+    header.Length = length;
+    header.Reserved = 0;
+    std::string data(
+        reinterpret_cast<const char*>(schema.Types), schema.FieldCount);
+    data.append(schema.Format, length + 1);
+    return append(SCHEMA_ENTRY_PREFIX, &header, sizeof(header),
+                  data.data(), data.size()) != nullptr;
+}
+
+
+/* Returns the place of the entry header or nullptr if the arena is full */
+char* FormatRegistry::append(
+    const char* prefix, const void* header, size_t header_size,
+    const char* data, size_t data_size)
+{
+    size_t entry_size = ptr_align_up<RECORD_ALIGNMENT>(
+        RECORD_PREFIX_SIZE + header_size + data_size);
+
+    size_t offset = ArenaFill.fetch_add(entry_size);
+    if (offset + entry_size > ArenaSize)
+        return nullptr;
+
+    char* place = Arena + offset;
+    memcpy(place + RECORD_PREFIX_SIZE, header, header_size);
+    if (data_size != 0)
+        memcpy(place + RECORD_PREFIX_SIZE + header_size, data, data_size);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    memcpy(place, prefix, RECORD_PREFIX_SIZE);
+    return place + RECORD_PREFIX_SIZE;
+}
+
+
+static void sample_clock(ClockCalibration& calibration, int sample) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    calibration.Ticks[sample] = read_clock();
+    calibration.Nanoseconds[sample] = now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+void FormatRegistry::store_calibration() {
+    ClockCalibration calibration;
+    sample_clock(calibration, 0);
+    /* a couple of milliseconds give the rate good enough to start with */
+    struct timespec pause = {0, 2000000};
+    nanosleep(&pause, nullptr);
+    sample_clock(calibration, 1);
+    append(CLOCK_ENTRY_PREFIX, &calibration, sizeof(calibration), nullptr, 0);
+}
+
+
+void FormatRegistry::refresh_calibration() {
+    if (record_kind(Arena) != RECORD_KIND_CLOCK)
+        return;
+    ClockCalibration calibration;
+    memcpy(&calibration, Arena + RECORD_PREFIX_SIZE, sizeof(calibration));
+    sample_clock(calibration, 1);
+    memcpy(Arena + RECORD_PREFIX_SIZE, &calibration, sizeof(calibration));
+}
+
+
+size_t FormatRegistry::published(size_t offset) const {
+    size_t fill = std::min(ArenaFill.load(), ArenaSize);
+    while (offset + RECORD_PREFIX_SIZE <= fill) {
+        const char* entry = Arena + offset;
+        size_t entry_size = RECORD_PREFIX_SIZE;
+        switch (record_kind(entry)) {
+        case RECORD_KIND_FORMAT: {
+            FormatEntryHeader header;
+            memcpy(&header, entry + RECORD_PREFIX_SIZE, sizeof(header));
+            entry_size += sizeof(header) + header.Length + 1;
+            break;
+        }
+        case RECORD_KIND_SCHEMA_ENTRY: {
+            SchemaEntryHeader header;
+            memcpy(&header, entry + RECORD_PREFIX_SIZE, sizeof(header));
+            entry_size += sizeof(header) + header.Fields + header.Length + 1;
+            break;
+        }
+        case RECORD_KIND_CLOCK:
+            entry_size += sizeof(ClockCalibration);
+            break;
+        default:
+            return offset;
+        }
+        offset += ptr_align_up<RECORD_ALIGNMENT>(entry_size);
     }
+    return offset;
+}
+
+
+class TLSChunkHolder {
+public:
+    inline MemoryBufferChunk* reset(GlobalContext* ctx);
+    inline MemoryBufferChunk* get(GlobalContext* ctx);
+    inline void write_header(char* place);
 
-    size_t available_space(size_t chunk_size) const {
-        return chunk_size + reinterpret_cast<const char*>(this) - fill_point;
+    MemoryBufferChunk* current() const {
+        return Chunk;
     }
 
-    bool empty() const {
-        auto start_point = ptr_align_up<RECORD_ALIGNMENT>(
-            reinterpret_cast<const char*>(this) + sizeof(*this));
-        return fill_point == start_point;
+    /* the current chunk is released by the caller, the held ones are
+     * returned */
+    void detach(GlobalContext* ctx) {
+        Chunk = nullptr;
+        while (auto chunk = ctx->take_held(Held))
+            ctx->return_chunk(chunk);
     }
 
-    void fill_up_to(char* new_fill_point) {
-        fill_point = ptr_align_up<RECORD_ALIGNMENT>(new_fill_point);
+    /* Only the thread of the holder changes the counters, a relaxed load
+     * and store cost as much as a plain increment */
+    void count(WriteCounter counter, uint64_t value = 1) {
+        auto& total = Counters[counter];
+        total.store(total.load(std::memory_order_relaxed) + value,
+                    std::memory_order_relaxed);
     }
 
-    char* get_fill_point() const {
-        return fill_point;
+    uint64_t counter(WriteCounter counter) const {
+        return Counters[counter].load(std::memory_order_relaxed);
     }
 
 private:
-    char* fill_point;
-};
+    friend class TLSChunkTable;
 
+    inline void adapt(const GlobalContext* ctx);
 
-struct GlobalContext {
-    std::unique_ptr<char[]> const BigBuffer;
-    size_t const ChunkSize;
-    size_t const TotalSize;
-    RingPtrQueue<MemoryBufferChunk*, false> Queue;
-
-    GlobalContext(size_t total_buffer_size, size_t chunk_size);
+    MemoryBufferChunk* Chunk = nullptr;
+    /* full chunks the queue refused, see GlobalContext::hold_chunk */
+    MemoryBufferChunk* Held = nullptr;
+    /* the size class of the next chunk and when the thread got the current
+     * one, see Options::LargeChunkSize */
+    bool Large = false;
+    uint64_t TakenAt = 0;
+    /* GlobalContext::Id of the log the chunk belongs to, thread_stats
+     * of other threads read it */
+    std::atomic<uint64_t> Owner = {0};
+    uint32_t ThreadId = 0;
+    uint32_t Sequence = 0;
+    std::atomic<uint64_t> Counters[WRITE_COUNTERS] = {};
 };
 
 
-class TLSChunkHolder {
+/* Chunks of a thread, one per log, indexed by GlobalContext::Slot. A slot
+ * is reused by another log after a log is destroyed, so an entry is valid
+ * only if its owner is the log of the slot. */
+class TLSChunkTable {
 public:
-    ~TLSChunkHolder();
-    inline MemoryBufferChunk* reset(GlobalContext* ctx);
-    inline MemoryBufferChunk* get(GlobalContext* ctx);
+    TLSChunkTable();
+    ~TLSChunkTable();
+
+    TLSChunkHolder& holder(const GlobalContext* ctx) {
+        TLSChunkHolder& holder = Holders[ctx->Slot];
+        if (holder.Owner.load(std::memory_order_relaxed) != ctx->Id) {
+            holder.Chunk = nullptr;
+            holder.Held = nullptr;
+            holder.Sequence = 0;
+            holder.Large = false;
+            for (auto& counter : holder.Counters)
+                counter.store(0, std::memory_order_relaxed);
+            holder.Owner.store(ctx->Id, std::memory_order_release);
+        }
+        return holder;
+    }
+
+    /* the counters of the thread for the log if it has written to it */
+    bool read_counters(
+        const GlobalContext* ctx, uint64_t values[WRITE_COUNTERS]) const;
+
+    uint32_t thread_id() const {
+        return Holders[0].ThreadId;
+    }
 
 private:
-    MemoryBufferChunk* Chunk = nullptr;
+    TLSChunkHolder Holders[MAX_LOGS];
 };
 
 
+/* The tables of all living threads, thread_stats looks at them. The lock
+ * is taken when a thread starts and exits and by thread_stats only. */
+struct TableRegistry {
+    std::mutex Lock;
+    std::vector<TLSChunkTable*> Tables;
+};
+
+
+static TableRegistry& table_registry() {
+    static TableRegistry registry;
+    return registry;
+}
+
 
 /* Global memory log context */
-thread_local TLSChunkHolder CurrentChunk;
+thread_local TLSChunkTable CurrentChunks;
 std::atomic<GlobalContext*> GlobalCtx(nullptr);
 
+/* All living logs by GlobalContext::Slot */
+static std::atomic<GlobalContext*> Contexts[MAX_LOGS];
+static std::atomic<uint64_t> NextLogId(1);
 
-TLSChunkHolder::~TLSChunkHolder() {
-    auto ctx = GlobalCtx.load(std::memory_order_relaxed);
 
-    if (ctx != nullptr && Chunk != nullptr)
-        ctx->Queue.enqueue(Chunk);
+GlobalContext* log_in_slot(size_t slot) {
+    return Contexts[slot].load(std::memory_order_acquire);
 }
 
 
-MemoryBufferChunk* TLSChunkHolder::reset(GlobalContext* ctx) {
-    if (Chunk != nullptr)
-        ctx->Queue.enqueue(Chunk);
+TLSChunkTable::TLSChunkTable() {
+    uint32_t thread_id = syscall(SYS_gettid);
+    for (auto& holder : Holders)
+        holder.ThreadId = thread_id;
+
+    auto& registry = table_registry();
+    std::lock_guard<std::mutex> guard(registry.Lock);
+    registry.Tables.push_back(this);
+}
+
+
+/* chunks and counters of an exiting thread go back to their logs; the
+ * counters move under the lock, so thread_stats never counts them twice
+ * or misses them */
+TLSChunkTable::~TLSChunkTable() {
+    GlobalContext* contexts[MAX_LOGS];
+    for (size_t slot = 0; slot < MAX_LOGS; ++slot) {
+        auto ctx = Contexts[slot].load(std::memory_order_relaxed);
+        if (ctx != nullptr &&
+            ctx->Id == Holders[slot].Owner.load(std::memory_order_relaxed))
+            contexts[slot] = ctx;
+        else
+            contexts[slot] = nullptr;
+    }
+
+    {
+        auto& registry = table_registry();
+        std::lock_guard<std::mutex> guard(registry.Lock);
+        registry.Tables.erase(
+            std::find(registry.Tables.begin(), registry.Tables.end(), this));
+        for (size_t slot = 0; slot < MAX_LOGS; ++slot) {
+            if (contexts[slot] == nullptr)
+                continue;
+            for (size_t i = 0; i < WRITE_COUNTERS; ++i)
+                contexts[slot]->ExitedWrites[i].fetch_add(
+                    Holders[slot].counter(static_cast<WriteCounter>(i)),
+                    std::memory_order_relaxed);
+        }
+    }
+
+    for (size_t slot = 0; slot < MAX_LOGS; ++slot) {
+        if (contexts[slot] == nullptr)
+            continue;
+        if (Holders[slot].Chunk != nullptr)
+            contexts[slot]->park_chunk(Holders[slot].Chunk);
+        while (auto chunk = contexts[slot]->take_held(Holders[slot].Held))
+            contexts[slot]->return_chunk(chunk);
+    }
+}
+
+
+static void fill_write_counters(
+    WriteCounters& counters, const uint64_t values[WRITE_COUNTERS])
+{
+    counters.Records = values[COUNTER_RECORDS];
+    counters.Bytes = values[COUNTER_BYTES];
+    counters.DroppedTooLarge = values[COUNTER_DROPPED_TOO_LARGE];
+    counters.DroppedNoChunk = values[COUNTER_DROPPED_NO_CHUNK];
+    counters.DroppedReservations = values[COUNTER_DROPPED_RESERVATIONS];
+    counters.ChunkSwitches = values[COUNTER_CHUNK_SWITCHES];
+    counters.QueueFailures = values[COUNTER_QUEUE_FAILURES];
+    counters.FormatRetries = values[COUNTER_FORMAT_RETRIES];
+}
+
+
+bool TLSChunkTable::read_counters(
+    const GlobalContext* ctx, uint64_t values[WRITE_COUNTERS]) const
+{
+    const TLSChunkHolder& holder = Holders[ctx->Slot];
+    if (holder.Owner.load(std::memory_order_acquire) != ctx->Id)
+        return false;
+
+    for (size_t i = 0; i < WRITE_COUNTERS; ++i)
+        values[i] = holder.counter(static_cast<WriteCounter>(i));
+    return true;
+}
+
 
-    Chunk = ctx->Queue.dequeue();
-    if (Chunk == nullptr)
+/* A thread filling a small chunk faster than this gets large chunks */
+constexpr uint64_t HOT_FILL_NS = 1000000;
+/* and it gets small ones again when its write rate drops this many times */
+constexpr uint64_t COLD_RATE_DROP = 4;
+
+
+static uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+/* The time it took to fill the chunk decides the size of the next one */
+void TLSChunkHolder::adapt(const GlobalContext* ctx) {
+    uint64_t now = monotonic_ns();
+    uint64_t fill_time = now - TakenAt;
+    TakenAt = now;
+    if (ctx->is_large(Chunk))
+        Large = fill_time < HOT_FILL_NS * COLD_RATE_DROP
+            * (ctx->LargeChunkSize / ctx->ChunkSize);
+    else
+        Large = fill_time < HOT_FILL_NS;
+}
+
+
+MemoryBufferChunk* TLSChunkHolder::reset(GlobalContext* ctx) {
+    /* a crashed log keeps every chunk as it is until it is written */
+    if (ctx->Crashed.load(std::memory_order_relaxed))
         return nullptr;
-    Chunk->reset();
+    if (Chunk == nullptr) {
+        Chunk = ctx->acquire_chunk(Large);
+        return Chunk;
+    }
+
+    count(COUNTER_CHUNK_SWITCHES);
+    ctx->account_filled(Chunk);
+    if (ctx->LargeRegionSize != 0)
+        adapt(ctx);
+    /* the chunks refused at the earlier switches are retried first */
+    ctx->release_held(Held, HELD_RETRIES);
+    ctx->release_stranded(HELD_RETRIES);
+    /* the next chunk is taken before the full one is given away: if there
+     * is none (other threads hold them or the drainer is writing them out)
+     * the thread overwrites its own chunk rather than drops records */
+    MemoryBufferChunk* next = ctx->acquire_chunk(Large);
+    if (next == nullptr) {
+        ctx->overwrite_chunk(Chunk);
+        return Chunk;
+    }
+    /* if the queue is congested, the thread holds the full chunk rather
+     * than waits or writes over it, and gives it away at a later switch */
+    if (!ctx->release_chunk(Chunk)) {
+        count(COUNTER_QUEUE_FAILURES);
+        ctx->hold_chunk(Held, Chunk);
+    }
+    Chunk = next;
     return Chunk;
 }
 
 
+void TLSChunkHolder::write_header(char* place) {
+    RecordHeader header;
+    header.Timestamp = read_clock();
+    header.ThreadId = ThreadId;
+    header.Sequence = Sequence++;
+    memcpy(place, &header, sizeof(header));
+}
+
+
 MemoryBufferChunk* TLSChunkHolder::get(GlobalContext* ctx) {
     if (Chunk == nullptr) {
-        Chunk = ctx->Queue.dequeue();
-        if (Chunk == nullptr)
-            return nullptr;
-        Chunk->reset();
+        Chunk = ctx->acquire_chunk(Large);
+        if (ctx->LargeRegionSize != 0)
+            TakenAt = monotonic_ns();
     }
     return Chunk;
 }
 
 
-GlobalContext::GlobalContext(size_t total_buffer_size, size_t chunk_size)
-    : BigBuffer(new char[total_buffer_size])
-    , ChunkSize(chunk_size)
-    , TotalSize(total_buffer_size)
-    , Queue(total_buffer_size / chunk_size)
+/* The format arena follows the chunks in the same allocation, the
+ * compressed region follows the arena */
+static size_t format_arena_offset(size_t total_buffer_size) {
+    return ptr_align_up<RECORD_ALIGNMENT>(total_buffer_size);
+}
+
+
+static size_t compressed_region_offset(size_t total_buffer_size) {
+    return format_arena_offset(total_buffer_size) + FORMAT_ARENA_SIZE;
+}
+
+
+static std::vector<int> buffer_nodes(const Options& options) {
+    if (!options.NumaAware)
+        return {};
+    auto nodes = numa_nodes();
+    size_t chunks = options.TotalBufferSize / options.ChunkSize;
+    if (nodes.size() == 1 || nodes.size() > chunks)
+        return {};
+    return nodes;
+}
+
+
+/* Each NUMA node gets an equal number of whole chunks */
+static size_t node_part_size(
+    const Options& options, const std::vector<int>& nodes)
 {
-    /* let's pre-allocate all memory pages */
-    for (size_t i = 0; i < total_buffer_size; i += PAGE_SIZE)
-        BigBuffer[i] = 0;
+    if (nodes.empty())
+        return 0;
+    size_t chunks = options.TotalBufferSize / options.ChunkSize;
+    return (chunks + nodes.size() - 1) / nodes.size() * options.ChunkSize;
+}
 
-    /* put all chunks into the queue */
-    for (size_t i = 0; i < total_buffer_size / chunk_size; ++i)
-        Queue.enqueue(
-            reinterpret_cast<MemoryBufferChunk*>(
-                BigBuffer.get() + chunk_size * i));
+
+/* About a half of the buffer in whole large chunks, if they are used */
+static size_t large_region_size(
+    const Options& options, const std::vector<int>& nodes)
+{
+    if (options.LargeChunkSize == 0 || !nodes.empty())
+        return 0;
+    size_t half = options.TotalBufferSize / 2;
+    return half - half % options.LargeChunkSize;
+}
+
+
+static size_t queue_shards(
+    const Options& options, const std::vector<int>& nodes)
+{
+    if (!nodes.empty())
+        return nodes.size();
+    if (options.QueueShards != 0)
+        return options.QueueShards;
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    return cpus > 0 ? cpus : 1;
+}
+
+
+GlobalContext::GlobalContext(const Options& options)
+    : NumaNodes(buffer_nodes(options))
+    , BigBuffer(
+        compressed_region_offset(options.TotalBufferSize)
+            + ptr_align_up<RECORD_ALIGNMENT>(options.CompressedBufferSize),
+        options.MappedFile, NumaNodes, node_part_size(options, NumaNodes),
+        options.HugePageSize)
+    , ChunkSize(options.ChunkSize)
+    , TotalSize(options.TotalBufferSize)
+    , NodePartSize(node_part_size(options, NumaNodes))
+    , LargeChunkSize(options.LargeChunkSize)
+    , LargeRegionSize(large_region_size(options, NumaNodes))
+    , MaxChunkSize(LargeRegionSize != 0 ? LargeChunkSize : ChunkSize)
+    , RecordHeaderSize(options.RecordHeader ? sizeof(RecordHeader) : 0)
+    , RecordFrameSize(options.RecordFrame ? sizeof(RecordFrame) : 0)
+    , Queue(queue_shards(options, NumaNodes),
+            options.TotalBufferSize / options.ChunkSize)
+    , LargeQueue(Queue.shards(),
+                 std::max<size_t>(LargeRegionSize / MaxChunkSize, 1))
+    , Partial(options.TotalBufferSize / options.ChunkSize)
+    , ChunkLinks(new MemoryBufferChunk*[chunks()]())
+    , Formats(BigBuffer.get() + format_arena_offset(options.TotalBufferSize),
+              FORMAT_ARENA_SIZE)
+    , CompressedRegion(
+        BigBuffer.get() + compressed_region_offset(options.TotalBufferSize))
+    , CompressedSize(
+        ptr_align_up<RECORD_ALIGNMENT>(options.CompressedBufferSize))
+{
+    memcpy(TextPrefix, RECORD_PREFIX, RECORD_PREFIX_SIZE);
+    memcpy(BinaryPrefix, BINARY_RECORD_PREFIX, RECORD_PREFIX_SIZE);
+    memcpy(SchemaPrefix, SCHEMA_RECORD_PREFIX, RECORD_PREFIX_SIZE);
+    if (options.RecordHeader) {
+        TextPrefix[RECORD_HEADER_POS] = RECORD_HEADER_FLAG;
+        BinaryPrefix[RECORD_HEADER_POS] = RECORD_HEADER_FLAG;
+        SchemaPrefix[RECORD_HEADER_POS] = RECORD_HEADER_FLAG;
+        Formats.store_calibration();
+    }
+    if (options.RecordFrame) {
+        TextPrefix[RECORD_FRAME_POS] = RECORD_FRAME_FLAG;
+        BinaryPrefix[RECORD_FRAME_POS] = RECORD_FRAME_FLAG;
+        SchemaPrefix[RECORD_FRAME_POS] = RECORD_FRAME_FLAG;
+    }
+
+    for (size_t shard = 0; shard < NumaNodes.size(); ++shard) {
+        size_t node = NumaNodes[shard];
+        if (NodeShard.size() <= node)
+            NodeShard.resize(node + 1, 0);
+        NodeShard[node] = shard;
+    }
+
+    /* put all chunks into the queues, spread them over the shards */
+    for (size_t i = 0; i < chunks(); ++i) {
+        auto chunk = new (this->chunk(i)) MemoryBufferChunk;
+        chunk->reset();
+        (is_large(chunk) ? LargeQueue : Queue).enqueue(
+            chunk,
+            NumaNodes.empty() ? i % Queue.shards() : home_shard(chunk));
+    }
+
+    if (options.DrainPath != nullptr)
+        Drain.reset(new Drainer(*this, options));
+    if (CompressedSize != 0)
+        Compress.reset(
+            new Compressor(*this, CompressedRegion, CompressedSize));
+    Dumper.reset(new ChunkDumper(*this));
+
+    Id = NextLogId.fetch_add(1, std::memory_order_relaxed);
+    for (Slot = 0; Slot < MAX_LOGS; ++Slot) {
+        GlobalContext* free_slot = nullptr;
+        if (Contexts[Slot].compare_exchange_strong(free_slot, this))
+            return;
+    }
+    throw std::length_error("too many logs");
+}
+
+
+GlobalContext::~GlobalContext() {
+    Contexts[Slot].store(nullptr, std::memory_order_relaxed);
+}
+
+
+bool GlobalContext::release_chunk(MemoryBufferChunk* chunk) {
+    size_t failures = FailReleases.load(std::memory_order_relaxed);
+    while (failures != 0)
+        if (FailReleases.compare_exchange_weak(failures, failures - 1,
+                                               std::memory_order_relaxed))
+            return false;
+    if (Drain && !chunk->empty())
+        return Drain->seal(chunk);
+    if (Compress && !chunk->empty())
+        return Compress->seal(chunk);
+    return free_chunk(chunk);
+}
+
+
+void GlobalContext::return_chunk(MemoryBufferChunk* chunk) {
+    for (size_t attempt = 0; attempt < RETURN_ATTEMPTS; ++attempt) {
+        if (release_chunk(chunk))
+            return;
+        sched_yield();
+    }
+    std::lock_guard<std::mutex> guard(StrandedLock);
+    hold_chunk(Stranded, chunk);
+    StrandedChunks.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+size_t GlobalContext::release_held(MemoryBufferChunk*& list, size_t count) {
+    size_t released = 0;
+    for (; released < count; ++released) {
+        MemoryBufferChunk* chunk = take_held(list);
+        if (chunk == nullptr)
+            break;
+        if (!release_chunk(chunk)) {
+            hold_chunk(list, chunk);
+            break;
+        }
+    }
+    return released;
+}
+
+
+size_t GlobalContext::free_held(MemoryBufferChunk*& list, size_t count) {
+    size_t freed = 0;
+    for (; freed < count; ++freed) {
+        MemoryBufferChunk* chunk = take_held(list);
+        if (chunk == nullptr)
+            break;
+        if (!free_chunk(chunk)) {
+            hold_chunk(list, chunk);
+            break;
+        }
+    }
+    return freed;
+}
+
+
+void GlobalContext::release_stranded(size_t count) {
+    if (StrandedChunks.load(std::memory_order_relaxed) == 0)
+        return;
+    std::unique_lock<std::mutex> lock(StrandedLock, std::try_to_lock);
+    if (!lock.owns_lock())
+        return;
+    StrandedChunks.fetch_sub(release_held(Stranded, count),
+                             std::memory_order_relaxed);
+}
+
+
+void GlobalContext::overwrite_chunk(MemoryBufferChunk* chunk) {
+    if (Drain && !chunk->empty())
+        Drain->drop();
+    else if (Compress && !chunk->empty())
+        Compress->drop();
+    chunk->reset();
+}
+
+
+void GlobalContext::park_chunk(MemoryBufferChunk* chunk) {
+    if (!chunk->empty()
+        && !chunk->out_of_space(chunk_size(chunk), RECORD_ALIGNMENT)
+        && Partial.enqueue(chunk))
+        return;
+    if (!chunk->empty())
+        account_filled(chunk);
+    return_chunk(chunk);
+}
+
+
+MemoryBufferChunk* GlobalContext::acquire_chunk(bool large) {
+    /* the records of a parked chunk stay, the new ones follow them */
+    auto chunk = Partial.dequeue();
+    if (chunk != nullptr) {
+        ResumedChunks.fetch_add(1, std::memory_order_relaxed);
+        return chunk;
+    }
+
+    /* a chunk of the other size is better than none */
+    size_t shard = local_shard();
+    if (large && LargeRegionSize != 0)
+        chunk = LargeQueue.dequeue(shard);
+    if (chunk == nullptr)
+        chunk = Queue.dequeue(shard);
+    if (chunk == nullptr && LargeRegionSize != 0 && !large)
+        chunk = LargeQueue.dequeue(shard);
+    if (chunk == nullptr && Drain)
+        chunk = Drain->steal();
+    if (chunk == nullptr && Compress)
+        chunk = Compress->steal();
+    if (chunk == nullptr)
+        return nullptr;
+
+    chunk->reset();
+    TakenChunks.fetch_add(1, std::memory_order_relaxed);
+    if (is_large(chunk))
+        TakenLargeChunks.fetch_add(1, std::memory_order_relaxed);
+    return chunk;
 }
 
 
 bool initialize(size_t total_buffer_size, size_t chunk_size) {
-    if (chunk_size <= RECORD_PREFIX_SIZE + 2)
+    Options options;
+    options.TotalBufferSize = total_buffer_size;
+    options.ChunkSize = chunk_size;
+    return initialize(options);
+}
+
+
+static bool valid_options(const Options& options) {
+    if (options.ChunkSize <= RECORD_PREFIX_SIZE + 2)
+        return false;
+
+    if (options.TotalBufferSize < options.ChunkSize)
+        return false;
+
+    if (options.TotalBufferSize % options.ChunkSize != 0)
+        return false;
+
+    if ((options.HugePageSize & (options.HugePageSize - 1)) != 0)
+        return false;
+
+    /* a block of the largest chunk must fit into the compressed region
+     * and the chunks go either to the drainer or to the compressor */
+    if (options.CompressedBufferSize != 0 &&
+        (options.DrainPath != nullptr ||
+         options.CompressedBufferSize < 2 * std::max(
+             options.ChunkSize, options.LargeChunkSize)))
         return false;
 
-    if (total_buffer_size < chunk_size)
+    if (options.LargeChunkSize != 0 &&
+        (options.LargeChunkSize <= options.ChunkSize ||
+         options.LargeChunkSize % options.ChunkSize != 0 ||
+         options.TotalBufferSize / 2 < options.LargeChunkSize))
         return false;
 
-    if (total_buffer_size % chunk_size != 0)
+    return true;
+}
+
+
+bool initialize(const Options& options) {
+    if (!valid_options(options))
         return false;
 
     GlobalContext* new_ctx;
     try {
-        new_ctx = new GlobalContext(total_buffer_size, chunk_size);
+        new_ctx = new GlobalContext(options);
     } catch (...) {
         return false;
     }
@@ -191,123 +794,776 @@ bool initialize(size_t total_buffer_size, size_t chunk_size) {
 }
 
 
+/* the records of the calling thread get to the drain files */
+static void destroy_context(GlobalContext* ctx) {
+    if (ctx == nullptr)
+        return;
+    TLSChunkHolder& holder = CurrentChunks.holder(ctx);
+    if (holder.current() != nullptr)
+        ctx->return_chunk(holder.current());
+    holder.detach(ctx);
+    /* parked and stranded chunks go to the drainer before it stops */
+    while (MemoryBufferChunk* chunk = ctx->Partial.dequeue())
+        ctx->return_chunk(chunk);
+    for (size_t attempt = 0; attempt < RETURN_ATTEMPTS; ++attempt) {
+        ctx->release_stranded(ctx->chunks());
+        if (ctx->StrandedChunks.load(std::memory_order_relaxed) == 0)
+            break;
+        sched_yield();
+    }
+    delete ctx;
+}
+
+
 void finalize() {
-    auto old_ctx = GlobalCtx.exchange(nullptr, std::memory_order_release);
-    delete old_ctx;
-    CurrentChunk = TLSChunkHolder();
+    destroy_context(GlobalCtx.exchange(nullptr, std::memory_order_release));
 }
 
 
 struct CallContext {
     GlobalContext* GCtx;
+    TLSChunkHolder* Holder;
     MemoryBufferChunk* Chunk;
     char* PrefixPlace;
     char* RecordPlace;
 
-    bool init(size_t record_size) {
-        GCtx = GlobalCtx.load(std::memory_order_relaxed);
+    bool init(GlobalContext* ctx, size_t record_size) {
+        GCtx = ctx;
 
         if (GCtx == nullptr)
             return false;
 
-        if (record_size > GCtx->ChunkSize - RECORD_PREFIX_SIZE)
+        Holder = &CurrentChunks.holder(GCtx);
+        record_size += extra_size();
+        if (record_size > GCtx->ChunkSize - RECORD_PREFIX_SIZE) {
+            Holder->count(COUNTER_DROPPED_TOO_LARGE);
             return false;
+        }
 
-        Chunk = CurrentChunk.get(GCtx);
-        if (Chunk == nullptr)
+        Chunk = Holder->get(GCtx);
+        if (Chunk == nullptr) {
+            Holder->count(COUNTER_DROPPED_NO_CHUNK);
             return false;
-        if (Chunk->out_of_space(GCtx->ChunkSize, record_size)) {
-            Chunk = CurrentChunk.reset(GCtx);
-            if (Chunk == nullptr)
-                return false;
-            if (Chunk->out_of_space(GCtx->ChunkSize, record_size))
-                return false;
         }
+        if (Chunk->out_of_space(GCtx->chunk_size(Chunk), record_size))
+            return switch_chunk(record_size);
 
-        PrefixPlace = Chunk->get_fill_point();
-        RecordPlace = PrefixPlace + RECORD_PREFIX_SIZE;
-
-        memset(PrefixPlace, 0, RECORD_PREFIX_SIZE);
+        place_record();
         return true;
     }
 
     bool reset_chunk(size_t record_size) {
-        Chunk = CurrentChunk.reset(GCtx);
-        if (Chunk == nullptr)
-            return false;
-        if (Chunk->out_of_space(GCtx->ChunkSize, record_size))
-            return false;
+        return switch_chunk(record_size + extra_size());
+    }
+
+    /* A resumed chunk (see GlobalContext::park_chunk) may have less room
+     * than the record needs, the next chunk is a free one then */
+    bool switch_chunk(size_t record_size) {
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            Chunk = Holder->reset(GCtx);
+            if (Chunk == nullptr) {
+                Holder->count(COUNTER_DROPPED_NO_CHUNK);
+                return false;
+            }
+            if (!Chunk->out_of_space(GCtx->chunk_size(Chunk), record_size)) {
+                place_record();
+                return true;
+            }
+            if (Chunk->empty())
+                break;
+        }
+        Holder->count(COUNTER_DROPPED_TOO_LARGE);
+        return false;
+    }
+
+    /* bytes of the frame and the header between the prefix and the record */
+    size_t extra_size() const {
+        return GCtx->RecordFrameSize + GCtx->RecordHeaderSize;
+    }
+
+    /* space left in the chunk for the record itself */
+    size_t available_space() const {
+        return Chunk->available_space(GCtx->chunk_size(Chunk))
+            - RECORD_PREFIX_SIZE - extra_size();
+    }
+
+    void place_record() {
+        place_record_at(Chunk->get_fill_point());
+    }
 
-        PrefixPlace = Chunk->get_fill_point();
-        RecordPlace = PrefixPlace + RECORD_PREFIX_SIZE;
+    void place_record_at(char* place) {
+        PrefixPlace = place;
+        RecordPlace = PrefixPlace + RECORD_PREFIX_SIZE + GCtx->RecordFrameSize;
 
         memset(PrefixPlace, 0, RECORD_PREFIX_SIZE);
-        return true;
+        if (GCtx->RecordHeaderSize != 0) {
+            Holder->write_header(RecordPlace);
+            RecordPlace += GCtx->RecordHeaderSize;
+        }
+    }
+
+    /* Publishes the record ending at end: the frame first if there is
+     * one, the prefix is the last, so a reader never sees a prefix of
+     * an incomplete record */
+    void write_prefix(const char* end, char kind = RECORD_KIND_TEXT) {
+        const char* prefix = GCtx->TextPrefix;
+        if (kind == RECORD_KIND_BINARY)
+            prefix = GCtx->BinaryPrefix;
+        else if (kind == RECORD_KIND_SCHEMA)
+            prefix = GCtx->SchemaPrefix;
+        write_frame(end);
+        // ensure a compiler does not reorder operations
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        memcpy(PrefixPlace, prefix, RECORD_PREFIX_SIZE);
+        Holder->count(COUNTER_RECORDS);
+        Holder->count(COUNTER_BYTES, end - RecordPlace);
+    }
+
+    void write_frame(const char* end) {
+        if (GCtx->RecordFrameSize != 0) {
+            char* frame_place = PrefixPlace + RECORD_PREFIX_SIZE;
+            const char* framed = frame_place + sizeof(RecordFrame);
+            RecordFrame frame;
+            frame.Length = end - framed;
+            frame.Checksum = record_checksum(framed, frame.Length);
+            memcpy(frame_place, &frame, sizeof(frame));
+        }
+    }
+
+    /* Places the first record like init does and returns how many of the
+     * records fit into the rest of the chunk along with it, 0 if the
+     * first one is dropped */
+    size_t init_batch(
+        GlobalContext* ctx, const struct iovec* records, size_t count)
+    {
+        if (!init(ctx, records[0].iov_len))
+            return 0;
+        size_t space = Chunk->available_space(GCtx->chunk_size(Chunk));
+        size_t used = record_span(records[0].iov_len);
+        size_t taken = 1;
+        for (; taken < count; ++taken) {
+            size_t next = ptr_align_up<RECORD_ALIGNMENT>(used) +
+                record_span(records[taken].iov_len);
+            if (next > space)
+                break;
+            used = next;
+        }
+        return taken;
     }
 
-    void write_prefix() {
+    /* Writes the records placed by init_batch one after another, then
+     * publishes all of their prefixes behind one fence and moves the
+     * fill point once */
+    void write_batch(const struct iovec* records, size_t count) {
+        char* first = PrefixPlace;
+        char* end = RecordPlace;
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (i != 0)
+                place_record_at(ptr_align_up<RECORD_ALIGNMENT>(end));
+            memcpy(RecordPlace, records[i].iov_base, records[i].iov_len);
+            end = RecordPlace + records[i].iov_len;
+            write_frame(end);
+            bytes += records[i].iov_len;
+        }
         // ensure a compiler does not reorder operations
         std::atomic_signal_fence(std::memory_order_seq_cst);
-        memcpy(PrefixPlace, RECORD_PREFIX, RECORD_PREFIX_SIZE);
+        char* place = first;
+        for (size_t i = 0; i < count; ++i) {
+            memcpy(place, GCtx->TextPrefix, RECORD_PREFIX_SIZE);
+            place = ptr_align_up<RECORD_ALIGNMENT>(
+                place + record_span(records[i].iov_len));
+        }
+        Chunk->fill_up_to(end);
+        Holder->count(COUNTER_RECORDS, count);
+        Holder->count(COUNTER_BYTES, bytes);
+    }
+
+    /* bytes of a record of len bytes from its prefix to its end */
+    size_t record_span(size_t len) const {
+        return RECORD_PREFIX_SIZE + extra_size() + len;
     }
 };
 
 
-bool write(const char* buf, size_t len) {
+static bool write_record(GlobalContext* gctx, const char* buf, size_t len) {
     CallContext ctx;
-    if (!ctx.init(len))
+    if (!ctx.init(gctx, len))
         return false;
     memcpy(ctx.RecordPlace, buf, len);
-    ctx.write_prefix();
+    ctx.write_prefix(ctx.RecordPlace + len);
     ctx.Chunk->fill_up_to(ctx.RecordPlace + len);
     return true;
 }
 
 
-bool format_write(const char* format, ...) {
+/* The records go into the chunk in groups, as many as fit into the rest
+ * of it, a record dropped for its size or for no chunk does not stop
+ * the ones after it */
+static bool write_records(
+    GlobalContext* gctx, const struct iovec* records, size_t count)
+{
+    bool written = true;
+    while (count != 0) {
+        CallContext ctx;
+        size_t taken = ctx.init_batch(gctx, records, count);
+        if (taken == 0) {
+            written = false;
+            taken = 1;
+        } else {
+            ctx.write_batch(records, taken);
+        }
+        records += taken;
+        count -= taken;
+    }
+    return written;
+}
+
+
+/* A record reserved by reserve() and not committed yet */
+struct ReservedRecord {
+    CallContext Ctx;
+    size_t Size;
+    bool Pending;
+};
+
+thread_local ReservedRecord Reserved;
+
+
+static void* reserve_record(GlobalContext* gctx, size_t len) {
+    Reserved.Pending = false;
+    if (!Reserved.Ctx.init(gctx, len))
+        return nullptr;
+    Reserved.Size = len;
+    Reserved.Pending = true;
+    return Reserved.Ctx.RecordPlace;
+}
+
+
+static bool commit_record(GlobalContext* gctx, size_t actual_len) {
+    if (!Reserved.Pending)
+        return false;
+    Reserved.Pending = false;
+
+    /* the place is still ours only if nothing was written by the thread
+     * to the log after reserve and the log was not re-initialized */
+    CallContext& ctx = Reserved.Ctx;
+    if (gctx == nullptr || gctx != ctx.GCtx)
+        return false;
+    TLSChunkHolder& holder = CurrentChunks.holder(gctx);
+    if (actual_len > Reserved.Size || holder.current() != ctx.Chunk ||
+        ctx.Chunk->get_fill_point() != ctx.PrefixPlace) {
+        holder.count(COUNTER_DROPPED_RESERVATIONS);
+        return false;
+    }
+
+    ctx.write_prefix(ctx.RecordPlace + actual_len);
+    ctx.Chunk->fill_up_to(ctx.RecordPlace + actual_len);
+    return true;
+}
+
+
+/* vsnprintf for the formats the engine does not do: the text goes into
+ * the rest of the chunk and is formatted again in a new chunk if it does
+ * not fit */
+static bool vformat_record(
+    CallContext& ctx, const char* format, va_list args)
+{
+    for (;;) {
+        size_t space_available_for_record = ctx.available_space();
+
+        va_list args_copy;
+        va_copy(args_copy, args);
+        int bytes_written = vsnprintf(
+            ctx.RecordPlace, space_available_for_record, format, args_copy);
+        va_end(args_copy);
+        if (bytes_written < 0)
+            return false;
+        /* the terminating zero has to fit as well */
+        if ((size_t)bytes_written < space_available_for_record) {
+            ctx.write_prefix(ctx.RecordPlace + bytes_written);
+            ctx.Chunk->fill_up_to(ctx.RecordPlace + bytes_written);
+            return true;
+        }
+        ctx.Holder->count(COUNTER_FORMAT_RETRIES);
+        if (!ctx.reset_chunk(bytes_written + 1))
+            return false;
+    }
+}
+
+
+/* The engine formats the text right into the rest of the chunk as well,
+ * but it counts the whole text when the rest is too short, so the text
+ * is formatted once more at most, in a chunk known to have room for it */
+static bool format_record(
+    GlobalContext* gctx, const char* format, va_list args)
+{
     CallContext ctx;
-    if (!ctx.init(2))
+    if (!ctx.init(gctx, 2))
         return false;
 
-  again:
-    size_t space_available_for_record =
-        ctx.Chunk->available_space(ctx.GCtx->ChunkSize) - RECORD_PREFIX_SIZE;
+    size_t space_available_for_record = ctx.available_space();
+    ptrdiff_t size = format_text(
+        ctx.RecordPlace, space_available_for_record, format, args);
+    if (size < 0)
+        return vformat_record(ctx, format, args);
+
+    /* the terminating zero ends the text for the readers of unframed
+     * records, though it is not a part of the record */
+    char* end = ctx.RecordPlace + size;
+    if ((size_t)size >= space_available_for_record) {
+        ctx.Holder->count(COUNTER_FORMAT_RETRIES);
+        if (!ctx.reset_chunk(size + 1))
+            return false;
+        end = format_to(ctx.RecordPlace, format, args);
+    }
+    *end = '\0';
+    ctx.write_prefix(end);
+    ctx.Chunk->fill_up_to(end);
+    return true;
+}
+
+
+bool write(const char* buf, size_t len) {
+    return write_record(GlobalCtx.load(std::memory_order_relaxed), buf, len);
+}
+
+
+bool write_batch(const struct iovec* records, size_t count) {
+    return write_records(
+        GlobalCtx.load(std::memory_order_relaxed), records, count);
+}
+
+
+void* reserve(size_t len) {
+    return reserve_record(GlobalCtx.load(std::memory_order_relaxed), len);
+}
+
+
+bool commit(size_t actual_len) {
+    return commit_record(
+        GlobalCtx.load(std::memory_order_relaxed), actual_len);
+}
 
+
+bool format_write(const char* format, ...) {
     va_list args;
     va_start(args, format);
-    int bytes_written =
-        vsnprintf(ctx.RecordPlace, space_available_for_record, format, args);
-    if (bytes_written < 0)
+    bool result = format_record(
+        GlobalCtx.load(std::memory_order_relaxed), format, args);
+    va_end(args);
+    return result;
+}
+
+
+namespace detail {
+
+
+std::atomic<uint64_t> Filter(~0ull << FILTER_CATEGORY_SHIFT | LEVEL_TRACE);
+
+
+static size_t binary_arg_size(const BinaryArg& arg, uint32_t& string_length) {
+    switch (arg.Type) {
+    case ARG_INT32:
+    case ARG_UINT32:
+        return sizeof(uint32_t);
+    case ARG_STRING:
+        string_length = arg.String == nullptr ? 0 : strlen(arg.String);
+        return sizeof(uint32_t) + string_length;
+    default:
+        return sizeof(uint64_t);
+    }
+}
+
+
+bool binary_write_args(
+    const char* format, const BinaryArg* args, size_t args_number)
+{
+    return binary_write_args(GlobalCtx.load(std::memory_order_relaxed),
+                             format, args, args_number);
+}
+
+
+bool binary_write_args(
+    GlobalContext* gctx, const char* format,
+    const BinaryArg* args, size_t args_number)
+{
+    uint32_t string_lengths[MAX_BINARY_ARGS];
+    size_t record_size = BINARY_RECORD_HEADER_SIZE + args_number;
+    for (size_t i = 0; i < args_number; ++i)
+        record_size += binary_arg_size(args[i], string_lengths[i]);
+
+    CallContext ctx;
+    if (!ctx.init(gctx, record_size))
         return false;
-    if ((size_t)bytes_written > space_available_for_record) {
-        if (!ctx.reset_chunk(bytes_written))
-            return false;
-        goto again;
+
+    ctx.GCtx->Formats.add(format);
+
+    char* place = ctx.RecordPlace;
+    uint64_t address = reinterpret_cast<uintptr_t>(format);
+    memcpy(place, &address, sizeof(address));
+    place += sizeof(address);
+    *place++ = static_cast<char>(args_number);
+    for (size_t i = 0; i < args_number; ++i)
+        *place++ = static_cast<char>(args[i].Type);
+
+    for (size_t i = 0; i < args_number; ++i) {
+        const BinaryArg& arg = args[i];
+        switch (arg.Type) {
+        case ARG_INT32:
+        case ARG_UINT32:
+            memcpy(place, &arg.Uint32, sizeof(uint32_t));
+            place += sizeof(uint32_t);
+            break;
+        case ARG_STRING:
+            memcpy(place, &string_lengths[i], sizeof(uint32_t));
+            place += sizeof(uint32_t);
+            if (string_lengths[i] != 0)
+                memcpy(place, arg.String, string_lengths[i]);
+            place += string_lengths[i];
+            break;
+        default:
+            memcpy(place, &arg.Uint64, sizeof(uint64_t));
+            place += sizeof(uint64_t);
+            break;
+        }
     }
 
-    ctx.write_prefix();
-    ctx.Chunk->fill_up_to(ctx.RecordPlace + bytes_written);
+    ctx.write_prefix(place, RECORD_KIND_BINARY);
+    ctx.Chunk->fill_up_to(place);
+    return true;
+}
+
+
+/* Type ids are given once per process, they are the same in every log */
+static std::atomic<const SchemaInfo*> Schemas[MAX_SCHEMAS];
+static std::atomic<uint32_t> NextSchemaId(1);
+
 
+/* Gives the schema its type id if it has none and puts it into the
+ * manifest of the log */
+static bool register_schema(GlobalContext* gctx, const SchemaInfo& schema) {
+    uint32_t id = schema.Id.load(std::memory_order_acquire);
+    if (id == 0) {
+        uint32_t new_id = NextSchemaId.fetch_add(1);
+        if (new_id >= MAX_SCHEMAS)
+            return false;
+        Schemas[new_id].store(&schema, std::memory_order_release);
+        /* a thread losing the race takes the id of the winner */
+        if (schema.Id.compare_exchange_strong(id, new_id))
+            id = new_id;
+    }
+    if (!gctx->Formats.add_schema(id, schema))
+        return false;
+    schema.Registered[gctx->Slot].store(gctx->Id, std::memory_order_release);
     return true;
 }
 
 
-bool dump(const char* filename) {
-    auto ctx = GlobalCtx.load(std::memory_order_relaxed);
+char* reserve_schema_record(const SchemaInfo& schema) {
+    return reserve_schema_record(
+        GlobalCtx.load(std::memory_order_relaxed), schema);
+}
+
+
+char* reserve_schema_record(GlobalContext* gctx, const SchemaInfo& schema) {
+    if (gctx == nullptr)
+        return nullptr;
+    if (schema.Registered[gctx->Slot].load(std::memory_order_relaxed) !=
+            gctx->Id && !register_schema(gctx, schema))
+        return nullptr;
+
+    Reserved.Pending = false;
+    CallContext& ctx = Reserved.Ctx;
+    Reserved.Size = SCHEMA_RECORD_HEADER_SIZE + schema.Size;
+    if (!ctx.init(gctx, Reserved.Size))
+        return nullptr;
+    uint32_t id = schema.Id.load(std::memory_order_relaxed);
+    memcpy(ctx.RecordPlace, &id, sizeof(id));
+    return ctx.RecordPlace + SCHEMA_RECORD_HEADER_SIZE;
+}
+
+
+void commit_schema_record() {
+    CallContext& ctx = Reserved.Ctx;
+    char* end = ctx.RecordPlace + Reserved.Size;
+    ctx.write_prefix(end, RECORD_KIND_SCHEMA);
+    ctx.Chunk->fill_up_to(end);
+}
+
+
+} // namespace detail
+
+
+const detail::SchemaInfo* find_schema(uint32_t id) {
+    if (id >= MAX_SCHEMAS)
+        return nullptr;
+    return detail::Schemas[id].load(std::memory_order_acquire);
+}
 
+
+static bool dump_buffer(GlobalContext* ctx, const char* filename) {
     if (ctx == nullptr)
         return false;
 
+    ctx->Formats.refresh_calibration();
+    /* the mapped file already is the dump, copying it would write the
+     * whole buffer again */
+    if (ctx->BigBuffer.mapped())
+        return ctx->BigBuffer.sync();
+
     FILE* dumpfile = fopen(filename, "wa");
     if (dumpfile == nullptr)
         return false;
 
     size_t write_result =
-        fwrite(ctx->BigBuffer.get(), ctx->TotalSize, 1, dumpfile);
+        fwrite(ctx->BigBuffer.get(), ctx->BigBuffer.size(), 1, dumpfile);
     fclose(dumpfile);
 
     return write_result == 1;
 }
 
 
+static bool dump_buffer_chunks(
+    GlobalContext* ctx, const char* filename, bool incremental)
+{
+    if (ctx == nullptr)
+        return false;
+
+    return ctx->Dumper->dump(filename, incremental);
+}
+
+
+static bool sync_buffer(GlobalContext* ctx) {
+    if (ctx == nullptr)
+        return false;
+
+    ctx->Formats.refresh_calibration();
+    return ctx->BigBuffer.sync();
+}
+
+
+static bool get_stats(GlobalContext* ctx, Stats& stats) {
+    if (ctx == nullptr)
+        return false;
+
+    stats = Stats();
+    stats.FilledChunks = ctx->FilledChunks.load(std::memory_order_relaxed);
+    stats.WastedBytes = ctx->WastedBytes.load(std::memory_order_relaxed);
+    stats.ResumedChunks = ctx->ResumedChunks.load(std::memory_order_relaxed);
+    stats.TakenChunks = ctx->TakenChunks.load(std::memory_order_relaxed);
+    stats.TakenLargeChunks =
+        ctx->TakenLargeChunks.load(std::memory_order_relaxed);
+
+    uint64_t writes[WRITE_COUNTERS];
+    for (size_t i = 0; i < WRITE_COUNTERS; ++i)
+        writes[i] = ctx->ExitedWrites[i].load(std::memory_order_relaxed);
+    {
+        auto& registry = table_registry();
+        std::lock_guard<std::mutex> guard(registry.Lock);
+        for (auto table : registry.Tables) {
+            uint64_t values[WRITE_COUNTERS];
+            if (!table->read_counters(ctx, values))
+                continue;
+            for (size_t i = 0; i < WRITE_COUNTERS; ++i)
+                writes[i] += values[i];
+        }
+    }
+    fill_write_counters(stats.Writes, writes);
+    stats.Backing = ctx->BigBuffer.backing();
+    stats.PageSize = ctx->BigBuffer.page_size();
+    if (ctx->Drain)
+        ctx->Drain->get_stats(stats);
+    if (ctx->Compress)
+        ctx->Compress->get_stats(stats);
+    return true;
+}
+
+
+static bool get_thread_stats(
+    GlobalContext* ctx, std::vector<ThreadStats>& threads)
+{
+    if (ctx == nullptr)
+        return false;
+
+    threads.clear();
+    auto& registry = table_registry();
+    std::lock_guard<std::mutex> guard(registry.Lock);
+    for (auto table : registry.Tables) {
+        uint64_t values[WRITE_COUNTERS];
+        if (!table->read_counters(ctx, values))
+            continue;
+        threads.emplace_back();
+        threads.back().ThreadId = table->thread_id();
+        fill_write_counters(threads.back().Writes, values);
+    }
+    return true;
+}
+
+
+bool dump(const char* filename) {
+    return dump_buffer(GlobalCtx.load(std::memory_order_relaxed), filename);
+}
+
+
+bool dump_chunks(const char* filename, bool incremental) {
+    return dump_buffer_chunks(
+        GlobalCtx.load(std::memory_order_relaxed), filename, incremental);
+}
+
+
+bool sync() {
+    return sync_buffer(GlobalCtx.load(std::memory_order_relaxed));
+}
+
+
+bool stats(Stats& stats) {
+    return get_stats(GlobalCtx.load(std::memory_order_relaxed), stats);
+}
+
+
+bool thread_stats(std::vector<ThreadStats>& threads) {
+    return get_thread_stats(GlobalCtx.load(std::memory_order_relaxed), threads);
+}
+
+
+static bool set_crash_fd(GlobalContext* ctx, int fd) {
+    if (ctx == nullptr || !install_crash_handlers())
+        return false;
+    ctx->CrashFd.store(fd, std::memory_order_relaxed);
+    return true;
+}
+
+
+static bool crash_dump_buffer(GlobalContext* ctx, int fd) {
+    if (ctx == nullptr)
+        return false;
+    return write_crash_image(*ctx, fd);
+}
+
+
+bool tail(TailCursor& cursor, TailCallback callback, void* arg) {
+    return detail::tail_records(
+        GlobalCtx.load(std::memory_order_relaxed), cursor, callback, arg);
+}
+
+
+bool install_crash_handler(int fd) {
+    return set_crash_fd(GlobalCtx.load(std::memory_order_relaxed), fd);
+}
+
+
+bool crash_dump(int fd) {
+    return crash_dump_buffer(GlobalCtx.load(std::memory_order_relaxed), fd);
+}
+
+
+void set_level(Level level) {
+    uint64_t filter = detail::Filter.load(std::memory_order_relaxed);
+    while (!detail::Filter.compare_exchange_weak(
+               filter, (filter & ~0xffull) | level,
+               std::memory_order_relaxed))
+        ;
+}
+
+
+Level get_level() {
+    return static_cast<Level>(
+        detail::Filter.load(std::memory_order_relaxed) & 0xff);
+}
+
+
+bool enable_category(unsigned category, bool enable) {
+    if (category >= MAX_CATEGORIES)
+        return false;
+    uint64_t bit = 1ull << (category + detail::FILTER_CATEGORY_SHIFT);
+    if (enable)
+        detail::Filter.fetch_or(bit, std::memory_order_relaxed);
+    else
+        detail::Filter.fetch_and(~bit, std::memory_order_relaxed);
+    return true;
+}
+
+
+Log::Log(const Options& options) {
+    if (!valid_options(options))
+        throw std::invalid_argument("memorylog::Log options");
+    Ctx = new GlobalContext(options);
+}
+
+
+Log::~Log() {
+    destroy_context(Ctx);
+}
+
+
+bool Log::write(const char* buf, size_t len) {
+    return write_record(Ctx, buf, len);
+}
+
+
+bool Log::format_write(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    bool result = format_record(Ctx, format, args);
+    va_end(args);
+    return result;
+}
+
+
+bool Log::write_batch(const struct iovec* records, size_t count) {
+    return write_records(Ctx, records, count);
+}
+
+
+void* Log::reserve(size_t len) {
+    return reserve_record(Ctx, len);
+}
+
+
+bool Log::commit(size_t actual_len) {
+    return commit_record(Ctx, actual_len);
+}
+
+
+bool Log::dump(const char* filename) {
+    return dump_buffer(Ctx, filename);
+}
+
+
+bool Log::dump_chunks(const char* filename, bool incremental) {
+    return dump_buffer_chunks(Ctx, filename, incremental);
+}
+
+
+bool Log::sync() {
+    return sync_buffer(Ctx);
+}
+
+
+bool Log::stats(Stats& stats) {
+    return get_stats(Ctx, stats);
+}
+
+
+bool Log::thread_stats(std::vector<ThreadStats>& threads) {
+    return get_thread_stats(Ctx, threads);
+}
+
+
+bool Log::tail(TailCursor& cursor, TailCallback callback, void* arg) {
+    return detail::tail_records(Ctx, cursor, callback, arg);
+}
+
+
+bool Log::install_crash_handler(int fd) {
+    return set_crash_fd(Ctx, fd);
+}
+
+
+bool Log::crash_dump(int fd) {
+    return crash_dump_buffer(Ctx, fd);
+}
+
+
 }
@@ -23,18 +23,762 @@ SOFTWARE.
 
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <type_traits>
+#include <vector>
+
+
+/* Call sites of the MEMORYLOG_* macros with a level below this one are
+ * removed at compile time, their arguments are not even evaluated.
+ * 0 is TRACE, 1 DEBUG, 2 INFO, 3 WARNING, 4 ERROR. */
+#ifndef MEMORYLOG_MIN_LEVEL
+#define MEMORYLOG_MIN_LEVEL 0
+#endif
 
 namespace memorylog {
 
+struct GlobalContext;
+
+/* Number of logs (the one of initialize and Log objects) that may exist
+ * at the same time */
+constexpr size_t MAX_LOGS = 32;
+
+struct Options {
+    size_t TotalBufferSize = 0;
+    size_t ChunkSize = 0;
+
+    /* If set, the buffer is a shared mapping of this file instead of heap
+     * memory. The file is created or truncated by initialize. The records
+     * stay in the file (or in the page cache) when the process crashes,
+     * no coredump is needed. A file on tmpfs or hugetlbfs is never
+     * written back to a disk. */
+    const char* MappedFile = nullptr;
+
+    /* Number of shards of the queue of free chunks, 0 means one shard per
+     * CPU. A thread returns and takes chunks from the shard of its CPU and
+     * steals from the neighbouring shards when the shard is empty, so
+     * chunk switches on different CPUs do not contend. With one shard
+     * the queue gives the best approximation of FIFO order of chunks. */
+    size_t QueueShards = 1;
+
+    /* Splits the buffer into equal parts, one per NUMA node, and places
+     * the pages of each part on its node. The queue gets a shard per node
+     * (QueueShards is ignored), threads take chunks of their own node
+     * first and a chunk always returns to its node. Has no effect on
+     * a machine with a single node. */
+    bool NumaAware = false;
+
+    /* Every record gets a 16 bytes header right after the prefix: a clock
+     * timestamp (TSC on x86), the thread id and a per-thread sequence
+     * number. The decoder uses it to put records of all threads back into
+     * one timeline. Text records with a header cannot be found by grep. */
+    bool RecordHeader = false;
+
+    /* Every record gets an 8 bytes frame right after the prefix: the
+     * length of the record and its checksum. Readers jump from a record
+     * to the next one instead of scanning the text for the next prefix,
+     * payloads containing the prefix do not break the parse and torn or
+     * stale records are detected. Text records with a frame cannot be
+     * found by grep. */
+    bool RecordFrame = false;
+
+    /* If set, a background thread writes full chunks to files
+     * <DrainPath>.0, <DrainPath>.1, ... before the chunks are reused, so
+     * the history is not limited by the buffer size. A new file is
+     * started when the current one reaches DrainFileSize bytes, only
+     * the last DrainFiles files are kept (0 keeps all of them). Writing
+     * threads never wait for the drainer, if it falls behind, the oldest
+     * full chunks are overwritten as without draining (see Stats). */
+    const char* DrainPath = nullptr;
+    size_t DrainFileSize = 64 * 1024 * 1024;
+    size_t DrainFiles = 8;
+
+    /* Backs the buffer with huge pages of this size (2MB or 1GB on x86):
+     * fewer page faults at start and fewer TLB misses on writes. It tries
+     * hugetlb pages of the size (they must be reserved, see
+     * /proc/sys/vm/nr_hugepages), then transparent huge pages, then
+     * regular pages; Stats::Backing tells which one it got. Ignored with
+     * MappedFile (put the file on hugetlbfs instead). */
+    size_t HugePageSize = 0;
+
+    /* Makes the chunk size of each thread follow its write rate. If set
+     * (a multiple of ChunkSize), about a half of the buffer is carved into
+     * chunks of this size. A thread starts with ChunkSize chunks and
+     * switches to large ones when it fills a chunk within a millisecond,
+     * it goes back to small chunks when it writes four times slower than
+     * that. Hot threads switch chunks less often, idle threads do not keep
+     * large chunks empty. The largest record is still limited by
+     * ChunkSize. Ignored with NumaAware on a machine with several nodes. */
+    size_t LargeChunkSize = 0;
+
+    /* If set, a background thread compresses full chunks into a region of
+     * this size placed after the chunks in the same buffer, and only then
+     * they are reused. The region is a ring of compressed blocks, the
+     * oldest blocks are overwritten. Log records usually compress several
+     * times, so the buffer keeps several times more history, writing
+     * threads never wait for the compressor. The decoder decompresses the
+     * blocks of a dump or a coredump. Must be at least twice the largest
+     * chunk size, cannot be used with DrainPath. */
+    size_t CompressedBufferSize = 0;
+};
+
+enum BufferBacking : unsigned char {
+    BACKING_HEAP,
+    BACKING_ANONYMOUS,
+    BACKING_FILE,
+    BACKING_HUGETLB,
+    BACKING_TRANSPARENT_HUGE_PAGES,
+};
+
+/* What the writes of a thread did, see Stats::Writes and thread_stats */
+struct WriteCounters {
+    /* records written and the bytes of their payloads (without prefixes,
+     * frames and headers) */
+    uint64_t Records = 0;
+    uint64_t Bytes = 0;
+    /* records not written: larger than a chunk, no chunk to write to
+     * (all of them taken by other threads and the drainer), reservations
+     * dropped or not fitting the record at commit */
+    uint64_t DroppedTooLarge = 0;
+    uint64_t DroppedNoChunk = 0;
+    uint64_t DroppedReservations = 0;
+    /* chunks the thread was done with and took another one, times
+     * the queue refused a full chunk and the thread held it to give it away
+     * at a later switch */
+    uint64_t ChunkSwitches = 0;
+    uint64_t QueueFailures = 0;
+    /* format_write records formatted again because they did not fit into
+     * the rest of the chunk */
+    uint64_t FormatRetries = 0;
+};
+
+struct ThreadStats {
+    /* the kernel thread id */
+    uint32_t ThreadId = 0;
+    WriteCounters Writes;
+};
+
+struct Stats {
+    /* chunks written to the drain files and the bytes of their records */
+    size_t DrainedChunks = 0;
+    size_t DrainedBytes = 0;
+    /* full chunks overwritten before the drainer or the compressor got
+     * them (or not fitting into the compressed region) */
+    size_t DroppedChunks = 0;
+    /* chunks compressed into the compressed region, the bytes of their
+     * records and of the compressed blocks, blocks overwritten by newer
+     * ones (see Options::CompressedBufferSize) */
+    size_t CompressedChunks = 0;
+    size_t CompressedRawBytes = 0;
+    size_t CompressedBytes = 0;
+    size_t EvictedBlocks = 0;
+    /* chunks a writer was done with (full, or left by an exiting thread
+     * and not resumed) and the unused bytes at their ends, WastedBytes /
+     * FilledChunks is the average waste per chunk */
+    size_t FilledChunks = 0;
+    size_t WastedBytes = 0;
+    /* partly filled chunks of exited threads resumed by other threads */
+    size_t ResumedChunks = 0;
+    /* chunks taken by writers from the queues of free chunks and how many
+     * of them were large (see Options::LargeChunkSize) */
+    size_t TakenChunks = 0;
+    size_t TakenLargeChunks = 0;
+    /* sums of the counters of all threads, exited ones included */
+    WriteCounters Writes;
+    /* memory of the buffer and its page size */
+    BufferBacking Backing = BACKING_HEAP;
+    size_t PageSize = 0;
+};
+
+/* A record passed to the callback of tail(). The text is valid only
+ * during the call. */
+struct TailRecord {
+    /* the text of a text record or the formatted text of a binary or
+     * a schema one */
+    const char* Text;
+    size_t Size;
+    /* zeros if the records have no headers (see Options::RecordHeader) */
+    uint64_t Timestamp;
+    uint32_t ThreadId;
+    uint32_t Sequence;
+};
+
+/* Returns false to stop tail() after this record */
+typedef bool (*TailCallback)(void* arg, const TailRecord& record);
+
+class TailCursor;
+
+namespace detail {
+struct TailCursorState;
+
+bool tail_records(
+    GlobalContext* ctx, TailCursor& cursor, TailCallback callback, void* arg);
+} // namespace detail
+
+/* The position of tail() in a log: the generation of every chunk and how
+ * far its records were read. Use one cursor per reading thread. A cursor
+ * used with another log (or the log re-initialized) starts over. */
+class TailCursor {
+public:
+    TailCursor();
+    ~TailCursor();
+
+    TailCursor(const TailCursor&) = delete;
+    TailCursor& operator=(const TailCursor&) = delete;
+
+    /* times a chunk was reused before the cursor read all its records */
+    uint64_t missed() const;
+
+private:
+    friend bool detail::tail_records(
+        GlobalContext* ctx, TailCursor& cursor,
+        TailCallback callback, void* arg);
+
+    detail::TailCursorState* State;
+};
+
 /* Initialize may throw std::bad_alloc */
 bool initialize(size_t total_buffer_size, size_t chunk_size);
 
+bool initialize(const Options& options);
+
 void finalize();
 
 bool write(const char* buf, size_t len);
 
 bool format_write(const char* format, ...);
 
+/* Writes count records, one per iovec, like count calls of write but
+ * with the cost of a call paid once for all the records fitting into
+ * the rest of the chunk; they become visible to readers together.
+ * Returns false if any of the records was dropped. */
+bool write_batch(const struct iovec* records, size_t count);
+
+/* Zero-copy write: reserve returns a place for a record of up to len bytes
+ * right in the chunk (or nullptr), the caller builds the record there and
+ * publishes it with commit(actual_len), actual_len <= len. Nothing else
+ * may be written by the thread between reserve and commit, otherwise
+ * the reservation is dropped and commit returns false. */
+void* reserve(size_t len);
+
+bool commit(size_t actual_len);
+
+/* Deferred formatting: only the format string address and the raw bytes
+ * of the arguments are copied into the log, formatting happens later in
+ * the decoder (see memorylog_decode). The format string must outlive
+ * the process (use literals). Strings (char*) are copied, any other
+ * pointer is stored as an address. */
+template <typename... Args>
+bool binary_write(const char* format, Args... args);
+
+/* Writes the whole buffer into the file. A file-backed buffer (see
+ * Options::MappedFile) is only flushed to its own file like sync does,
+ * the file named here is not written then. */
 bool dump(const char* filename);
 
+/* Writes a consistent snapshot of the buffer while other threads keep
+ * writing: only complete records of non-empty chunks are copied, nothing
+ * torn or left from a previous use of a chunk. The file has the layout of
+ * the buffer like a dump, the gaps are zeros. With incremental = true
+ * the file of the previous dump_chunks call is updated in place and only
+ * the chunks changed since then are written (a full dump is done if
+ * the file name differs). */
+bool dump_chunks(const char* filename, bool incremental = false);
+
+/* Flushes a file-backed buffer (see Options::MappedFile) to the file,
+ * returns false if the buffer is not file-backed */
+bool sync();
+
+/* Returns false if the log is not initialized */
+bool stats(Stats& stats);
+
+/* The counters of every living thread that has written to the log.
+ * The threads count their own writes without atomic operations, the
+ * counters are collected only here, so the numbers of threads writing
+ * meanwhile may lag behind by a few records. Returns false if the log
+ * is not initialized. */
+bool thread_stats(std::vector<ThreadStats>& threads);
+
+/* Calls the callback for every record written since the previous call
+ * with the cursor, for all records in the buffer on the first call, chunk
+ * by chunk in the order of each chunk. Writers are not stopped: the new
+ * records of a chunk are copied out and passed on only if the chunk was
+ * not reused meanwhile, otherwise the chunk is read again from its new
+ * start. A call costs a look at every chunk plus the copy of the new
+ * records. Returns false if the log is not initialized. */
+bool tail(TailCursor& cursor, TailCallback callback, void* arg);
+
+/* Installs handlers of SIGSEGV, SIGABRT and SIGBUS (once per process)
+ * that write the records of the log to fd when the process crashes, as
+ * crash_dump does, and then pass the signal on to the handler installed
+ * before them or to the default action (a coredump). The fd is opened
+ * beforehand (a file, a pipe, a socket) and must stay open, -1 turns
+ * the writing off. Every log with an fd is written. Returns false if
+ * the log is not initialized or the handlers could not be installed. */
+bool install_crash_handler(int fd);
+
+/* Writes the records of the log to fd using only async-signal-safe
+ * calls (writev of the filled parts of the buffer, no stdio, no malloc,
+ * no locks), for fatal signal handlers of the application. The output
+ * is decoded like a dump. The log is sealed: threads writing meanwhile
+ * keep their chunks but get no new ones, so call it only when the
+ * process is about to die. Returns false if the log is not initialized
+ * or a write fails. */
+bool crash_dump(int fd);
+
+
+enum Level : unsigned char {
+    LEVEL_TRACE,
+    LEVEL_DEBUG,
+    LEVEL_INFO,
+    LEVEL_WARNING,
+    LEVEL_ERROR,
+};
+
+constexpr unsigned MAX_CATEGORIES = 56;
+
+/* Levels and categories filter the records of the MEMORYLOG_* macros
+ * before any formatting. The filter is independent of initialize, by
+ * default all levels and all categories are enabled. */
+void set_level(Level level);
+
+Level get_level();
+
+/* Returns false if the category is out of range */
+bool enable_category(unsigned category, bool enable);
+
+/* One relaxed load, see MEMORYLOG_FORMAT. A category out of range is
+ * never enabled. */
+inline bool enabled(Level level, unsigned category = 0);
+
+constexpr int COMPILED_MIN_LEVEL = MEMORYLOG_MIN_LEVEL;
+
+constexpr bool compiled_in(Level level) {
+    return level >= COMPILED_MIN_LEVEL;
+}
+
+
+namespace detail {
+
+constexpr size_t MAX_BINARY_ARGS = 32;
+
+enum BinaryArgType : unsigned char {
+    ARG_INT32 = 1,
+    ARG_UINT32,
+    ARG_INT64,
+    ARG_UINT64,
+    ARG_DOUBLE,
+    ARG_POINTER,
+    ARG_STRING,
+};
+
+struct BinaryArg {
+    BinaryArgType Type;
+    union {
+        int32_t Int32;
+        uint32_t Uint32;
+        int64_t Int64;
+        uint64_t Uint64;
+        double Double;
+        const void* Pointer;
+        const char* String;
+    };
+};
+
+
+template <typename T>
+typename std::enable_if<
+    std::is_integral<T>::value && std::is_signed<T>::value &&
+        sizeof(T) <= sizeof(int32_t),
+    BinaryArg>::type
+make_binary_arg(T value) {
+    BinaryArg arg;
+    arg.Type = ARG_INT32;
+    arg.Int32 = value;
+    return arg;
+}
+
+template <typename T>
+typename std::enable_if<
+    std::is_integral<T>::value && std::is_unsigned<T>::value &&
+        sizeof(T) <= sizeof(uint32_t),
+    BinaryArg>::type
+make_binary_arg(T value) {
+    BinaryArg arg;
+    arg.Type = ARG_UINT32;
+    arg.Uint32 = value;
+    return arg;
+}
+
+template <typename T>
+typename std::enable_if<
+    std::is_integral<T>::value && std::is_signed<T>::value &&
+        (sizeof(T) > sizeof(int32_t)),
+    BinaryArg>::type
+make_binary_arg(T value) {
+    BinaryArg arg;
+    arg.Type = ARG_INT64;
+    arg.Int64 = value;
+    return arg;
+}
+
+template <typename T>
+typename std::enable_if<
+    std::is_integral<T>::value && std::is_unsigned<T>::value &&
+        (sizeof(T) > sizeof(uint32_t)),
+    BinaryArg>::type
+make_binary_arg(T value) {
+    BinaryArg arg;
+    arg.Type = ARG_UINT64;
+    arg.Uint64 = value;
+    return arg;
+}
+
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, BinaryArg>::type
+make_binary_arg(T value) {
+    BinaryArg arg;
+    arg.Type = ARG_DOUBLE;
+    arg.Double = value;
+    return arg;
+}
+
+inline BinaryArg make_binary_arg(const char* value) {
+    BinaryArg arg;
+    arg.Type = ARG_STRING;
+    arg.String = value;
+    return arg;
+}
+
+inline BinaryArg make_binary_arg(const void* value) {
+    BinaryArg arg;
+    arg.Type = ARG_POINTER;
+    arg.Pointer = value;
+    return arg;
+}
+
+bool binary_write_args(
+    const char* format, const BinaryArg* args, size_t args_number);
+
+bool binary_write_args(
+    GlobalContext* ctx, const char* format,
+    const BinaryArg* args, size_t args_number);
+
+enum SchemaFieldType : unsigned char {
+    FIELD_INT8 = 1,
+    FIELD_UINT8,
+    FIELD_INT16,
+    FIELD_UINT16,
+    FIELD_INT32,
+    FIELD_UINT32,
+    FIELD_INT64,
+    FIELD_UINT64,
+    FIELD_FLOAT,
+    FIELD_DOUBLE,
+    FIELD_BOOL,
+};
+
+/* enums are stored as their underlying types */
+template <typename T, bool = std::is_enum<T>::value>
+struct SchemaValue {
+    typedef T type;
+};
+
+template <typename T>
+struct SchemaValue<T, true> {
+    typedef typename std::underlying_type<T>::type type;
+};
+
+template <typename T>
+constexpr SchemaFieldType schema_field_type() {
+    static_assert(std::is_arithmetic<T>::value,
+                  "schema fields are numbers, bools and enums");
+    static_assert(sizeof(T) <= sizeof(uint64_t), "schema field is too large");
+    if (std::is_same<T, bool>::value)
+        return FIELD_BOOL;
+    if (std::is_floating_point<T>::value)
+        return sizeof(T) == sizeof(float) ? FIELD_FLOAT : FIELD_DOUBLE;
+    unsigned width = sizeof(T) == 1 ? 0 : sizeof(T) == 2 ? 1
+        : sizeof(T) == 4 ? 2 : 3;
+    return static_cast<SchemaFieldType>(
+        FIELD_INT8 + 2 * width + (std::is_unsigned<T>::value ? 1 : 0));
+}
+
+template <typename... Fields>
+struct SchemaTypes {
+    /* the extra element keeps the array non-empty without fields */
+    static constexpr unsigned char VALUES[] = {
+        schema_field_type<typename SchemaValue<Fields>::type>()..., 0};
+};
+
+template <typename... Fields>
+constexpr unsigned char SchemaTypes<Fields...>::VALUES[];
+
+template <typename... Fields>
+struct FieldsSize;
+
+template <>
+struct FieldsSize<> {
+    static constexpr size_t value = 0;
+};
+
+template <typename T, typename... Rest>
+struct FieldsSize<T, Rest...> {
+    static constexpr size_t value = sizeof(T) + FieldsSize<Rest...>::value;
+};
+
+/* Keeps the field types of a schema from being deduced from the
+ * arguments of schema_write, so the arguments convert to the fields */
+template <typename T>
+struct Identity {
+    typedef T type;
+};
+
+/* Every field is stored at an offset known at compile time, the copies
+ * of constant sizes become plain stores */
+template <size_t OFFSET>
+inline void encode_fields(char*) {}
+
+template <size_t OFFSET, typename T, typename... Rest>
+inline void encode_fields(char* place, T value, Rest... rest) {
+    memcpy(place + OFFSET, &value, sizeof(T));
+    encode_fields<OFFSET + sizeof(T)>(place, rest...);
+}
+
+/* The part of Schema the library works with */
+struct SchemaInfo {
+    constexpr SchemaInfo(
+        const char* format, const unsigned char* types,
+        size_t field_count, size_t size)
+        : Format(format), Types(types), FieldCount(field_count), Size(size)
+        , Id(0), Registered{}
+    {}
+
+    const char* const Format;
+    const unsigned char* const Types;
+    size_t const FieldCount;
+    /* bytes of all fields */
+    size_t const Size;
+    /* the type id, given by the first write */
+    mutable std::atomic<uint32_t> Id;
+    /* the id of the log in each slot whose manifest has the schema */
+    mutable std::atomic<uint64_t> Registered[MAX_LOGS];
+};
+
+/* Returns the place of the fields of a schema record in the chunk of the
+ * thread or nullptr, the record is published by commit_schema_record.
+ * It is the reserve/commit pair with the type id written in between. */
+char* reserve_schema_record(const SchemaInfo& schema);
+
+char* reserve_schema_record(GlobalContext* ctx, const SchemaInfo& schema);
+
+void commit_schema_record();
+
+/* The runtime filter: the lowest enabled level in the low byte and
+ * a bit per enabled category above it */
+constexpr unsigned FILTER_CATEGORY_SHIFT = 8;
+extern std::atomic<uint64_t> Filter;
+
+} // namespace detail
+
+
+/* A record type with fixed fields, declared once, e.g.
+ *
+ *   static const memorylog::Schema<uint32_t, State, State> TRANSITION(
+ *       "connection %u: %d -> %d\n");
+ *   memorylog::schema_write(TRANSITION, id, from, to);
+ *
+ * A record of a schema is its 4 bytes type id followed by the raw bytes
+ * of the fields, packed at offsets known at compile time: no format
+ * string address, no argument types, no formatting. The first write
+ * of a schema to a log puts the type id, the field types and the format
+ * into the manifest in the format arena of the log, the decoder formats
+ * the records with it like binary records. Fields are numbers, bools
+ * and enums. Schemas must outlive the process (static or global objects
+ * are constant-initialized), at most MAX_SCHEMAS of them get type ids. */
+constexpr size_t MAX_SCHEMAS = 4096;
+
+template <typename... Fields>
+class Schema : public detail::SchemaInfo {
+public:
+    static constexpr size_t SIZE = detail::FieldsSize<Fields...>::value;
+
+    constexpr explicit Schema(const char* format)
+        : detail::SchemaInfo(
+              format,
+              detail::SchemaTypes<
+                  typename detail::SchemaValue<Fields>::type...>::VALUES,
+              sizeof...(Fields), detail::FieldsSize<Fields...>::value)
+    {}
+
+    Schema(const Schema&) = delete;
+    Schema& operator=(const Schema&) = delete;
+};
+
+template <typename... Fields>
+constexpr size_t Schema<Fields...>::SIZE;
+
+template <typename... Fields>
+bool schema_write(
+    const Schema<Fields...>& schema,
+    typename detail::Identity<Fields>::type... fields);
+
+
+/* An independent log with its own buffer, chunks and queue, e.g. a large
+ * ring of small chunks for high-rate tracing next to a small ring for
+ * rare events, so a noisy subsystem does not push out the records of
+ * the others. The functions are the same as the global ones (which work
+ * with the log of initialize). A thread keeps a chunk of each log it
+ * writes to, it finds it in a small per-thread table in O(1).
+ *
+ * The constructor throws std::invalid_argument for bad options,
+ * std::length_error if there are MAX_LOGS logs already and whatever
+ * initialize may fail with. The destructor must not run while other
+ * threads write to the log, like finalize. */
+class Log {
+public:
+    explicit Log(const Options& options);
+    ~Log();
+
+    Log(const Log&) = delete;
+    Log& operator=(const Log&) = delete;
+
+    bool write(const char* buf, size_t len);
+
+    bool format_write(const char* format, ...);
+
+    bool write_batch(const struct iovec* records, size_t count);
+
+    /* one reservation per thread across all logs */
+    void* reserve(size_t len);
+
+    bool commit(size_t actual_len);
+
+    template <typename... Args>
+    bool binary_write(const char* format, Args... args);
+
+    template <typename... Fields>
+    bool schema_write(
+        const Schema<Fields...>& schema,
+        typename detail::Identity<Fields>::type... fields);
+
+    bool dump(const char* filename);
+
+    bool dump_chunks(const char* filename, bool incremental = false);
+
+    bool sync();
+
+    bool stats(Stats& stats);
+
+    bool thread_stats(std::vector<ThreadStats>& threads);
+
+    bool tail(TailCursor& cursor, TailCallback callback, void* arg);
+
+    bool install_crash_handler(int fd);
+
+    bool crash_dump(int fd);
+
+private:
+    GlobalContext* Ctx;
+};
+
+
+template <typename... Args>
+bool binary_write(const char* format, Args... args) {
+    static_assert(sizeof...(Args) <= detail::MAX_BINARY_ARGS,
+                  "too many arguments for binary_write");
+    /* the extra element keeps the array non-empty without arguments */
+    const detail::BinaryArg packed[] = {detail::make_binary_arg(args)..., {}};
+    return detail::binary_write_args(format, packed, sizeof...(Args));
+}
+
+
+template <typename... Args>
+bool Log::binary_write(const char* format, Args... args) {
+    static_assert(sizeof...(Args) <= detail::MAX_BINARY_ARGS,
+                  "too many arguments for binary_write");
+    const detail::BinaryArg packed[] = {detail::make_binary_arg(args)..., {}};
+    return detail::binary_write_args(Ctx, format, packed, sizeof...(Args));
+}
+
+
+template <typename... Fields>
+bool schema_write(
+    const Schema<Fields...>& schema,
+    typename detail::Identity<Fields>::type... fields)
+{
+    char* place = detail::reserve_schema_record(schema);
+    if (place == nullptr)
+        return false;
+    detail::encode_fields<0>(place, fields...);
+    detail::commit_schema_record();
+    return true;
+}
+
+
+template <typename... Fields>
+bool Log::schema_write(
+    const Schema<Fields...>& schema,
+    typename detail::Identity<Fields>::type... fields)
+{
+    char* place = detail::reserve_schema_record(Ctx, schema);
+    if (place == nullptr)
+        return false;
+    detail::encode_fields<0>(place, fields...);
+    detail::commit_schema_record();
+    return true;
+}
+
+
+inline bool enabled(Level level, unsigned category) {
+    uint64_t filter = detail::Filter.load(std::memory_order_relaxed);
+    /* a shift by 64 bits and more is undefined, the bits of the filter
+     * above MAX_CATEGORIES are not categories */
+    return level >= (filter & 0xff) && category < MAX_CATEGORIES &&
+        ((filter >> detail::FILTER_CATEGORY_SHIFT) >> category & 1) != 0;
+}
+
 } // namespace memorylog
+
+
+/* Filtered logging, e.g. MEMORYLOG_FORMAT(DEBUG, 3, "state %d\n", state).
+ * The level is one of TRACE, DEBUG, INFO, WARNING, ERROR and the category
+ * is a number below MAX_CATEGORIES, a larger one filters the record out.
+ * A call site below MEMORYLOG_MIN_LEVEL compiles to nothing, a call site
+ * filtered out at runtime costs one relaxed load; in both cases the
+ * arguments are not evaluated. The macros return the result of the write
+ * or false if the record is filtered out. */
+#define MEMORYLOG_ENABLED(level, category) \
+    (::memorylog::compiled_in(::memorylog::LEVEL_##level) && \
+     ::memorylog::enabled(::memorylog::LEVEL_##level, (category)))
+
+#define MEMORYLOG_WRITE(level, category, buf, len) \
+    (MEMORYLOG_ENABLED(level, category) && ::memorylog::write((buf), (len)))
+
+#define MEMORYLOG_FORMAT(level, category, ...) \
+    (MEMORYLOG_ENABLED(level, category) && \
+     ::memorylog::format_write(__VA_ARGS__))
+
+#define MEMORYLOG_BINARY(level, category, ...) \
+    (MEMORYLOG_ENABLED(level, category) && \
+     ::memorylog::binary_write(__VA_ARGS__))
+
+#define MEMORYLOG_SCHEMA(level, category, ...) \
+    (MEMORYLOG_ENABLED(level, category) && \
+     ::memorylog::schema_write(__VA_ARGS__))
+
+/* The same for a Log object */
+#define MEMORYLOG_LOG_WRITE(log, level, category, buf, len) \
+    (MEMORYLOG_ENABLED(level, category) && (log).write((buf), (len)))
+
+#define MEMORYLOG_LOG_FORMAT(log, level, category, ...) \
+    (MEMORYLOG_ENABLED(level, category) && (log).format_write(__VA_ARGS__))
+
+#define MEMORYLOG_LOG_BINARY(log, level, category, ...) \
+    (MEMORYLOG_ENABLED(level, category) && (log).binary_write(__VA_ARGS__))
+
+#define MEMORYLOG_LOG_SCHEMA(log, level, category, ...) \
+    (MEMORYLOG_ENABLED(level, category) && (log).schema_write(__VA_ARGS__))
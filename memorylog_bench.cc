@@ -0,0 +1,855 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include <benchmark/benchmark.h>
+#include "memorylog.hh"
+#include "memorylog_decode.hh"
+#include "lz_codec.hh"
+#include "mt_ring_queue.hh"
+#include "bounded_queue.hh"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Run with --benchmark_format=json (or --benchmark_out=<file>
+ * --benchmark_out_format=json) to get machine readable results, two such
+ * files can be compared with tools/compare.py from google benchmark. */
+
+
+static const char RECORD[] = "state 12 -> 13 on event 1234567\n";
+
+constexpr size_t BENCH_BUFFER_SIZE = 64 * 1024 * 1024;
+constexpr size_t MAX_RECORD_SIZE = 1024;
+
+static char RecordBuffer[MAX_RECORD_SIZE];
+
+
+static int max_threads() {
+    return benchmark::CPUInfo::Get().num_cpus;
+}
+
+
+static void initialize_log(size_t chunk_size, size_t shards = 1) {
+    memorylog::Options options;
+    options.TotalBufferSize = BENCH_BUFFER_SIZE;
+    options.ChunkSize = chunk_size;
+    options.QueueShards = shards;
+    memorylog::initialize(options);
+    memset(RecordBuffer, 'x', sizeof(RecordBuffer));
+}
+
+
+static void teardown(const benchmark::State&) {
+    memorylog::finalize();
+}
+
+
+/* range(0) is the record size, range(1) is the chunk size */
+static void setup_record_chunk(const benchmark::State& state) {
+    initialize_log(state.range(1));
+}
+
+
+static void record_chunk_args(benchmark::internal::Benchmark* bench) {
+    bench->Setup(setup_record_chunk)->Teardown(teardown)
+        ->ArgNames({"record", "chunk"})
+        ->ArgsProduct({{16, 64, 256, 1024}, {4096, 65536, 1 << 20}})
+        ->ThreadRange(1, max_threads())
+        ->UseRealTime();
+}
+
+
+static void BM_Write(benchmark::State& state) {
+    size_t record_size = state.range(0);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(memorylog::write(RecordBuffer, record_size));
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * record_size);
+}
+
+BENCHMARK(BM_Write)->Apply(record_chunk_args);
+
+
+static void setup_batch(const benchmark::State&) {
+    initialize_log(65536);
+}
+
+
+/* range(0) records of range(1) bytes by one write_batch call, items are
+ * records, so ns per item compares with BM_Write */
+static void BM_WriteBatch(benchmark::State& state) {
+    std::vector<struct iovec> records(state.range(0));
+    for (auto& record : records)
+        record = {RecordBuffer, static_cast<size_t>(state.range(1))};
+    for (auto _ : state)
+        benchmark::DoNotOptimize(
+            memorylog::write_batch(records.data(), records.size()));
+    state.SetItemsProcessed(state.iterations() * records.size());
+    state.SetBytesProcessed(
+        state.iterations() * records.size() * state.range(1));
+}
+
+BENCHMARK(BM_WriteBatch)
+    ->Setup(setup_batch)->Teardown(teardown)
+    ->ArgNames({"batch", "record"})
+    ->ArgsProduct({{1, 10, 50}, {16, 64}})
+    ->ThreadRange(1, max_threads())->UseRealTime();
+
+
+/* the string argument makes the record as long as range(0) */
+static void BM_FormatWrite(benchmark::State& state) {
+    int string_size = state.range(0) - 12;
+    uint32_t counter = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(memorylog::format_write(
+            "%10u %.*s\n", ++counter, string_size, RecordBuffer));
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_FormatWrite)->Apply(record_chunk_args);
+
+
+/* the float conversions are the expensive part of printf */
+static void BM_FormatWriteFloat(benchmark::State& state) {
+    double value = 0.0;
+    for (auto _ : state) {
+        value += 1.25;
+        benchmark::DoNotOptimize(memorylog::format_write(
+            "%.3f %g %e\n", value, value / 7, value * 1e10));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_FormatWriteFloat)
+    ->Setup(setup_record_chunk)->Teardown(teardown)
+    ->ArgNames({"record", "chunk"})->Args({64, 65536})
+    ->ThreadRange(1, max_threads())->UseRealTime();
+
+
+/* doubles far from 1 have hundreds of exact digits */
+static void BM_FormatWriteFloatHuge(benchmark::State& state) {
+    double value = 1e300;
+    for (auto _ : state) {
+        value += 1e285;
+        benchmark::DoNotOptimize(memorylog::format_write(
+            "%g %e\n", value, 1 / value));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_FormatWriteFloatHuge)
+    ->Setup(setup_record_chunk)->Teardown(teardown)
+    ->ArgNames({"record", "chunk"})->Args({64, 65536})
+    ->ThreadRange(1, max_threads())->UseRealTime();
+
+
+/* the usual log lines: several short conversions, format 0 mixes
+ * numbers and strings, format 1 is numbers only */
+static void BM_FormatWriteArgs(benchmark::State& state) {
+    static const char* const STATES[] = {"SYN_SENT", "ESTABLISHED"};
+    uint32_t counter = 0;
+    for (auto _ : state) {
+        ++counter;
+        if (state.range(0) == 0)
+            benchmark::DoNotOptimize(memorylog::format_write(
+                "conn %d state %s -> %s seq %u\n", (int)(counter & 0xffff),
+                STATES[counter & 1], STATES[~counter & 1], counter));
+        else
+            benchmark::DoNotOptimize(memorylog::format_write(
+                "%d %d %d %d\n", (int)counter, -(int)counter,
+                (int)(counter >> 4), 7));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_FormatWriteArgs)
+    ->Setup(setup_record_chunk)->Teardown(teardown)
+    ->ArgNames({"format", "chunk"})->ArgsProduct({{0, 1}, {65536}})
+    ->ThreadRange(1, max_threads())->UseRealTime();
+
+
+/* a record built in place against a record built aside and copied */
+struct Transition {
+    uint64_t Key;
+    uint32_t From;
+    uint32_t To;
+    uint64_t Payload[30];
+};
+
+
+static void BM_CopyTransition(benchmark::State& state) {
+    uint64_t counter = 0;
+    for (auto _ : state) {
+        Transition record;
+        record.Key = ++counter;
+        record.From = counter;
+        record.To = counter + 1;
+        for (auto& word : record.Payload)
+            word = counter;
+        benchmark::DoNotOptimize(memorylog::write(
+            reinterpret_cast<const char*>(&record), sizeof(record)));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_CopyTransition)
+    ->Setup(setup_record_chunk)->Teardown(teardown)
+    ->ArgNames({"record", "chunk"})->Args({sizeof(Transition), 65536})
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+static void BM_ReserveTransition(benchmark::State& state) {
+    uint64_t counter = 0;
+    for (auto _ : state) {
+        auto record =
+            static_cast<Transition*>(memorylog::reserve(sizeof(Transition)));
+        if (record == nullptr)
+            continue;
+        record->Key = ++counter;
+        record->From = counter;
+        record->To = counter + 1;
+        for (auto& word : record->Payload)
+            word = counter;
+        benchmark::DoNotOptimize(memorylog::commit(sizeof(Transition)));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_ReserveTransition)
+    ->Setup(setup_record_chunk)->Teardown(teardown)
+    ->ArgNames({"record", "chunk"})->Args({sizeof(Transition), 65536})
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+/* range(0) is the chunk size */
+static void setup_chunk(const benchmark::State& state) {
+    initialize_log(state.range(0));
+}
+
+
+static void BM_BinaryWrite(benchmark::State& state) {
+    uint32_t counter = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(memorylog::binary_write(
+            "state %u -> %u on event %lu\n", counter, counter + 1,
+            (uint64_t)counter * 7));
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_BinaryWrite)
+    ->Setup(setup_chunk)->Teardown(teardown)
+    ->ArgName("chunk")->Arg(4096)->Arg(65536)
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+/* the record of BM_BinaryWrite as a schema: only the type id and
+ * the fields are stored */
+static const memorylog::Schema<uint32_t, uint32_t, uint64_t> STATE_CHANGE(
+    "state %u -> %u on event %lu\n");
+
+
+static void BM_SchemaWrite(benchmark::State& state) {
+    uint32_t counter = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(memorylog::schema_write(
+            STATE_CHANGE, counter, counter + 1, (uint64_t)counter * 7));
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_SchemaWrite)
+    ->Setup(setup_chunk)->Teardown(teardown)
+    ->ArgName("chunk")->Arg(4096)->Arg(65536)
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+/* range(0) is 1 if records have headers (timestamp, thread, sequence) */
+static void setup_record_header(const benchmark::State& state) {
+    memorylog::Options options;
+    options.TotalBufferSize = BENCH_BUFFER_SIZE;
+    options.ChunkSize = 65536;
+    options.RecordHeader = state.range(0) != 0;
+    memorylog::initialize(options);
+}
+
+
+static void BM_WriteRecordHeader(benchmark::State& state) {
+    for (auto _ : state)
+        benchmark::DoNotOptimize(
+            memorylog::write(RECORD, sizeof(RECORD) - 1));
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_WriteRecordHeader)
+    ->Setup(setup_record_header)->Teardown(teardown)
+    ->ArgName("header")->Arg(0)->Arg(1)
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+static void setup_record_chunk_64k(const benchmark::State&) {
+    initialize_log(65536);
+}
+
+
+/* range(0) is 1 if records have frames (length and checksum), range(1)
+ * is the record size */
+static void setup_record_frame(const benchmark::State& state) {
+    memorylog::Options options;
+    options.TotalBufferSize = BENCH_BUFFER_SIZE;
+    options.ChunkSize = 65536;
+    options.RecordFrame = state.range(0) != 0;
+    memorylog::initialize(options);
+    memset(RecordBuffer, 'x', sizeof(RecordBuffer));
+}
+
+
+static void BM_WriteRecordFrame(benchmark::State& state) {
+    size_t record_size = state.range(1);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(memorylog::write(RecordBuffer, record_size));
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * record_size);
+}
+
+BENCHMARK(BM_WriteRecordFrame)
+    ->Setup(setup_record_frame)->Teardown(teardown)
+    ->ArgNames({"frame", "record"})
+    ->ArgsProduct({{0, 1}, {32, 256}})
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+/* A call site filtered out at runtime, range(0) is 1 if it is enabled */
+static void setup_level(const benchmark::State& state) {
+    initialize_log(65536);
+    memorylog::set_level(
+        state.range(0) ? memorylog::LEVEL_TRACE : memorylog::LEVEL_INFO);
+}
+
+
+static void teardown_level(const benchmark::State&) {
+    memorylog::finalize();
+    memorylog::set_level(memorylog::LEVEL_TRACE);
+}
+
+
+static void BM_FilteredFormatWrite(benchmark::State& state) {
+    uint32_t counter = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(MEMORYLOG_FORMAT(
+            DEBUG, 0, "state %u -> %u\n", counter, counter + 1));
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_FilteredFormatWrite)
+    ->Setup(setup_level)->Teardown(teardown_level)
+    ->ArgName("enabled")->Arg(0)->Arg(1)
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+/* Each record fills a chunk, so every write switches to another chunk;
+ * range(0) is the number of queue shards (0 is one shard per CPU) */
+constexpr size_t SWITCH_CHUNK_SIZE = 256;
+
+static void setup_chunk_switch(const benchmark::State& state) {
+    initialize_log(SWITCH_CHUNK_SIZE, state.range(0));
+}
+
+
+static void BM_ChunkSwitch(benchmark::State& state) {
+    /* the record is larger than a half of the chunk */
+    size_t record_size = SWITCH_CHUNK_SIZE / 2 + 16;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(memorylog::write(RecordBuffer, record_size));
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_ChunkSwitch)
+    ->Setup(setup_chunk_switch)->Teardown(teardown)
+    ->ArgName("shards")->Arg(1)->Arg(0)
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+/* range(0) is the number of queue shards (0 is one shard per CPU),
+ * range(1) is the chunk size; small chunks make chunk switches frequent */
+static void setup_sharded(const benchmark::State& state) {
+    initialize_log(state.range(1), state.range(0));
+}
+
+
+static void BM_WriteSharded(benchmark::State& state) {
+    for (auto _ : state)
+        benchmark::DoNotOptimize(
+            memorylog::write(RECORD, sizeof(RECORD) - 1));
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_WriteSharded)
+    ->Setup(setup_sharded)->Teardown(teardown)
+    ->ArgNames({"shards", "chunk"})
+    ->ArgsProduct({{1, 0}, {256, 4096}})
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+/* range(0) is the huge page size, 0 is regular heap memory */
+static void BM_Initialize(benchmark::State& state) {
+    memorylog::Options options;
+    options.TotalBufferSize = BENCH_BUFFER_SIZE;
+    options.ChunkSize = 65536;
+    options.HugePageSize = state.range(0);
+    for (auto _ : state) {
+        memorylog::initialize(options);
+        memorylog::finalize();
+    }
+    state.SetBytesProcessed(state.iterations() * BENCH_BUFFER_SIZE);
+}
+
+BENCHMARK(BM_Initialize)
+    ->ArgName("huge_page")->Arg(0)->Arg(2 * 1024 * 1024)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+
+/* Small chunks scatter threads over the whole buffer, range(0) is
+ * the huge page size */
+static void setup_huge_pages(const benchmark::State& state) {
+    memorylog::Options options;
+    options.TotalBufferSize = BENCH_BUFFER_SIZE;
+    options.ChunkSize = 4096;
+    options.HugePageSize = state.range(0);
+    memorylog::initialize(options);
+}
+
+
+static void BM_WriteHugePages(benchmark::State& state) {
+    for (auto _ : state)
+        benchmark::DoNotOptimize(
+            memorylog::write(RECORD, sizeof(RECORD) - 1));
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_WriteHugePages)
+    ->Setup(setup_huge_pages)->Teardown(teardown)
+    ->ArgName("huge_page")->Arg(0)->Arg(2 * 1024 * 1024)
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+/* Hot writers with small chunks, range(0) is Options::LargeChunkSize
+ * (0 keeps the chunk size fixed); "switches" is the number of chunks
+ * taken per 1000 records */
+static void setup_adaptive(const benchmark::State& state) {
+    memorylog::Options options;
+    options.TotalBufferSize = BENCH_BUFFER_SIZE;
+    options.ChunkSize = 4096;
+    options.LargeChunkSize = state.range(0);
+    memorylog::initialize(options);
+}
+
+
+static void BM_WriteAdaptive(benchmark::State& state) {
+    for (auto _ : state)
+        benchmark::DoNotOptimize(
+            memorylog::write(RECORD, sizeof(RECORD) - 1));
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        memorylog::Stats stats;
+        memorylog::stats(stats);
+        state.counters["switches"] = 1000.0 * stats.TakenChunks
+            / (state.iterations() * state.threads());
+    }
+}
+
+BENCHMARK(BM_WriteAdaptive)
+    ->Setup(setup_adaptive)->Teardown(teardown)
+    ->ArgName("large_chunk")->Arg(0)->Arg(256 * 1024)
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+/* range(0) is Options::CompressedBufferSize, 0 turns the compressor off.
+ * The writer only hands full chunks over, compare the time with the one
+ * without compression; "ratio" is the raw size of the compressed records
+ * to their compressed size and "dropped" the share of full chunks the
+ * compressor did not get in time (it competes with the writer for CPU
+ * on a machine with a single one). */
+static void setup_compressed(const benchmark::State& state) {
+    memorylog::Options options;
+    options.TotalBufferSize = BENCH_BUFFER_SIZE;
+    options.ChunkSize = 65536;
+    options.CompressedBufferSize = state.range(0);
+    memorylog::initialize(options);
+}
+
+
+static void BM_WriteCompressed(benchmark::State& state) {
+    uint32_t event = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(memorylog::format_write(
+            "connection %u state CONNECTED -> IDLE on event %u\n",
+            event % 64, event));
+        ++event;
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    memorylog::Stats stats;
+    memorylog::stats(stats);
+    state.counters["ratio"] = stats.CompressedBytes == 0
+        ? 0 : (double)stats.CompressedRawBytes / stats.CompressedBytes;
+    state.counters["dropped"] = stats.FilledChunks == 0
+        ? 0 : (double)stats.DroppedChunks / stats.FilledChunks;
+}
+
+BENCHMARK(BM_WriteCompressed)
+    ->Setup(setup_compressed)->Teardown(teardown)
+    ->ArgName("compressed")->Arg(0)->Arg(BENCH_BUFFER_SIZE)
+    ->UseRealTime();
+
+
+/* The codec alone on a 64KB chunk of formatted records */
+static void BM_LzCompress(benchmark::State& state) {
+    std::string records;
+    char line[128];
+    for (uint32_t event = 0; records.size() < 65536; ++event)
+        records.append(line, snprintf(
+            line, sizeof(line),
+            "connection %u state CONNECTED -> IDLE on event %u\n",
+            event % 64, event));
+    std::vector<char> compressed(records.size());
+    size_t size = 0;
+    for (auto _ : state) {
+        size = memorylog::lz_compress(records.data(), records.size(),
+                                      compressed.data(), compressed.size());
+        benchmark::DoNotOptimize(size);
+    }
+    state.SetBytesProcessed(state.iterations() * records.size());
+    state.counters["ratio"] = (double)records.size() / size;
+}
+
+BENCHMARK(BM_LzCompress);
+
+
+/* A record written to one of several Log objects, it measures the lookup
+ * of the thread's chunk of the log; range(0) is the number of logs */
+static std::vector<std::unique_ptr<memorylog::Log>> BenchLogs;
+
+
+static void setup_logs(const benchmark::State& state) {
+    memorylog::Options options;
+    options.TotalBufferSize = BENCH_BUFFER_SIZE / state.range(0);
+    options.ChunkSize = 65536;
+    for (int i = 0; i < state.range(0); ++i)
+        BenchLogs.emplace_back(new memorylog::Log(options));
+}
+
+
+static void teardown_logs(const benchmark::State&) {
+    BenchLogs.clear();
+}
+
+
+static void BM_LogWrite(benchmark::State& state) {
+    size_t next = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+            BenchLogs[next]->write(RECORD, sizeof(RECORD) - 1));
+        if (++next == BenchLogs.size())
+            next = 0;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_LogWrite)
+    ->Setup(setup_logs)->Teardown(teardown_logs)
+    ->ArgName("logs")->Arg(1)->Arg(4)
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+/* Every thread takes an element and puts it back, like a chunk switch */
+static std::unique_ptr<memorylog::RingPtrQueue<void*, false>> BenchQueue;
+
+
+static void setup_queue(const benchmark::State& state) {
+    BenchQueue.reset(new memorylog::RingPtrQueue<void*, false>(state.range(0)));
+    for (uintptr_t i = 1; i <= (uintptr_t)state.range(0); ++i)
+        BenchQueue->enqueue((void*)i);
+}
+
+
+static void teardown_queue(const benchmark::State&) {
+    BenchQueue.reset();
+}
+
+
+static void BM_RingQueueHandoff(benchmark::State& state) {
+    for (auto _ : state) {
+        void* elem = BenchQueue->dequeue();
+        if (elem != nullptr)
+            BenchQueue->enqueue(elem);
+        benchmark::DoNotOptimize(elem);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_RingQueueHandoff)
+    ->Setup(setup_queue)->Teardown(teardown_queue)
+    ->ArgName("size")->Arg(64)->Arg(4096)
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+/* Same handoff, but every dequeue+enqueue pair is timed on its own and the
+ * percentiles of the pair latency are reported in nanoseconds. A thread
+ * preempted in the middle of an operation shows up in the tail of the
+ * RingPtrQueue, where the others spin waiting for it, while the bounded
+ * queue gives up and counts a failure instead. */
+template <typename QUEUE>
+static std::unique_ptr<QUEUE> LatencyQueue;
+
+
+template <typename QUEUE>
+static void setup_latency_queue(const benchmark::State& state) {
+    LatencyQueue<QUEUE>.reset(new QUEUE(state.range(0)));
+    for (uintptr_t i = 1; i <= (uintptr_t)state.range(0); ++i)
+        LatencyQueue<QUEUE>->enqueue((void*)i);
+}
+
+
+template <typename QUEUE>
+static void teardown_latency_queue(const benchmark::State&) {
+    LatencyQueue<QUEUE>.reset();
+}
+
+
+template <typename QUEUE>
+static void BM_QueueTailLatency(benchmark::State& state) {
+    using Clock = std::chrono::steady_clock;
+    std::vector<uint32_t> latencies;
+    latencies.reserve(1 << 20);
+    uint64_t failures = 0;
+
+    for (auto _ : state) {
+        auto start = Clock::now();
+        void* elem = LatencyQueue<QUEUE>->dequeue();
+        if (elem == nullptr || !LatencyQueue<QUEUE>->enqueue(elem))
+            ++failures;
+        auto elapsed = Clock::now() - start;
+        if (latencies.size() < latencies.capacity())
+            latencies.push_back(std::chrono::duration_cast<
+                std::chrono::nanoseconds>(elapsed).count());
+        benchmark::DoNotOptimize(elem);
+    }
+
+    /* an element failed to go back is lost for the rest of the run, that
+     * only shrinks the pool and is what the failure counter shows */
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double fraction) -> double {
+        if (latencies.empty())
+            return 0;
+        return latencies[(size_t)(fraction * (latencies.size() - 1))];
+    };
+    auto avg = benchmark::Counter::kAvgThreads;
+    state.counters["p50"] = benchmark::Counter(percentile(0.5), avg);
+    state.counters["p99"] = benchmark::Counter(percentile(0.99), avg);
+    state.counters["p999"] = benchmark::Counter(percentile(0.999), avg);
+    state.counters["max"] = benchmark::Counter(percentile(1.0), avg);
+    state.counters["failures"] = failures;
+    state.SetItemsProcessed(state.iterations());
+}
+
+using RingQueue = memorylog::RingPtrQueue<void*, false>;
+using BoundedQueue = memorylog::BoundedPtrQueue<void*>;
+
+BENCHMARK_TEMPLATE(BM_QueueTailLatency, RingQueue)
+    ->Setup(setup_latency_queue<RingQueue>)
+    ->Teardown(teardown_latency_queue<RingQueue>)
+    ->ArgName("size")->Arg(64)
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_QueueTailLatency, BoundedQueue)
+    ->Setup(setup_latency_queue<BoundedQueue>)
+    ->Teardown(teardown_latency_queue<BoundedQueue>)
+    ->ArgName("size")->Arg(64)
+    ->ThreadRange(1, max_threads())
+    ->UseRealTime();
+
+
+/* A thread pool with churn: every iteration starts a thread writing
+ * range(0) records and waits for it. "resumed" is the share of threads
+ * that went on in the chunk of an exited one, "waste_per_chunk" the
+ * average unused bytes of the chunks given up. */
+static void BM_ThreadChurn(benchmark::State& state) {
+    for (auto _ : state) {
+        std::thread thread([&state]() {
+            for (int64_t i = 0; i < state.range(0); ++i)
+                memorylog::write(RECORD, sizeof(RECORD) - 1);
+        });
+        thread.join();
+    }
+    memorylog::Stats stats;
+    memorylog::stats(stats);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.counters["resumed"] =
+        (double)stats.ResumedChunks / state.iterations();
+    state.counters["waste_per_chunk"] = stats.FilledChunks == 0
+        ? 0 : (double)stats.WastedBytes / stats.FilledChunks;
+}
+
+BENCHMARK(BM_ThreadChurn)
+    ->Setup(setup_record_chunk_64k)->Teardown(teardown)
+    ->ArgName("records")->Arg(10)->Arg(10000)
+    ->UseRealTime();
+
+
+/* A reader follows the writer with tail(), range(0) is the number of
+ * records written between two calls. The time per iteration includes
+ * the writes, compare with BM_Write; a call looks at all 1024 chunks. */
+static bool count_record(void* arg, const memorylog::TailRecord& record) {
+    *static_cast<size_t*>(arg) += record.Size;
+    return true;
+}
+
+
+static void BM_Tail(benchmark::State& state) {
+    memorylog::TailCursor cursor;
+    size_t bytes = 0;
+    memorylog::tail(cursor, count_record, &bytes);
+    for (auto _ : state) {
+        for (int64_t i = 0; i < state.range(0); ++i)
+            memorylog::write(RECORD, sizeof(RECORD) - 1);
+        memorylog::tail(cursor, count_record, &bytes);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.counters["missed"] = cursor.missed();
+}
+
+BENCHMARK(BM_Tail)
+    ->Setup(setup_record_chunk_64k)->Teardown(teardown)
+    ->ArgName("records")->Arg(16)->Arg(1024)
+    ->UseRealTime();
+
+
+/* A full 64MB buffer written out by the crash handler path against
+ * dump(), range(0) is 1 for dump() */
+static void setup_full_buffer(const benchmark::State&) {
+    initialize_log(65536);
+    for (size_t i = 0; i < BENCH_BUFFER_SIZE / 48; ++i)
+        memorylog::write(RECORD, sizeof(RECORD) - 1);
+}
+
+
+static void BM_CrashDump(benchmark::State& state) {
+    const char* filename = "memorylog_bench_crash";
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    for (auto _ : state) {
+        if (state.range(0) != 0) {
+            memorylog::dump(filename);
+        } else {
+            memorylog::crash_dump(fd);
+            state.PauseTiming();
+            ftruncate(fd, 0);
+            lseek(fd, 0, SEEK_SET);
+            state.ResumeTiming();
+        }
+    }
+    close(fd);
+    unlink(filename);
+    state.SetBytesProcessed(state.iterations() * BENCH_BUFFER_SIZE);
+}
+
+BENCHMARK(BM_CrashDump)
+    ->Setup(setup_full_buffer)->Teardown(teardown)
+    ->ArgName("dump")->Arg(0)->Arg(1)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+
+/* A dump of a full 64MB buffer of text and binary records, range(0) is
+ * the number of threads scanning it (0 means one per CPU), range(1) is 1
+ * if the records have frames */
+static std::string ExtractImages[2];
+
+
+static void setup_extract(const benchmark::State& state) {
+    std::string& image = ExtractImages[state.range(1)];
+    if (!image.empty())
+        return;
+    memorylog::Options options;
+    options.TotalBufferSize = BENCH_BUFFER_SIZE;
+    options.ChunkSize = 65536;
+    options.RecordFrame = state.range(1) != 0;
+    memorylog::initialize(options);
+    for (uint32_t i = 0; i < BENCH_BUFFER_SIZE / 32; ++i) {
+        if (i % 2 == 0)
+            memorylog::write(RECORD, sizeof(RECORD) - 1);
+        else
+            memorylog::binary_write("state %d -> %d on event %u\n", 12, 13, i);
+    }
+    memorylog::dump("bench-extract");
+    memorylog::finalize();
+
+    FILE* file = fopen("bench-extract", "r");
+    image.resize(BENCH_BUFFER_SIZE * 2);
+    image.resize(fread(&image[0], 1, image.size(), file));
+    fclose(file);
+    unlink("bench-extract");
+}
+
+
+static void BM_ExtractImage(benchmark::State& state) {
+    const std::string& image = ExtractImages[state.range(1)];
+    FILE* output = fopen("/dev/null", "w");
+    for (auto _ : state)
+        memorylog::extract_image(
+            image.data(), image.size(), output, state.range(0));
+    fclose(output);
+    state.SetBytesProcessed(state.iterations() * image.size());
+}
+
+BENCHMARK(BM_ExtractImage)
+    ->Setup(setup_extract)
+    ->ArgNames({"threads", "frame"})
+    ->ArgsProduct({{1, 0}, {0, 1}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+
+BENCHMARK_MAIN();
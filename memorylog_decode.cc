@@ -0,0 +1,1029 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "memorylog_decode.hh"
+#include "memorylog.hh"
+#include "record_format.hh"
+#include "lz_codec.hh"
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+namespace memorylog {
+
+
+namespace {
+
+
+/* images smaller than this are not worth splitting between threads */
+constexpr size_t MIN_SEGMENT_SIZE = 1 << 20;
+
+
+struct DecodedArg {
+    detail::BinaryArgType Type;
+    union {
+        int64_t Int;
+        uint64_t Uint;
+        double Double;
+        uint64_t Pointer;
+    };
+    const char* String;
+    uint32_t StringLength;
+};
+
+
+bool parse_binary_args(
+    const char* payload, size_t size,
+    std::vector<DecodedArg>& args, size_t& record_size)
+{
+    if (size < BINARY_RECORD_HEADER_SIZE)
+        return false;
+    size_t args_number = static_cast<unsigned char>(payload[sizeof(uint64_t)]);
+    if (args_number > detail::MAX_BINARY_ARGS)
+        return false;
+    if (size < BINARY_RECORD_HEADER_SIZE + args_number)
+        return false;
+
+    const char* types = payload + BINARY_RECORD_HEADER_SIZE;
+    const char* place = types + args_number;
+    const char* end = payload + size;
+
+    args.clear();
+    for (size_t i = 0; i < args_number; ++i) {
+        DecodedArg arg;
+        arg.Type = static_cast<detail::BinaryArgType>(types[i]);
+        /* a string is 0 for the conversions taking a number, e.g. %*d */
+        arg.Uint = 0;
+        arg.String = nullptr;
+        arg.StringLength = 0;
+
+        size_t value_size;
+        switch (arg.Type) {
+        case detail::ARG_INT32:
+        case detail::ARG_UINT32:
+        case detail::ARG_STRING:
+            value_size = sizeof(uint32_t);
+            break;
+        case detail::ARG_INT64:
+        case detail::ARG_UINT64:
+        case detail::ARG_DOUBLE:
+        case detail::ARG_POINTER:
+            value_size = sizeof(uint64_t);
+            break;
+        default:
+            return false;
+        }
+        if ((size_t)(end - place) < value_size)
+            return false;
+
+        switch (arg.Type) {
+        case detail::ARG_INT32: {
+            int32_t value;
+            memcpy(&value, place, sizeof(value));
+            arg.Int = value;
+            break;
+        }
+        case detail::ARG_UINT32: {
+            uint32_t value;
+            memcpy(&value, place, sizeof(value));
+            arg.Uint = value;
+            break;
+        }
+        case detail::ARG_STRING:
+            memcpy(&arg.StringLength, place, sizeof(arg.StringLength));
+            if ((size_t)(end - place) - value_size < arg.StringLength)
+                return false;
+            arg.String = place + value_size;
+            place += arg.StringLength;
+            break;
+        case detail::ARG_DOUBLE:
+            memcpy(&arg.Double, place, sizeof(arg.Double));
+            break;
+        default:
+            memcpy(&arg.Uint, place, sizeof(arg.Uint));
+            break;
+        }
+        place += value_size;
+        args.push_back(arg);
+    }
+
+    record_size = place - payload;
+    return true;
+}
+
+
+size_t schema_field_size(unsigned char type) {
+    switch (type) {
+    case detail::FIELD_INT8:
+    case detail::FIELD_UINT8:
+    case detail::FIELD_BOOL:
+        return 1;
+    case detail::FIELD_INT16:
+    case detail::FIELD_UINT16:
+        return 2;
+    case detail::FIELD_INT32:
+    case detail::FIELD_UINT32:
+    case detail::FIELD_FLOAT:
+        return 4;
+    case detail::FIELD_INT64:
+    case detail::FIELD_UINT64:
+    case detail::FIELD_DOUBLE:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+
+/* Turns the fields of a schema record into the arguments of binary
+ * records, so both are formatted the same way */
+bool parse_schema_fields(
+    const char* payload, size_t size,
+    const unsigned char* types, size_t fields,
+    std::vector<DecodedArg>& args, size_t& record_size)
+{
+    const char* place = payload + SCHEMA_RECORD_HEADER_SIZE;
+    const char* end = payload + size;
+
+    args.clear();
+    for (size_t i = 0; i < fields; ++i) {
+        size_t value_size = schema_field_size(types[i]);
+        if (value_size == 0 || (size_t)(end - place) < value_size)
+            return false;
+
+        DecodedArg arg;
+        arg.String = nullptr;
+        arg.StringLength = 0;
+        switch (types[i]) {
+        case detail::FIELD_INT8:
+        case detail::FIELD_INT16:
+        case detail::FIELD_INT32:
+        case detail::FIELD_INT64: {
+            /* sign-extends the little-endian bytes of the field */
+            uint64_t value = 0;
+            memcpy(&value, place, value_size);
+            unsigned shift = 64 - 8 * value_size;
+            arg.Int = (int64_t)(value << shift) >> shift;
+            arg.Type = value_size == sizeof(int64_t)
+                ? detail::ARG_INT64 : detail::ARG_INT32;
+            break;
+        }
+        case detail::FIELD_FLOAT: {
+            float value;
+            memcpy(&value, place, sizeof(value));
+            arg.Double = value;
+            arg.Type = detail::ARG_DOUBLE;
+            break;
+        }
+        case detail::FIELD_DOUBLE:
+            memcpy(&arg.Double, place, sizeof(arg.Double));
+            arg.Type = detail::ARG_DOUBLE;
+            break;
+        default:
+            arg.Uint = 0;
+            memcpy(&arg.Uint, place, value_size);
+            arg.Type = value_size == sizeof(uint64_t)
+                ? detail::ARG_UINT64 : detail::ARG_UINT32;
+            break;
+        }
+        place += value_size;
+        args.push_back(arg);
+    }
+
+    record_size = place - payload;
+    return true;
+}
+
+
+template <typename VALUE>
+void append_formatted(std::string& result, const char* spec, VALUE value) {
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), spec, value);
+    if (len < 0)
+        return;
+    if ((size_t)len < sizeof(buf)) {
+        result.append(buf, len);
+        return;
+    }
+    std::vector<char> big(len + 1);
+    snprintf(big.data(), big.size(), spec, value);
+    result.append(big.data(), len);
+}
+
+
+int64_t arg_as_signed(const DecodedArg& arg) {
+    return arg.Type == detail::ARG_DOUBLE ? (int64_t)arg.Double : arg.Int;
+}
+
+
+uint64_t arg_as_unsigned(const DecodedArg& arg) {
+    return arg.Type == detail::ARG_DOUBLE ? (uint64_t)arg.Double : arg.Uint;
+}
+
+
+bool arg_is_64bit(const DecodedArg& arg) {
+    return arg.Type != detail::ARG_INT32 && arg.Type != detail::ARG_UINT32;
+}
+
+
+/* Re-runs the printf-like formatting with the stored arguments. Every
+ * conversion is rebuilt with a length modifier matching the stored type
+ * of the argument, so a mismatch between the format and the arguments
+ * does not lead to undefined behavior here. */
+void format_args(
+    const char* format, const std::vector<DecodedArg>& args,
+    std::string& result)
+{
+    size_t next_arg = 0;
+    const char* pos = format;
+
+    while (*pos != '\0') {
+        if (*pos != '%') {
+            const char* next = strchr(pos, '%');
+            if (next == nullptr)
+                next = pos + strlen(pos);
+            result.append(pos, next - pos);
+            pos = next;
+            continue;
+        }
+
+        const char* spec_start = pos++;
+        if (*pos == '%') {
+            result.push_back('%');
+            ++pos;
+            continue;
+        }
+
+        std::string spec("%");
+        while (*pos != '\0' && strchr("-+ #0'", *pos) != nullptr)
+            spec.push_back(*pos++);
+
+        for (int part = 0; part < 2; ++part) {
+            if (part == 1) {
+                if (*pos != '.')
+                    break;
+                spec.push_back(*pos++);
+            }
+            if (*pos == '*') {
+                ++pos;
+                if (next_arg < args.size())
+                    spec += std::to_string(arg_as_signed(args[next_arg++]));
+            } else {
+                while (*pos >= '0' && *pos <= '9')
+                    spec.push_back(*pos++);
+            }
+        }
+
+        std::string length;
+        while (*pos != '\0' && strchr("hlqjztL", *pos) != nullptr)
+            length.push_back(*pos++);
+
+        char conversion = *pos;
+        if (conversion == '\0' || next_arg >= args.size()) {
+            /* malformed format or not enough arguments, keep it as is */
+            result.append(spec_start, pos + (conversion != '\0') - spec_start);
+            if (conversion != '\0')
+                ++pos;
+            continue;
+        }
+        ++pos;
+
+        const DecodedArg& arg = args[next_arg++];
+        if (arg.Type == detail::ARG_STRING
+            && strchr("diuoxXceEfFgGaAp", conversion) != nullptr) {
+            result.append("(string)");
+            continue;
+        }
+        switch (conversion) {
+        case 'd':
+        case 'i': {
+            int64_t value = arg_as_signed(arg);
+            if (length == "hh")
+                value = (signed char)value;
+            else if (length == "h")
+                value = (short)value;
+            else if (length.empty() && !arg_is_64bit(arg))
+                value = (int)value;
+            append_formatted(result, (spec + "ll" + conversion).c_str(),
+                             (long long)value);
+            break;
+        }
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X': {
+            uint64_t value = arg_as_unsigned(arg);
+            if (length == "hh")
+                value = (unsigned char)value;
+            else if (length == "h")
+                value = (unsigned short)value;
+            else if (length.empty() && !arg_is_64bit(arg))
+                value = (unsigned)value;
+            append_formatted(result, (spec + "ll" + conversion).c_str(),
+                             (unsigned long long)value);
+            break;
+        }
+        case 'c':
+            append_formatted(result, (spec + conversion).c_str(),
+                             (int)arg_as_signed(arg));
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A': {
+            double value = arg.Type == detail::ARG_DOUBLE
+                ? arg.Double : (double)arg_as_signed(arg);
+            append_formatted(result, (spec + conversion).c_str(), value);
+            break;
+        }
+        case 's':
+            if (arg.Type == detail::ARG_STRING) {
+                std::string value(arg.String, arg.StringLength);
+                append_formatted(result, (spec + 's').c_str(), value.c_str());
+            } else {
+                result.append("(not a string)");
+            }
+            break;
+        case 'p':
+            append_formatted(result, (spec + 'p').c_str(),
+                             (const void*)(uintptr_t)arg.Pointer);
+            break;
+        default:
+            /* %n and unknown conversions are skipped */
+            break;
+        }
+    }
+}
+
+
+void format_unknown(
+    uint64_t address, const std::vector<DecodedArg>& args,
+    std::string& result)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "<unknown format %#llx>",
+             (unsigned long long)address);
+    result.append(buf);
+    for (const auto& arg : args) {
+        result.push_back(' ');
+        switch (arg.Type) {
+        case detail::ARG_INT32:
+        case detail::ARG_INT64:
+            result += std::to_string(arg.Int);
+            break;
+        case detail::ARG_DOUBLE:
+            append_formatted(result, "%g", arg.Double);
+            break;
+        case detail::ARG_STRING:
+            result.push_back('"');
+            result.append(arg.String, arg.StringLength);
+            result.push_back('"');
+            break;
+        default:
+            result += std::to_string(arg.Uint);
+            break;
+        }
+    }
+}
+
+
+struct DecodedRecord {
+    bool HasHeader;
+    RecordHeader Header;
+    std::string Text;
+    /* where the record starts and where the scan goes on after it */
+    const char* Start;
+    const char* End;
+};
+
+
+/* The field types and the format of a type id from the manifest */
+struct SchemaLayout {
+    std::string Types;
+    std::string Format;
+};
+
+
+/* Format strings, schemas and the clock calibration found in an image */
+struct ImageFormats {
+    std::unordered_map<uint64_t, std::string> Formats;
+    std::unordered_map<uint32_t, SchemaLayout> Schemas;
+    ClockCalibration Calibration;
+    bool Calibrated = false;
+};
+
+
+/* A part of an image scanned by one thread: records starting in
+ * [Begin, Stop) are its own, though they may run past Stop */
+struct ImageSegment {
+    const char* Begin;
+    const char* Stop;
+    ImageFormats Formats;
+    std::vector<DecodedRecord> Records;
+};
+
+
+/* Prints "[time thread:sequence] ", the time is UTC if the clock
+ * calibration is known and raw clock ticks otherwise */
+void format_header(
+    const RecordHeader& header, const ClockCalibration* calibration,
+    std::string& result)
+{
+    char buf[96];
+    if (calibration != nullptr) {
+        long double rate =
+            (long double)(calibration->Nanoseconds[1] -
+                          calibration->Nanoseconds[0]) /
+            (calibration->Ticks[1] - calibration->Ticks[0]);
+        long double nanoseconds = calibration->Nanoseconds[0] +
+            ((long double)header.Timestamp - calibration->Ticks[0]) * rate;
+        uint64_t total = nanoseconds < 0 ? 0 : (uint64_t)nanoseconds;
+        time_t seconds = total / 1000000000ull;
+        struct tm utc;
+        gmtime_r(&seconds, &utc);
+        size_t len = strftime(buf, sizeof(buf), "[%Y-%m-%d %H:%M:%S", &utc);
+        snprintf(buf + len, sizeof(buf) - len, ".%09llu %u:%u] ",
+                 (unsigned long long)(total % 1000000000ull),
+                 header.ThreadId, header.Sequence);
+    } else {
+        snprintf(buf, sizeof(buf), "[%llu %u:%u] ",
+                 (unsigned long long)header.Timestamp,
+                 header.ThreadId, header.Sequence);
+    }
+    result += buf;
+}
+
+
+/* Checks the frame of a record, payload points to the frame. Returns
+ * the end of the record and moves payload past the frame, or nullptr if
+ * the record does not match its frame (torn, overwritten or not
+ * a record at all) */
+const char* check_frame(const char*& payload, const char* end) {
+    RecordFrame frame;
+    if ((size_t)(end - payload) < sizeof(frame))
+        return nullptr;
+    memcpy(&frame, payload, sizeof(frame));
+    const char* framed = payload + sizeof(frame);
+    if ((size_t)(end - framed) < frame.Length)
+        return nullptr;
+    if (record_checksum(framed, frame.Length) != frame.Checksum)
+        return nullptr;
+    payload = framed;
+    return framed + frame.Length;
+}
+
+
+/* Restores the records of a compressed block starting at pos. Returns
+ * the end of the block or nullptr if the block is damaged (torn by
+ * a dump taken while the block was written or partly overwritten). */
+const char* read_compressed_block(
+    const char* pos, const char* end, std::vector<char>& raw)
+{
+    const char* stored = pos + RECORD_PREFIX_SIZE;
+    CompressedBlockHeader header;
+    if ((size_t)(end - stored) < sizeof(header))
+        return nullptr;
+    memcpy(&header, stored, sizeof(header));
+    stored += sizeof(header);
+    if ((size_t)(end - stored) < header.Size)
+        return nullptr;
+    if (record_checksum(stored, header.Size) != header.Checksum)
+        return nullptr;
+
+    std::vector<char> unmasked(stored, stored + header.Size);
+    for (auto& byte : unmasked)
+        byte ^= COMPRESSED_BYTES_MASK;
+    raw.resize(header.RawSize);
+    if (header.Method == COMPRESSION_NONE) {
+        if (header.Size != header.RawSize)
+            return nullptr;
+        raw.swap(unmasked);
+    } else if (header.Method != COMPRESSION_LZ77 ||
+               !lz_decompress(unmasked.data(), unmasked.size(),
+                              raw.data(), raw.size())) {
+        return nullptr;
+    }
+    return stored + header.Size;
+}
+
+
+/* Returns the first aligned position from pos (before stop) where a record
+ * starts. With SSE2 a whole prefix is compared in one instruction, so
+ * the scan runs at the speed of memory. If nothing is found the returned
+ * position is stop or the last place where a prefix still fits. */
+const char* find_record(const char* pos, const char* stop, const char* end) {
+    if (end - pos < (ptrdiff_t)RECORD_PREFIX_SIZE)
+        return pos;
+    if (stop > end - RECORD_PREFIX_SIZE + 1)
+        stop = end - RECORD_PREFIX_SIZE + 1;
+#ifdef __SSE2__
+    const __m128i prefix =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(RECORD_PREFIX));
+    /* the flags and the kind are checked by record_kind */
+    const int variable_bytes = (1 << RECORD_HEADER_POS) |
+        (1 << RECORD_KIND_POS) | (1 << RECORD_FRAME_POS);
+    for (; pos < stop; pos += RECORD_ALIGNMENT) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+        int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(block, prefix));
+        if ((equal | variable_bytes) == 0xFFFF && record_kind(pos) != 0)
+            return pos;
+    }
+#else
+    for (; pos < stop; pos += RECORD_ALIGNMENT) {
+        if (record_kind(pos) != 0)
+            return pos;
+    }
+#endif
+    return pos;
+}
+
+
+/* Collects format strings, schemas and the clock calibration of
+ * the segment */
+void collect_formats(ImageSegment& segment, const char* end) {
+    ImageFormats& found = segment.Formats;
+    for (const char* pos = find_record(segment.Begin, segment.Stop, end);
+         pos < segment.Stop && end - pos >= (ptrdiff_t)RECORD_PREFIX_SIZE;
+         pos = find_record(pos + RECORD_ALIGNMENT, segment.Stop, end))
+    {
+        char kind = record_kind(pos);
+        const char* entry = pos + RECORD_PREFIX_SIZE;
+        if (kind == RECORD_KIND_CLOCK && !found.Calibrated &&
+            (size_t)(end - entry) >= sizeof(found.Calibration))
+        {
+            memcpy(&found.Calibration, entry, sizeof(found.Calibration));
+            found.Calibrated =
+                found.Calibration.Ticks[1] > found.Calibration.Ticks[0];
+            continue;
+        }
+        if (kind == RECORD_KIND_SCHEMA_ENTRY &&
+            (size_t)(end - entry) >= sizeof(SchemaEntryHeader))
+        {
+            SchemaEntryHeader header;
+            memcpy(&header, entry, sizeof(header));
+            entry += sizeof(header);
+            if ((size_t)(end - entry) < (size_t)header.Fields + header.Length)
+                continue;
+            SchemaLayout& layout = found.Schemas[header.Id];
+            layout.Types.assign(entry, header.Fields);
+            layout.Format.assign(entry + header.Fields, header.Length);
+            continue;
+        }
+        if (kind != RECORD_KIND_FORMAT)
+            continue;
+        if ((size_t)(end - entry) < sizeof(FormatEntryHeader))
+            continue;
+        FormatEntryHeader header;
+        memcpy(&header, entry, sizeof(header));
+        entry += sizeof(header);
+        if ((size_t)(end - entry) < header.Length)
+            continue;
+        found.Formats[header.Address].assign(entry, header.Length);
+    }
+}
+
+
+/* Merges the formats of the segments, a later entry wins like it does
+ * when the image is scanned from the start to the end */
+void merge_formats(std::vector<ImageSegment>& segments, ImageFormats& result) {
+    for (auto& segment : segments) {
+        ImageFormats& found = segment.Formats;
+        if (found.Calibrated && !result.Calibrated) {
+            result.Calibration = found.Calibration;
+            result.Calibrated = true;
+        }
+        for (auto& format : found.Formats)
+            result.Formats[format.first] = std::move(format.second);
+        found.Formats.clear();
+        for (auto& schema : found.Schemas)
+            result.Schemas[schema.first] = std::move(schema.second);
+        found.Schemas.clear();
+    }
+}
+
+
+/* Decodes the records starting in [pos, segment.Stop) */
+void decode_segment(
+    const char* image, const char* pos, const char* end,
+    const ImageFormats& formats, ImageSegment& segment)
+{
+    segment.Records.clear();
+    for (;;) {
+        pos = find_record(pos, segment.Stop, end);
+        if (pos >= segment.Stop || end - pos < (ptrdiff_t)RECORD_PREFIX_SIZE)
+            break;
+
+        char kind = record_kind(pos);
+        const char* payload = pos + RECORD_PREFIX_SIZE;
+        size_t record_size = 0;
+
+        if (kind == RECORD_KIND_COMPRESSED) {
+            std::vector<char> raw;
+            const char* block_end = read_compressed_block(pos, end, raw);
+            if (block_end == nullptr) {
+                pos += RECORD_ALIGNMENT;
+                continue;
+            }
+            ImageSegment block;
+            block.Begin = raw.data();
+            block.Stop = raw.data() + raw.size();
+            decode_segment(raw.data(), block.Begin, block.Stop, formats, block);
+
+            /* the records of the block start where the block starts and
+             * the last one ends where the block ends, so the stitching of
+             * the segments treats the block as a whole */
+            const char* block_start = pos;
+            pos = block_end;
+            size_t misalignment = (pos - image) % RECORD_ALIGNMENT;
+            if (misalignment != 0)
+                pos += RECORD_ALIGNMENT - misalignment;
+            for (auto& record : block.Records) {
+                record.Start = block_start;
+                record.End = block_start;
+                segment.Records.push_back(std::move(record));
+            }
+            if (!block.Records.empty())
+                segment.Records.back().End = pos;
+            continue;
+        }
+
+        DecodedRecord record;
+        record.HasHeader = false;
+        record.Header.Timestamp = 0;
+        record.Start = pos;
+
+        /* a framed record ends exactly where its frame says */
+        const char* limit = end;
+        bool is_record = kind == RECORD_KIND_TEXT ||
+            kind == RECORD_KIND_BINARY || kind == RECORD_KIND_SCHEMA;
+        bool framed = is_record && record_has_frame(pos);
+        if (framed) {
+            limit = check_frame(payload, end);
+            if (limit == nullptr) {
+                pos += RECORD_ALIGNMENT;
+                continue;
+            }
+        }
+
+        if (is_record && record_has_header(pos)) {
+            if ((size_t)(limit - payload) < sizeof(RecordHeader)) {
+                pos += RECORD_ALIGNMENT;
+                continue;
+            }
+            memcpy(&record.Header, payload, sizeof(RecordHeader));
+            record.HasHeader = true;
+            payload += sizeof(RecordHeader);
+        }
+
+        if (kind == RECORD_KIND_TEXT) {
+            record_size = framed
+                ? limit - payload : text_record_size(payload, end);
+            record.Text.assign(payload, record_size);
+        } else if (kind == RECORD_KIND_BINARY &&
+                   (size_t)(limit - payload) >= BINARY_RECORD_HEADER_SIZE)
+        {
+            auto found = formats.Formats.find(binary_record_format(payload));
+            const char* format = found == formats.Formats.end()
+                ? nullptr : found->second.c_str();
+            if (!format_binary_record(
+                    payload, limit - payload, format, record.Text, record_size))
+                kind = 0;
+        } else if (kind == RECORD_KIND_SCHEMA &&
+                   (size_t)(limit - payload) >= SCHEMA_RECORD_HEADER_SIZE)
+        {
+            auto found = formats.Schemas.find(schema_record_id(payload));
+            bool known = found != formats.Schemas.end();
+            if (!format_schema_record(
+                    payload, limit - payload,
+                    known ? reinterpret_cast<const unsigned char*>(
+                        found->second.Types.data()) : nullptr,
+                    known ? found->second.Types.size() : 0,
+                    known ? found->second.Format.c_str() : nullptr,
+                    record.Text, record_size))
+                kind = 0;
+        } else {
+            kind = 0;
+        }
+
+        if (kind == 0) {
+            pos += RECORD_ALIGNMENT;
+            continue;
+        }
+
+        pos = framed ? limit : payload + record_size;
+        size_t misalignment = (pos - image) % RECORD_ALIGNMENT;
+        if (misalignment != 0)
+            pos += RECORD_ALIGNMENT - misalignment;
+        record.End = pos;
+        segment.Records.push_back(std::move(record));
+    }
+}
+
+
+/* Runs job(index) for every index below count on the given number of
+ * threads, the calling thread is one of them */
+template <typename JOB>
+void run_parallel(size_t count, unsigned threads, JOB job) {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t index = next++; index < count; index = next++)
+            job(index);
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads && i < count; ++i)
+        workers.emplace_back(worker);
+    worker();
+    for (auto& thread : workers)
+        thread.join();
+}
+
+
+bool write_record(
+    const DecodedRecord& record, const ImageFormats& formats,
+    std::string& text, FILE* output)
+{
+    text.clear();
+    if (record.HasHeader)
+        format_header(
+            record.Header,
+            formats.Calibrated ? &formats.Calibration : nullptr, text);
+    text += record.Text;
+    if (text.empty() || text.back() != '\n')
+        text.push_back('\n');
+    return fwrite(text.data(), text.size(), 1, output) == 1;
+}
+
+
+} // anonymous namespace
+
+
+uint64_t binary_record_format(const char* payload) {
+    uint64_t address;
+    memcpy(&address, payload, sizeof(address));
+    return address;
+}
+
+
+bool format_binary_record(
+    const char* payload, size_t size, const char* format,
+    std::string& result, size_t& record_size)
+{
+    std::vector<DecodedArg> args;
+    if (!parse_binary_args(payload, size, args, record_size))
+        return false;
+
+    if (format != nullptr)
+        format_args(format, args, result);
+    else
+        format_unknown(binary_record_format(payload), args, result);
+    return true;
+}
+
+
+uint32_t schema_record_id(const char* payload) {
+    uint32_t id;
+    memcpy(&id, payload, sizeof(id));
+    return id;
+}
+
+
+bool format_schema_record(
+    const char* payload, size_t size,
+    const unsigned char* types, size_t fields, const char* format,
+    std::string& result, size_t& record_size)
+{
+    if (size < SCHEMA_RECORD_HEADER_SIZE)
+        return false;
+    if (types == nullptr) {
+        /* the size of the fields is unknown as well */
+        char buf[64];
+        snprintf(buf, sizeof(buf), "<unknown schema %u>",
+                 schema_record_id(payload));
+        result.append(buf);
+        record_size = SCHEMA_RECORD_HEADER_SIZE;
+        return true;
+    }
+
+    std::vector<DecodedArg> args;
+    if (!parse_schema_fields(payload, size, types, fields, args, record_size))
+        return false;
+    format_args(format, args, result);
+    return true;
+}
+
+
+bool decode_image(const char* image, size_t size, FILE* output) {
+    return extract_image(image, size, output, 1);
+}
+
+
+bool extract_image(
+    const char* image, size_t size, FILE* output,
+    unsigned threads, size_t segment_size)
+{
+    const char* const end = image + size;
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    if (segment_size == 0)
+        segment_size = std::max(size / (threads * 4), MIN_SEGMENT_SIZE);
+    segment_size = (segment_size + RECORD_ALIGNMENT - 1) /
+        RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+
+    std::vector<ImageSegment> segments((size + segment_size - 1) / segment_size);
+    for (size_t i = 0; i < segments.size(); ++i) {
+        segments[i].Begin = image + i * segment_size;
+        segments[i].Stop = image + std::min(size, (i + 1) * segment_size);
+    }
+
+    /* the first pass collects format strings and the clock calibration */
+    run_parallel(segments.size(), threads, [&](size_t index) {
+        collect_formats(segments[index], end);
+    });
+    ImageFormats formats;
+    merge_formats(segments, formats);
+
+    /* The second pass decodes the segments in parallel while this thread
+     * writes them out in order. A segment is decoded no further than
+     * "window" segments ahead of the writer, which limits the memory
+     * held by decoded records. */
+    std::mutex mutex;
+    std::condition_variable progress;
+    std::vector<char> decoded(segments.size(), 0);
+    size_t next = 0;
+    size_t written = 0;
+    bool stopped = false;
+    const size_t window = 2 * threads;
+
+    auto worker = [&]() {
+        for (;;) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                progress.wait(lock, [&]() {
+                    return stopped || next >= segments.size() ||
+                        next < written + window;
+                });
+                if (stopped || next >= segments.size())
+                    return;
+                index = next++;
+            }
+            ImageSegment& segment = segments[index];
+            decode_segment(image, segment.Begin, end, formats, segment);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                decoded[index] = 1;
+            }
+            progress.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; threads > 1 && i < threads && i < segments.size(); ++i)
+        workers.emplace_back(worker);
+
+    /* Records without a header go out at once. Records with headers are
+     * sorted by timestamps at the end, they come after the others as if
+     * those had timestamp 0. Each chunk is already ordered, so the stable
+     * merge sort mostly merges runs of records of the chunks. */
+    std::vector<DecodedRecord> with_headers;
+    std::string text;
+    const char* resume = image;
+    bool result = true;
+
+    for (size_t index = 0; index < segments.size() && result; ++index) {
+        ImageSegment& segment = segments[index];
+        if (workers.empty()) {
+            decode_segment(image, segment.Begin, end, formats, segment);
+        } else {
+            std::unique_lock<std::mutex> lock(mutex);
+            progress.wait(lock, [&]() { return decoded[index] != 0; });
+        }
+
+        /* The last record of the previous segment may run into this one,
+         * the scan goes on right after it. Normally this segment finds
+         * nothing before that point and its records stay as they are.
+         * If one of them overlaps the point, the segment was scanned out
+         * of step with a sequential scan and is decoded again from it. */
+        if (resume > segment.Begin && resume < segment.Stop) {
+            for (const auto& record : segment.Records) {
+                if (record.Start < resume && record.End > resume) {
+                    decode_segment(image, resume, end, formats, segment);
+                    break;
+                }
+            }
+        }
+
+        for (auto& record : segment.Records) {
+            if (record.Start < resume)
+                continue;
+            resume = record.End;
+            if (record.HasHeader)
+                with_headers.push_back(std::move(record));
+            else if (!write_record(record, formats, text, output))
+                result = false;
+        }
+        segment.Records.clear();
+        segment.Records.shrink_to_fit();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            written = index + 1;
+            stopped = !result;
+        }
+        progress.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+    }
+    progress.notify_all();
+    for (auto& thread : workers)
+        thread.join();
+
+    std::stable_sort(
+        with_headers.begin(), with_headers.end(),
+        [](const DecodedRecord& left, const DecodedRecord& right) {
+            return left.Header.Timestamp < right.Header.Timestamp;
+        });
+    for (size_t i = 0; i < with_headers.size() && result; ++i)
+        result = write_record(with_headers[i], formats, text, output);
+    return result;
+}
+
+
+bool decode_file(const char* filename, FILE* output) {
+    return extract_file(filename, output, 1);
+}
+
+
+bool extract_file(const char* filename, FILE* output, unsigned threads) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = file_stat.st_size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+
+    void* image = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return false;
+
+    bool result = extract_image(
+        static_cast<const char*>(image), size, output, threads);
+    munmap(image, size);
+    return result;
+}
+
+
+} // namespace memorylog
@@ -0,0 +1,86 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+
+namespace memorylog {
+
+
+/* Decodes the records found in a memory image (a file written by dump()
+ * or a coredump) and prints them as text to the output, one record
+ * per line. Binary records are formatted with the format strings found
+ * in the same image. Records with headers (Options::RecordHeader) are
+ * sorted by their timestamps and printed as "[time thread:sequence] text".
+ * Returns false only if the output fails. */
+bool decode_image(const char* image, size_t size, FILE* output);
+
+/* The same as decode_image for a file, returns false if the file could
+ * not be read */
+bool decode_file(const char* filename, FILE* output);
+
+/* Does the same as decode_image and gives the same output, but splits the
+ * image into segments of segment_size bytes (0 picks the size from the
+ * image size) and scans them on the given number of threads (0 means one
+ * per CPU). The output is written by the calling thread while the next
+ * segments are decoded, records with headers are written at the end. */
+bool extract_image(
+    const char* image, size_t size, FILE* output,
+    unsigned threads, size_t segment_size = 0);
+
+/* The same as extract_image for a file */
+bool extract_file(const char* filename, FILE* output, unsigned threads);
+
+/* Returns the address of the format string of a binary record,
+ * payload points right after the prefix */
+uint64_t binary_record_format(const char* payload);
+
+/* Formats a single binary record, payload points right after the prefix
+ * and size is the number of bytes available from there. The format may
+ * be nullptr if it is unknown. On success record_size is set to the size
+ * of the record payload. Returns false if the record is malformed. */
+bool format_binary_record(
+    const char* payload, size_t size, const char* format,
+    std::string& result, size_t& record_size);
+
+
+/* Returns the type id of a schema record, payload points right after
+ * the prefix */
+uint32_t schema_record_id(const char* payload);
+
+/* Formats a single schema record like format_binary_record with
+ * the field types and the format of its schema. If the schema is unknown
+ * (types is nullptr) the record is "<unknown schema id>" and its size is
+ * that of the type id alone. Returns false if the record is malformed. */
+bool format_schema_record(
+    const char* payload, size_t size,
+    const unsigned char* types, size_t fields, const char* format,
+    std::string& result, size_t& record_size);
+
+
+} // namespace memorylog
@@ -0,0 +1,390 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+#include "memorylog.hh"
+#include "sharded_queue.hh"
+#include "bounded_queue.hh"
+#include "record_format.hh"
+#include "buffer_storage.hh"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <sched.h>
+
+
+/* Internal structures of the logger shared by its translation units */
+
+
+namespace memorylog {
+
+
+class Drainer;
+class Compressor;
+class ChunkDumper;
+
+constexpr size_t FORMAT_ARENA_SIZE = 64 * 1024;
+
+/* Indexes of the per-thread counters, the fields of WriteCounters */
+enum WriteCounter {
+    COUNTER_RECORDS,
+    COUNTER_BYTES,
+    COUNTER_DROPPED_TOO_LARGE,
+    COUNTER_DROPPED_NO_CHUNK,
+    COUNTER_DROPPED_RESERVATIONS,
+    COUNTER_CHUNK_SWITCHES,
+    COUNTER_QUEUE_FAILURES,
+    COUNTER_FORMAT_RETRIES,
+    WRITE_COUNTERS,
+};
+constexpr size_t FORMAT_REGISTRY_SLOTS = 1024;
+/* an enqueue may fail although the queue of sealed chunks of the drainer
+ * or the compressor has a place for every chunk (see BoundedPtrQueue),
+ * a chunk is sealed with this many attempts */
+constexpr size_t SEAL_ATTEMPTS = 4;
+/* a thread that may wait gives a chunk away with this many attempts, the
+ * chunk is stranded then (see GlobalContext::return_chunk) */
+constexpr size_t RETURN_ATTEMPTS = 16;
+/* chunks a writer retries to give away at a chunk switch, more than the one
+ * it may add, so the list of chunks it holds shrinks */
+constexpr size_t HELD_RETRIES = 2;
+
+
+template <uintptr_t ALIGNMENT, typename PTR_TYPE>
+inline PTR_TYPE ptr_align_up(PTR_TYPE value) {
+    constexpr uintptr_t MASK = ALIGNMENT - 1;
+    static_assert((ALIGNMENT & MASK) == 0, "invalid alignment");
+    uintptr_t cvalue = reinterpret_cast<uintptr_t>(value);
+    return reinterpret_cast<PTR_TYPE>((cvalue + MASK) & ~MASK);
+}
+
+
+/* The fill point is written only by the thread owning the chunk. Other
+ * threads (the dumper) read it with end_point(), the records below it are
+ * complete. The generation changes every time the chunk is reset, so
+ * a reader copying the records finds out whether the chunk was reused
+ * during the copy. */
+class MemoryBufferChunk {
+public:
+    void reset() {
+        fill_point.store(start_point(), std::memory_order_relaxed);
+        generation.store(generation.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+        /* like the writer of a seqlock: records of the new generation
+         * must not become visible before the generation itself */
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    /* the place of the first record of the chunk */
+    char* start_point() {
+        return ptr_align_up<RECORD_ALIGNMENT>(
+            reinterpret_cast<char*>(this) + sizeof(*this));
+    }
+
+    bool out_of_space(size_t chunk_size, size_t record_len) const {
+        size_t space_left =
+            chunk_size + reinterpret_cast<const char*>(this) - get_fill_point();
+        return record_len + RECORD_PREFIX_SIZE > space_left;
+    }
+
+    size_t available_space(size_t chunk_size) const {
+        return chunk_size + reinterpret_cast<const char*>(this)
+            - get_fill_point();
+    }
+
+    bool empty() const {
+        auto start_point = ptr_align_up<RECORD_ALIGNMENT>(
+            reinterpret_cast<const char*>(this) + sizeof(*this));
+        return get_fill_point() == start_point;
+    }
+
+    void fill_up_to(char* new_fill_point) {
+        fill_point.store(ptr_align_up<RECORD_ALIGNMENT>(new_fill_point),
+                         std::memory_order_release);
+    }
+
+    char* get_fill_point() const {
+        return fill_point.load(std::memory_order_relaxed);
+    }
+
+    /* the fill point as seen by a thread not owning the chunk */
+    char* end_point() const {
+        return fill_point.load(std::memory_order_acquire);
+    }
+
+    uint64_t get_generation() const {
+        return generation.load(std::memory_order_acquire);
+    }
+
+private:
+    std::atomic<char*> fill_point = {nullptr};
+    std::atomic<uint64_t> generation = {0};
+};
+
+
+/* Keeps copies of format strings used by binary records in an arena
+ * placed in the same buffer as the chunks, so a decoder finds them in
+ * a dump file or a coredump. Each string is stored once. */
+class FormatRegistry {
+public:
+    FormatRegistry(char* arena, size_t arena_size);
+    void add(const char* format);
+
+    /* The format added at the address or nullptr; the address of a binary
+     * record is only an address once it is found here */
+    const char* find(uint64_t address) const;
+
+    /* Puts a schema entry into the manifest, returns false if the arena
+     * is full */
+    bool add_schema(uint32_t id, const detail::SchemaInfo& schema);
+
+    /* The clock calibration entry is the first one in the arena, its
+     * second sample is refreshed in place to improve the precision */
+    void store_calibration();
+    void refresh_calibration();
+
+    const char* arena() const {
+        return Arena;
+    }
+
+    /* End of the entries starting at the offset that are completely
+     * written; an entry may be booked but not yet published */
+    size_t published(size_t offset) const;
+
+private:
+    void store(const char* format);
+    char* append(const char* prefix, const void* header, size_t header_size,
+                 const char* data, size_t data_size);
+
+    char* const Arena;
+    size_t const ArenaSize;
+    std::atomic<size_t> ArenaFill = {0};
+    std::unique_ptr<std::atomic<uintptr_t>[]> const Slots;
+};
+
+
+/* The schema of a type id given in this process or nullptr */
+const detail::SchemaInfo* find_schema(uint32_t id);
+
+/* The log in a slot of the per-thread tables or nullptr, a plain atomic
+ * load, so it is safe in a signal handler */
+GlobalContext* log_in_slot(size_t slot);
+
+
+struct GlobalContext {
+    /* NUMA nodes the buffer is split across, empty if it is not split */
+    std::vector<int> const NumaNodes;
+    BufferStorage const BigBuffer;
+    size_t const ChunkSize;
+    size_t const TotalSize;
+    size_t const NodePartSize;
+    /* the large chunks of Options::LargeChunkSize take the first
+     * LargeRegionSize bytes of the buffer, the small ones follow them;
+     * LargeRegionSize is 0 if the chunk sizes do not adapt */
+    size_t const LargeChunkSize;
+    size_t const LargeRegionSize;
+    size_t const MaxChunkSize;
+    /* size of RecordHeader if records have headers, 0 otherwise */
+    size_t const RecordHeaderSize;
+    /* size of RecordFrame if records have frames, 0 otherwise */
+    size_t const RecordFrameSize;
+    /* operations on the queue take a bounded number of steps and may
+     * fail, see release_chunk */
+    ShardedPtrQueue<MemoryBufferChunk*, BoundedPtrQueue<MemoryBufferChunk*>>
+        Queue;
+    /* free large chunks, empty if the chunk sizes do not adapt */
+    ShardedPtrQueue<MemoryBufferChunk*, BoundedPtrQueue<MemoryBufferChunk*>>
+        LargeQueue;
+    /* partly filled chunks left by exiting threads, the next thread
+     * needing a chunk resumes one of them instead of taking a free one */
+    BoundedPtrQueue<MemoryBufferChunk*> Partial;
+    /* the links of the lists of chunks a queue refused, by chunk index (see
+     * hold_chunk); a chunk is in one list at most and only the thread
+     * holding the list touches its link, so a list never fails */
+    std::unique_ptr<MemoryBufferChunk*[]> const ChunkLinks;
+    /* chunks that exiting threads could not give away, the writers retry
+     * them at their chunk switches */
+    std::mutex StrandedLock;
+    MemoryBufferChunk* Stranded = nullptr;
+    std::atomic<size_t> StrandedChunks = {0};
+    /* release_chunk fails while this is not 0 and counts it down, tests
+     * use it in place of a congested queue */
+    std::atomic<size_t> FailReleases = {0};
+    /* see Stats */
+    std::atomic<size_t> FilledChunks = {0};
+    std::atomic<size_t> WastedBytes = {0};
+    std::atomic<size_t> ResumedChunks = {0};
+    std::atomic<size_t> TakenChunks = {0};
+    std::atomic<size_t> TakenLargeChunks = {0};
+    /* the counters of the exited threads */
+    std::atomic<uint64_t> ExitedWrites[WRITE_COUNTERS] = {};
+    /* the fd the crash handler writes the log to, -1 if none, and
+     * whether the log is sealed by a crash (see write_crash_image) */
+    std::atomic<int> CrashFd = {-1};
+    std::atomic<bool> Crashed = {false};
+    FormatRegistry Formats;
+    /* the ring of compressed chunks after the format arena, its size is
+     * 0 if Options::CompressedBufferSize is not set */
+    char* const CompressedRegion;
+    size_t const CompressedSize;
+    /* shard of each NUMA node by node id */
+    std::vector<size_t> NodeShard;
+    char TextPrefix[RECORD_PREFIX_SIZE];
+    char BinaryPrefix[RECORD_PREFIX_SIZE];
+    char SchemaPrefix[RECORD_PREFIX_SIZE];
+    /* index of the log in the per-thread tables of chunks and a number
+     * unique for every log ever created */
+    size_t Slot = 0;
+    uint64_t Id = 0;
+    /* writes full chunks to files if Options::DrainPath is set; it is
+     * declared after everything it uses, so it is stopped before anything
+     * else is gone */
+    std::unique_ptr<Drainer> Drain;
+    /* compresses full chunks if Options::CompressedBufferSize is set */
+    std::unique_ptr<Compressor> Compress;
+    /* state of incremental dumps, see dump_chunks */
+    std::unique_ptr<ChunkDumper> Dumper;
+
+    GlobalContext(const Options& options);
+    ~GlobalContext();
+
+    size_t large_chunks() const {
+        return LargeRegionSize != 0 ? LargeRegionSize / LargeChunkSize : 0;
+    }
+
+    size_t chunks() const {
+        return large_chunks() + (TotalSize - LargeRegionSize) / ChunkSize;
+    }
+
+    MemoryBufferChunk* chunk(size_t index) const {
+        size_t large = large_chunks();
+        size_t offset = index < large
+            ? LargeChunkSize * index
+            : LargeRegionSize + ChunkSize * (index - large);
+        return reinterpret_cast<MemoryBufferChunk*>(BigBuffer.get() + offset);
+    }
+
+    bool is_large(const MemoryBufferChunk* chunk) const {
+        return reinterpret_cast<const char*>(chunk)
+            < BigBuffer.get() + LargeRegionSize;
+    }
+
+    size_t chunk_size(const MemoryBufferChunk* chunk) const {
+        return is_large(chunk) ? LargeChunkSize : ChunkSize;
+    }
+
+    size_t chunk_index(const MemoryBufferChunk* chunk) const {
+        size_t offset = reinterpret_cast<const char*>(chunk) - BigBuffer.get();
+        if (offset < LargeRegionSize)
+            return offset / LargeChunkSize;
+        return large_chunks() + (offset - LargeRegionSize) / ChunkSize;
+    }
+
+    /* a chunk the thread is done with goes to the drainer or to the
+     * compressor if there is one, to the queue of free chunks otherwise;
+     * it fails only if the queue is congested, the thread holds the chunk
+     * then (see hold_chunk) */
+    bool release_chunk(MemoryBufferChunk* chunk);
+
+    /* puts the chunk into the queue of free chunks of its size */
+    bool free_chunk(MemoryBufferChunk* chunk) {
+        return (is_large(chunk) ? LargeQueue : Queue).enqueue(
+            chunk, home_shard(chunk));
+    }
+
+    /* the same for threads that may wait; a chunk still refused after
+     * RETURN_ATTEMPTS is stranded, never lost */
+    void return_chunk(MemoryBufferChunk* chunk);
+
+    /* puts a chunk at the head of a list of chunks the thread holds */
+    void hold_chunk(MemoryBufferChunk*& list, MemoryBufferChunk* chunk) {
+        ChunkLinks[chunk_index(chunk)] = list;
+        list = chunk;
+    }
+
+    /* takes the chunk at the head of the list, nullptr if it is empty */
+    MemoryBufferChunk* take_held(MemoryBufferChunk*& list) {
+        MemoryBufferChunk* chunk = list;
+        if (chunk != nullptr)
+            list = ChunkLinks[chunk_index(chunk)];
+        return chunk;
+    }
+
+    /* releases (or frees) at most count chunks of the list, stops at the
+     * first one the queue refuses; returns the number of chunks gone */
+    size_t release_held(MemoryBufferChunk*& list, size_t count);
+    size_t free_held(MemoryBufferChunk*& list, size_t count);
+
+    /* retries at most count stranded chunks, never blocks: nothing is done
+     * if another thread retries them */
+    void release_stranded(size_t count);
+
+    /* a full chunk the thread writes over, its records do not get to the
+     * drainer or the compressor (counted as dropped there) */
+    void overwrite_chunk(MemoryBufferChunk* chunk);
+
+    /* the chunk of an exiting thread, it is kept for another thread if
+     * it has records and room for more */
+    void park_chunk(MemoryBufferChunk* chunk);
+
+    /* counts the unused space at the end of a chunk a writer is done with */
+    void account_filled(const MemoryBufferChunk* chunk) {
+        FilledChunks.fetch_add(1, std::memory_order_relaxed);
+        WastedBytes.fetch_add(chunk->available_space(chunk_size(chunk)),
+                              std::memory_order_relaxed);
+    }
+
+    /* a chunk ready for writing or nullptr, never blocks: a parked chunk
+     * to resume or a free chunk (reset), a large one if asked and there
+     * is one; if the drainer falls behind the oldest chunk waiting for it
+     * is overwritten */
+    MemoryBufferChunk* acquire_chunk(bool large);
+
+    /* the queue shard of the CPU (or the NUMA node) the calling thread
+     * is running on */
+    size_t local_shard() const {
+        if (Queue.shards() == 1)
+            return 0;
+        unsigned cpu, node;
+        if (getcpu(&cpu, &node) != 0)
+            return 0;
+        if (NumaNodes.empty())
+            return cpu % Queue.shards();
+        return node < NodeShard.size() ? NodeShard[node] : 0;
+    }
+
+    /* the shard a chunk goes to when it is returned, a chunk always
+     * returns to its own NUMA node */
+    size_t home_shard(const MemoryBufferChunk* chunk) const {
+        if (NumaNodes.empty())
+            return local_shard();
+        size_t offset = reinterpret_cast<const char*>(chunk) - BigBuffer.get();
+        size_t shard = offset / NodePartSize;
+        return shard < Queue.shards() ? shard : Queue.shards() - 1;
+    }
+};
+
+
+} // namespace memorylog
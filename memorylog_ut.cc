@@ -25,18 +25,38 @@ SOFTWARE.
 #include <CppUTest/TestHarness.h>
 
 #include "memorylog.hh"
+#include "memorylog_internal.hh"
+#include "memorylog_decode.hh"
+#include "buffer_storage.hh"
+#include "record_format.hh"
+#include "lz_codec.hh"
+#include "format_engine.hh"
 #include <stdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <cmath>
 #include <limits>
 #include <algorithm>
 #include <memory>
 #include <string.h>
+#include <string>
 #include <thread>
+#include <vector>
+#include <stdexcept>
+#include <atomic>
 
 #include "ut_helpers.hh"
 
 
+namespace memorylog {
+extern std::atomic<GlobalContext*> GlobalCtx;
+}
+
+
 TEST_GROUP(MEMORYLOG_WRITE) {
     void setup() {
         memorylog::initialize(256, 128);
@@ -63,6 +83,232 @@ TEST_GROUP(MEMORYLOG_FORMAT_WRITE) {
     }
 };
 
+TEST_GROUP(MEMORYLOG_BINARY_WRITE) {
+    void setup() {
+        memorylog::initialize(1024, 512);
+    }
+
+    void teardown() {
+        memorylog::finalize();
+    }
+};
+
+TEST_GROUP(MEMORYLOG_MAPPED) {
+    void setup() {
+        memorylog::Options options;
+        options.TotalBufferSize = 1024;
+        options.ChunkSize = 512;
+        options.MappedFile = "log-mapped";
+        memorylog::initialize(options);
+    }
+
+    void teardown() {
+        memorylog::finalize();
+    }
+};
+
+TEST_GROUP(MEMORYLOG_SHARDED) {
+    void setup() {
+        memorylog::Options options;
+        options.TotalBufferSize = 4096;
+        options.ChunkSize = 128;
+        options.QueueShards = 0;
+        memorylog::initialize(options);
+    }
+
+    void teardown() {
+        memorylog::finalize();
+    }
+};
+
+TEST_GROUP(MEMORYLOG_HEADER) {
+    void setup() {
+        memorylog::Options options;
+        options.TotalBufferSize = 4096;
+        options.ChunkSize = 256;
+        options.RecordHeader = true;
+        memorylog::initialize(options);
+    }
+
+    void teardown() {
+        memorylog::finalize();
+    }
+};
+
+TEST_GROUP(MEMORYLOG_RESERVE) {
+    void setup() {
+        memorylog::initialize(256, 128);
+    }
+
+    void teardown() {
+        memorylog::finalize();
+    }
+};
+
+TEST_GROUP(MEMORYLOG_DRAIN) {
+    void setup() {
+        for (int i = 0; i < 1000; ++i)
+            unlink(drain_file("log-drain", i).c_str());
+    }
+
+    void teardown() {
+        memorylog::finalize();
+    }
+
+    static std::string drain_file(const char* path, int index) {
+        return std::string(path) + "." + std::to_string(index);
+    }
+};
+
+TEST_GROUP(MEMORYLOG_DUMP_CHUNKS) {
+    void setup() {
+        memorylog::initialize(4096, 256);
+    }
+
+    void teardown() {
+        memorylog::finalize();
+    }
+};
+
+TEST_GROUP(MEMORYLOG_LEVELS) {
+    void setup() {
+        memorylog::initialize(4096, 256);
+    }
+
+    void teardown() {
+        memorylog::finalize();
+        memorylog::set_level(memorylog::LEVEL_TRACE);
+        for (unsigned i = 0; i < memorylog::MAX_CATEGORIES; ++i)
+            memorylog::enable_category(i, true);
+    }
+};
+
+TEST_GROUP(MEMORYLOG_LOG) {
+    void teardown() {
+        memorylog::finalize();
+    }
+
+    static memorylog::Options log_options(size_t total, size_t chunk) {
+        memorylog::Options options;
+        options.TotalBufferSize = total;
+        options.ChunkSize = chunk;
+        return options;
+    }
+};
+
+TEST_GROUP(MEMORYLOG_EXTRACT) {
+    void teardown() {
+        memorylog::finalize();
+    }
+};
+
+TEST_GROUP(MEMORYLOG_FRAME) {
+    void teardown() {
+        memorylog::finalize();
+    }
+
+    static memorylog::Options frame_options(bool header) {
+        memorylog::Options options;
+        options.TotalBufferSize = 4096;
+        options.ChunkSize = 1024;
+        options.RecordFrame = true;
+        options.RecordHeader = header;
+        return options;
+    }
+};
+
+TEST_GROUP(MEMORYLOG_TAIL) {
+    void teardown() {
+        memorylog::finalize();
+    }
+
+    /* collects the records, stops after Limit records */
+    struct Collected {
+        std::vector<std::string> Texts;
+        std::vector<memorylog::TailRecord> Records;
+        size_t Limit = ~size_t(0);
+    };
+
+    static bool collect(void* arg, const memorylog::TailRecord& record) {
+        auto collected = static_cast<Collected*>(arg);
+        collected->Texts.emplace_back(record.Text, record.Size);
+        collected->Records.push_back(record);
+        return collected->Texts.size() < collected->Limit;
+    }
+};
+
+TEST_GROUP(MEMORYLOG_COMPRESS) {
+    void teardown() {
+        memorylog::finalize();
+    }
+
+    static memorylog::Options compress_options(size_t compressed_size) {
+        memorylog::Options options;
+        options.TotalBufferSize = 65536;
+        options.ChunkSize = 4096;
+        options.CompressedBufferSize = compressed_size;
+        return options;
+    }
+
+    /* waits until the compressor is done with all full chunks */
+    static memorylog::Stats wait_for_compressor() {
+        memorylog::Stats stats;
+        for (int i = 0; i < 5000; ++i) {
+            CHECK(memorylog::stats(stats));
+            if (stats.CompressedChunks + stats.DroppedChunks ==
+                stats.FilledChunks)
+                break;
+            usleep(1000);
+        }
+        return stats;
+    }
+};
+
+TEST_GROUP(MEMORYLOG_SCHEMA) {
+    void teardown() {
+        memorylog::finalize();
+    }
+};
+
+TEST_GROUP(MEMORYLOG_CRASH) {
+    void teardown() {
+        memorylog::finalize();
+    }
+
+    /* Runs crash() in a child process with a log writing to the file on
+     * a crash, returns the wait status of the child. The child gets
+     * the abort handler before the crash handlers are installed. */
+    template <typename CRASH>
+    static int crash_child(
+        const char* filename, CRASH crash, void (*abort_handler)(int) = nullptr)
+    {
+        int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CHECK(fd >= 0);
+        pid_t child = fork();
+        if (child == 0) {
+            struct rlimit no_core = {0, 0};
+            setrlimit(RLIMIT_CORE, &no_core);
+            if (abort_handler != nullptr)
+                signal(SIGABRT, abort_handler);
+            if (!memorylog::initialize(4096, 1024) ||
+                !memorylog::install_crash_handler(fd))
+                _exit(1);
+            crash();
+            _exit(2);
+        }
+        close(fd);
+        int status = 0;
+        CHECK_EQUAL(child, waitpid(child, &status, 0));
+        return status;
+    }
+};
+
+TEST_GROUP(LZ_CODEC) {};
+
+TEST_GROUP(FORMAT_ENGINE) {};
+
+TEST_GROUP(BUFFER_STORAGE) {};
+
 static size_t get_file_length(FILE* file) {
     struct stat file_stat_buf;
     int res = fstat(fileno(file), &file_stat_buf);
@@ -92,6 +338,19 @@ static bool find_string(const char* filename, const char* string) {
 }
 
 
+static bool find_decoded_string(const char* filename, const char* string) {
+    const char* decoded_filename = "log-dump-decoded";
+    FILE* decoded = fopen(decoded_filename, "w");
+    if (decoded == nullptr)
+        throw "fopen";
+    bool decode_result = memorylog::decode_file(filename, decoded);
+    fclose(decoded);
+    if (!decode_result)
+        throw "decode_file";
+    return find_string(decoded_filename, string);
+}
+
+
 TEST(MEMORYLOG_FORMAT_WRITE, WRITE_MANY) {
     for (uint32_t i = 0; i < 100; ++i)
         CHECK(memorylog::format_write(
@@ -177,3 +436,1770 @@ TEST(MEMORYLOG_INIT, CALL_BEFORE_INITIALIZATION) {
     for (uint16_t i = 0; i < 100; ++i)
         CHECK(!memorylog::write("love me or leave me\n", 20));
 }
+
+
+TEST(MEMORYLOG_BINARY_WRITE, WRITE_ONCE) {
+    CHECK(memorylog::binary_write("%s or %s\n", "love me", "leave me"));
+    CHECK(memorylog::dump("log-dump4"));
+    CHECK(find_decoded_string("log-dump4", "love me or leave me\n"));
+}
+
+
+TEST(MEMORYLOG_BINARY_WRITE, ALL_TYPES) {
+    int value = -5;
+    CHECK(memorylog::binary_write(
+        "%d %u %ld %llu %x %.2f %c %s %p|%5d|%-4s|",
+        -1, 2u, -3l, 4ull, 255, 1.5, 'z', "str", (void*)0x10,
+        42, "ab"));
+    CHECK(memorylog::binary_write("no arguments"));
+    CHECK(memorylog::binary_write("%hhd %*d", 257, 3, value));
+    CHECK(memorylog::dump("log-dump4"));
+    CHECK(find_decoded_string(
+        "log-dump4", "-1 2 -3 4 ff 1.50 z str 0x10|   42|ab  |\n"));
+    CHECK(find_decoded_string("log-dump4", "\nno arguments\n"));
+    CHECK(find_decoded_string("log-dump4", "\n1  -5\n"));
+}
+
+
+TEST(MEMORYLOG_BINARY_WRITE, STRING_AS_NUMBER) {
+    CHECK(memorylog::binary_write("%d|%u|%x|%f|%c|%*d|\n",
+                                  "a", "b", "c", "d", "e", "f", 7));
+    CHECK(memorylog::dump("log-dump4"));
+    CHECK(find_decoded_string(
+        "log-dump4",
+        "(string)|(string)|(string)|(string)|(string)|7|\n"));
+}
+
+
+TEST(MEMORYLOG_BINARY_WRITE, MIXED_WITH_TEXT) {
+    for (uint32_t i = 0; i < 100; ++i) {
+        CHECK(memorylog::binary_write("binary %u\n", i));
+        CHECK(memorylog::format_write("text %u\n", i));
+    }
+    CHECK(memorylog::dump("log-dump4"));
+    CHECK(find_decoded_string("log-dump4", "\nbinary 99\ntext 99\n"));
+}
+
+
+TEST(MEMORYLOG_BINARY_WRITE, MESSAGE_TOO_BIG) {
+    char buf[600];
+    memset(buf, 'a', sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    CHECK(!memorylog::binary_write("%s", buf));
+}
+
+
+TEST(MEMORYLOG_MAPPED, RECORDS_ARE_IN_FILE) {
+    CHECK(memorylog::write("love me or leave me\n", 20));
+    CHECK(memorylog::binary_write("%s or %s\n", "love me", "leave me"));
+    /* the file shares pages with the buffer, no dump is needed */
+    CHECK(find_string("log-mapped", "\niPao2ijSahbe0F love me or leave me\n"));
+    CHECK(find_decoded_string("log-mapped", "love me or leave me\n"));
+    CHECK(memorylog::sync());
+}
+
+
+TEST(MEMORYLOG_MAPPED, DUMP) {
+    CHECK(memorylog::format_write("%s or %s\n", "love me", "leave me"));
+    unlink("log-dump5");
+    /* the mapped file is the dump, it is flushed and not copied */
+    CHECK(memorylog::dump("log-dump5"));
+    CHECK(access("log-dump5", F_OK) != 0);
+    CHECK(find_string("log-mapped", "\niPao2ijSahbe0F love me or leave me\n"));
+}
+
+
+TEST(MEMORYLOG_INIT, SYNC_HEAP_BUFFER) {
+    CHECK(memorylog::initialize(256, 128));
+    CHECK(!memorylog::sync());
+}
+
+
+TEST(MEMORYLOG_INIT, MAPPED_FILE_CANNOT_BE_CREATED) {
+    memorylog::Options options;
+    options.TotalBufferSize = 256;
+    options.ChunkSize = 128;
+    options.MappedFile = "no-such-directory/log-mapped";
+    CHECK(!memorylog::initialize(options));
+}
+
+
+TEST(MEMORYLOG_SHARDED, WRITE_4_THREADS) {
+    SyncStart greenlight(4);
+
+    auto thread_lambda = [&]() {
+        greenlight.WaitForGreenLight();
+        for (uint16_t i = 0; i < 1000; ++i)
+            CHECK(memorylog::write("love me or leave me\n", 20));
+    };
+
+    std::thread threads[4];
+    for (auto& thread : threads)
+        thread = std::thread(thread_lambda);
+    greenlight.Start();
+    for (auto& thread : threads)
+        thread.join();
+
+    CHECK(memorylog::dump("log-dump6"));
+    CHECK(find_string("log-dump6", "\niPao2ijSahbe0F love me or leave me\n"));
+}
+
+
+TEST(MEMORYLOG_INIT, NUMA_AWARE) {
+    memorylog::Options options;
+    options.TotalBufferSize = 4096;
+    options.ChunkSize = 128;
+    options.NumaAware = true;
+    CHECK(memorylog::initialize(options));
+    CHECK(memorylog::write("love me or leave me\n", 20));
+    CHECK(memorylog::dump("log-dump7"));
+    CHECK(find_string("log-dump7", "\niPao2ijSahbe0F love me or leave me\n"));
+}
+
+
+TEST(BUFFER_STORAGE, PARSE_NODE_LIST) {
+    auto nodes = memorylog::parse_node_list("0-2,5,7-8\n");
+    CHECK_EQUAL(nodes.size(), 6u);
+    CHECK_EQUAL(nodes[0], 0);
+    CHECK_EQUAL(nodes[2], 2);
+    CHECK_EQUAL(nodes[3], 5);
+    CHECK_EQUAL(nodes[5], 8);
+    CHECK(memorylog::parse_node_list("").empty());
+    CHECK(!memorylog::numa_nodes().empty());
+}
+
+
+TEST(BUFFER_STORAGE, PLACE_ON_NODES) {
+    /* the policy is only a hint, any node id must not break allocation */
+    std::vector<int> nodes = {0, 0, 0};
+    memorylog::BufferStorage storage(100000, nullptr, nodes, 40000);
+    CHECK(storage.get() != nullptr);
+    CHECK(!storage.mapped());
+    memset(storage.get(), 1, storage.size());
+}
+
+
+static std::string read_decoded(const char* filename) {
+    const char* decoded_filename = "log-dump-decoded";
+    FILE* decoded = fopen(decoded_filename, "w+");
+    if (decoded == nullptr)
+        throw "fopen";
+    if (!memorylog::decode_file(filename, decoded))
+        throw "decode_file";
+    fflush(decoded);
+    std::string result(get_file_length(decoded), 0);
+    rewind(decoded);
+    if (!result.empty() && fread(&result[0], result.size(), 1, decoded) != 1)
+        throw "fread";
+    fclose(decoded);
+    return result;
+}
+
+
+TEST(MEMORYLOG_HEADER, RECORDS_ARE_ORDERED) {
+    /* the ring is reused many times, so the chunks in the buffer are
+     * not in the order they were written */
+    for (uint32_t i = 0; i < 500; ++i) {
+        if (i % 2 == 0)
+            CHECK(memorylog::format_write("record %u\n", i));
+        else
+            CHECK(memorylog::binary_write("record %u\n", i));
+    }
+    CHECK(memorylog::dump("log-dump8"));
+
+    std::string decoded = read_decoded("log-dump8");
+    CHECK(decoded.compare(0, 3, "[20") == 0);
+
+    long previous = -1;
+    size_t lines = 0;
+    for (size_t pos = decoded.find("] record "); pos != std::string::npos;
+         pos = decoded.find("] record ", pos + 1))
+    {
+        long number = strtol(decoded.c_str() + pos + 9, nullptr, 10);
+        CHECK(number > previous);
+        previous = number;
+        ++lines;
+    }
+    CHECK_EQUAL(previous, 499);
+    CHECK(lines > 50);
+}
+
+
+TEST(MEMORYLOG_HEADER, MESSAGE_TOO_BIG) {
+    char buf[256 - 16 - 16];
+    memset(buf, 'a', sizeof(buf));
+    CHECK(!memorylog::write(buf, sizeof(buf)));
+    CHECK(memorylog::write(buf, sizeof(buf) - 32));
+}
+
+
+TEST(MEMORYLOG_RESERVE, RESERVE_COMMIT) {
+    for (uint16_t i = 0; i < 100; ++i) {
+        char* place = static_cast<char*>(memorylog::reserve(64));
+        CHECK(place != nullptr);
+        int len = sprintf(place, "love me or leave me %u\n", i);
+        CHECK(memorylog::commit(len));
+    }
+    CHECK(memorylog::dump("log-dump9"));
+    CHECK(find_string("log-dump9",
+                      "\niPao2ijSahbe0F love me or leave me 99\n"));
+}
+
+
+TEST(MEMORYLOG_RESERVE, MESSAGE_TOO_BIG) {
+    CHECK(memorylog::reserve(128) == nullptr);
+    CHECK(!memorylog::commit(0));
+}
+
+
+TEST(MEMORYLOG_RESERVE, COMMIT_WITHOUT_RESERVE) {
+    CHECK(!memorylog::commit(0));
+    CHECK(memorylog::reserve(16) != nullptr);
+    CHECK(memorylog::commit(0));
+    CHECK(!memorylog::commit(0));
+}
+
+
+TEST(MEMORYLOG_RESERVE, COMMIT_TOO_MUCH) {
+    CHECK(memorylog::reserve(16) != nullptr);
+    CHECK(!memorylog::commit(17));
+}
+
+
+TEST(MEMORYLOG_RESERVE, WRITE_BETWEEN_RESERVE_AND_COMMIT) {
+    CHECK(memorylog::reserve(16) != nullptr);
+    CHECK(memorylog::write("love me or leave me\n", 20));
+    CHECK(!memorylog::commit(16));
+}
+
+
+TEST(MEMORYLOG_DRAIN, ALL_RECORDS_ARE_DRAINED) {
+    memorylog::Options options;
+    options.TotalBufferSize = 1024 * 1024;
+    options.ChunkSize = 1024;
+    options.DrainPath = "log-drain";
+    CHECK(memorylog::initialize(options));
+
+    /* the buffer is large enough, no chunk is reused */
+    for (uint32_t i = 0; i < 1000; ++i) {
+        if (i % 2 == 0)
+            CHECK(memorylog::format_write("drained record %u\n", i));
+        else
+            CHECK(memorylog::binary_write("drained record %u\n", i));
+    }
+    memorylog::Stats stats;
+    CHECK(memorylog::stats(stats));
+    CHECK_EQUAL(0, stats.DroppedChunks);
+    memorylog::finalize();
+
+    std::string decoded = read_decoded("log-drain.0");
+    size_t records = 0;
+    for (size_t pos = decoded.find("drained record ");
+         pos != std::string::npos;
+         pos = decoded.find("drained record ", pos + 1))
+        ++records;
+    CHECK_EQUAL(1000, records);
+    CHECK(decoded.find("drained record 999\n") != std::string::npos);
+}
+
+
+static size_t count_string(const std::string& text, const char* string) {
+    size_t count = 0;
+    for (size_t pos = text.find(string); pos != std::string::npos;
+         pos = text.find(string, pos + 1))
+        ++count;
+    return count;
+}
+
+
+TEST(MEMORYLOG_DRAIN, REFUSED_CHUNKS_ARE_NOT_LOST) {
+    memorylog::Options options;
+    options.TotalBufferSize = 1024 * 1024;
+    options.ChunkSize = 1024;
+    options.DrainPath = "log-drain";
+    CHECK(memorylog::initialize(options));
+    auto ctx = memorylog::GlobalCtx.load();
+
+    /* the queue refuses the full chunks of a few switches in a row */
+    ctx->FailReleases.store(20);
+    for (uint32_t i = 0; i < 500; ++i)
+        CHECK(memorylog::format_write("held record %u\n", i));
+
+    /* and every chunk of an exiting thread, they are stranded */
+    ctx->FailReleases.store(1000);
+    std::thread thread([]() {
+        for (uint32_t i = 0; i < 200; ++i)
+            CHECK(memorylog::format_write("stranded record %u\n", i));
+    });
+    thread.join();
+    CHECK(ctx->StrandedChunks.load() != 0);
+
+    /* the writer gives them away at its next switches */
+    ctx->FailReleases.store(0);
+    for (uint32_t i = 500; i < 1000; ++i)
+        CHECK(memorylog::format_write("held record %u\n", i));
+    CHECK_EQUAL(0, ctx->StrandedChunks.load());
+
+    memorylog::Stats stats;
+    CHECK(memorylog::stats(stats));
+    CHECK(stats.Writes.QueueFailures > 0);
+    CHECK_EQUAL(0, stats.DroppedChunks);
+    memorylog::finalize();
+
+    std::string decoded = read_decoded("log-drain.0");
+    CHECK_EQUAL(1000, count_string(decoded, "held record "));
+    CHECK_EQUAL(200, count_string(decoded, "stranded record "));
+}
+
+
+TEST(MEMORYLOG_DRAIN, FILES_ROTATE) {
+    memorylog::Options options;
+    options.TotalBufferSize = 1024 * 1024;
+    options.ChunkSize = 256;
+    options.DrainPath = "log-drain";
+    options.DrainFileSize = 1024;
+    options.DrainFiles = 2;
+    CHECK(memorylog::initialize(options));
+
+    char buf[200];
+    memset(buf, 'a', sizeof(buf));
+    for (uint32_t i = 0; i < 200; ++i) {
+        CHECK(memorylog::write(buf, sizeof(buf)));
+        /* let the drainer write a few batches */
+        if (i % 20 == 0)
+            usleep(5000);
+    }
+    CHECK(memorylog::format_write("last record\n"));
+    memorylog::finalize();
+
+    int last = -1;
+    size_t files = 0;
+    for (int i = 0; i < 1000; ++i) {
+        if (access(drain_file("log-drain", i).c_str(), F_OK) == 0) {
+            last = i;
+            ++files;
+        }
+    }
+    CHECK(last > 1);
+    CHECK_EQUAL(2, files);
+    CHECK(find_string(drain_file("log-drain", last).c_str(), "last record\n"));
+}
+
+
+TEST(MEMORYLOG_DRAIN, WRITERS_DO_NOT_WAIT) {
+    memorylog::Options options;
+    options.TotalBufferSize = 1024;
+    options.ChunkSize = 256;
+    options.DrainPath = "log-drain";
+    CHECK(memorylog::initialize(options));
+
+    /* the drainer cannot keep up, the oldest full chunks are reused */
+    for (uint32_t i = 0; i < 10000; ++i)
+        CHECK(memorylog::format_write("record %u\n", i));
+
+    memorylog::Stats stats;
+    CHECK(memorylog::stats(stats));
+    CHECK(stats.DrainedChunks + stats.DroppedChunks <= 10000);
+    CHECK(stats.DrainedBytes <= stats.DrainedChunks * 256);
+}
+
+
+TEST(MEMORYLOG_INIT, DRAIN_FILE_CANNOT_BE_CREATED) {
+    memorylog::Options options;
+    options.TotalBufferSize = 1024;
+    options.ChunkSize = 512;
+    options.DrainPath = "no-such-directory/log-drain";
+    CHECK(!memorylog::initialize(options));
+    memorylog::Stats stats;
+    CHECK(!memorylog::stats(stats));
+}
+
+
+static std::string read_file(const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == nullptr)
+        throw "fopen";
+    std::string result(get_file_length(file), '\0');
+    if (!result.empty() && fread(&result[0], result.size(), 1, file) != 1)
+        throw "fread";
+    fclose(file);
+    return result;
+}
+
+
+TEST(MEMORYLOG_DUMP_CHUNKS, SNAPSHOT) {
+    for (uint32_t i = 0; i < 100; ++i)
+        CHECK(memorylog::format_write("snapshot record %u\n", i));
+    CHECK(memorylog::binary_write("binary record %u\n", 100));
+    CHECK(memorylog::dump_chunks("log-chunks1"));
+
+    std::string dumped = read_file("log-chunks1");
+    CHECK(dumped.size() > 4096);
+    CHECK(dumped.find("\niPao2ijSahbe0F snapshot record 99\n")
+          != std::string::npos);
+    CHECK(find_decoded_string("log-chunks1", "binary record 100\n"));
+}
+
+
+TEST(MEMORYLOG_DUMP_CHUNKS, INCREMENTAL_SKIPS_UNCHANGED) {
+    CHECK(memorylog::format_write("first record\n"));
+    CHECK(memorylog::dump_chunks("log-chunks2"));
+
+    /* the chunk has not changed, it is not written again */
+    FILE* file = fopen("log-chunks2", "r+");
+    size_t length = get_file_length(file);
+    CHECK(ftruncate(fileno(file), 0) == 0);
+    CHECK(ftruncate(fileno(file), length) == 0);
+    fclose(file);
+    CHECK(memorylog::dump_chunks("log-chunks2", true));
+    CHECK(!find_string("log-chunks2", "first record\n"));
+
+    CHECK(memorylog::format_write("second record\n"));
+    CHECK(memorylog::dump_chunks("log-chunks2", true));
+    CHECK(find_string("log-chunks2", "first record\n"));
+    CHECK(find_string("log-chunks2", "second record\n"));
+
+    /* another file gets everything */
+    CHECK(memorylog::dump_chunks("log-chunks3", true));
+    CHECK(find_string("log-chunks3", "first record\n"));
+}
+
+
+TEST(MEMORYLOG_DUMP_CHUNKS, ONLY_RECORDS_ARE_WRITTEN) {
+    memorylog::Options options;
+    options.TotalBufferSize = 1 << 20;
+    options.ChunkSize = 65536;
+    memorylog::Log log(options);
+    CHECK(log.format_write("the only record\n"));
+    CHECK(log.dump_chunks("log-chunks5"));
+
+    /* the file has the size of the buffer, but the empty space of the
+     * chunks is a hole */
+    struct stat file_stat;
+    CHECK_EQUAL(0, stat("log-chunks5", &file_stat));
+    CHECK((size_t)file_stat.st_size >= options.TotalBufferSize);
+    CHECK((size_t)file_stat.st_blocks * 512 < options.TotalBufferSize / 4);
+    CHECK(find_decoded_string("log-chunks5", "the only record\n"));
+}
+
+
+TEST(MEMORYLOG_DUMP_CHUNKS, INCREMENTAL_SAME_AS_FULL) {
+    /* chunks are reused with fewer records than they had in the previous
+     * dump, the incremental dump wipes the rest */
+    uint32_t record = 0;
+    for (uint32_t round = 0; round < 20; ++round) {
+        for (uint32_t i = 0; i < (round * 7) % 11 + 1; ++i)
+            CHECK(memorylog::format_write("record %u of round %u\n",
+                                          record++, round));
+        CHECK(memorylog::dump_chunks("log-chunks6", true));
+        std::string incremental = read_file("log-chunks6");
+        CHECK(memorylog::dump_chunks("log-chunks6"));
+        CHECK(incremental == read_file("log-chunks6"));
+    }
+}
+
+
+TEST(MEMORYLOG_DUMP_CHUNKS, CONSISTENT_WHILE_WRITING) {
+    std::atomic<bool> stop(false);
+    auto writer = [&stop]() {
+        for (uint32_t i = 0; !stop; ++i)
+            memorylog::format_write("consistent record %08u\n", i % 100000000);
+    };
+    std::thread thread1(writer);
+    std::thread thread2(writer);
+
+    const std::string prefix = "\niPao2ijSahbe0F ";
+    const std::string text = "consistent record ";
+    for (int dump = 0; dump < 20; ++dump) {
+        CHECK(memorylog::dump_chunks("log-chunks4", true));
+        std::string dumped = read_file("log-chunks4");
+        for (size_t pos = dumped.find(prefix); pos != std::string::npos;
+             pos = dumped.find(prefix, pos + 1))
+        {
+            size_t record = pos + prefix.size();
+            CHECK(dumped.compare(record, text.size(), text) == 0);
+            CHECK(dumped[record + text.size() + 8] == '\n');
+        }
+    }
+
+    stop = true;
+    thread1.join();
+    thread2.join();
+}
+
+
+static int evaluated_argument(int& counter) {
+    return ++counter;
+}
+
+
+TEST(MEMORYLOG_LEVELS, LEVEL_THRESHOLD) {
+    CHECK_EQUAL(memorylog::LEVEL_TRACE, memorylog::get_level());
+    CHECK(MEMORYLOG_FORMAT(TRACE, 0, "trace record %d\n", 1));
+
+    memorylog::set_level(memorylog::LEVEL_WARNING);
+    CHECK_EQUAL(memorylog::LEVEL_WARNING, memorylog::get_level());
+    int counter = 0;
+    CHECK(!MEMORYLOG_FORMAT(INFO, 0, "info record %d\n",
+                            evaluated_argument(counter)));
+    CHECK_EQUAL(0, counter);
+    CHECK(MEMORYLOG_FORMAT(ERROR, 0, "error record %d\n",
+                           evaluated_argument(counter)));
+    CHECK_EQUAL(1, counter);
+    CHECK(MEMORYLOG_WRITE(WARNING, 0, "warning record\n", 15));
+    CHECK(!MEMORYLOG_BINARY(DEBUG, 0, "debug record %d\n", 2));
+
+    CHECK(memorylog::dump("log-dump10"));
+    CHECK(find_string("log-dump10", "trace record 1\n"));
+    CHECK(!find_string("log-dump10", "info record"));
+    CHECK(find_string("log-dump10", "error record 1\n"));
+    CHECK(find_string("log-dump10", "warning record\n"));
+}
+
+
+TEST(MEMORYLOG_LEVELS, CATEGORIES) {
+    CHECK(memorylog::enable_category(5, false));
+    CHECK(!memorylog::enable_category(memorylog::MAX_CATEGORIES, false));
+    CHECK(!memorylog::enabled(memorylog::LEVEL_ERROR, 5));
+    CHECK(memorylog::enabled(memorylog::LEVEL_ERROR, 6));
+    /* the bits of the filter above the categories are not looked at */
+    CHECK(!memorylog::enabled(
+        memorylog::LEVEL_ERROR, memorylog::MAX_CATEGORIES));
+    CHECK(!memorylog::enabled(memorylog::LEVEL_ERROR, 63));
+    CHECK(!memorylog::enabled(memorylog::LEVEL_ERROR, 64));
+    CHECK(!memorylog::enabled(memorylog::LEVEL_ERROR, 1000));
+    CHECK(!MEMORYLOG_FORMAT(ERROR, 64, "category %d\n", 64));
+
+    CHECK(!MEMORYLOG_FORMAT(ERROR, 5, "category %d\n", 5));
+    CHECK(MEMORYLOG_FORMAT(ERROR, 55, "category %d\n", 55));
+    CHECK(memorylog::enable_category(5, true));
+    CHECK(MEMORYLOG_FORMAT(TRACE, 5, "category %d again\n", 5));
+
+    CHECK(memorylog::dump("log-dump11"));
+    CHECK(!find_string("log-dump11", "category 5\n"));
+    CHECK(find_string("log-dump11", "category 55\n"));
+    CHECK(find_string("log-dump11", "category 5 again\n"));
+}
+
+
+TEST(MEMORYLOG_LEVELS, COMPILED_IN) {
+    static_assert(memorylog::compiled_in(memorylog::LEVEL_TRACE),
+                  "all levels are compiled in by default");
+    CHECK(MEMORYLOG_ENABLED(TRACE, 0));
+}
+
+
+TEST(BUFFER_STORAGE, HUGE_PAGES) {
+    size_t huge_page_size = 2 * 1024 * 1024;
+    memorylog::BufferStorage storage(
+        3 * huge_page_size + 100, nullptr, {}, 0, huge_page_size);
+    if (storage.backing() == memorylog::BACKING_ANONYMOUS) {
+        CHECK_EQUAL(4096, storage.page_size());
+    } else {
+        CHECK(storage.backing() == memorylog::BACKING_HUGETLB ||
+              storage.backing() == memorylog::BACKING_TRANSPARENT_HUGE_PAGES);
+        CHECK_EQUAL(huge_page_size, storage.page_size());
+        CHECK_EQUAL(0, (uintptr_t)storage.get() % huge_page_size);
+    }
+    memset(storage.get(), 'a', storage.size());
+
+    /* 1GB pages are rarely reserved, it falls back */
+    memorylog::BufferStorage fallback(4096, nullptr, {}, 0, 1ul << 30);
+    CHECK(fallback.backing() != memorylog::BACKING_HUGETLB ||
+          fallback.page_size() == 1ul << 30);
+    memset(fallback.get(), 'a', fallback.size());
+}
+
+
+TEST(MEMORYLOG_INIT, HUGE_PAGES) {
+    memorylog::Options options;
+    options.TotalBufferSize = 4 * 1024 * 1024;
+    options.ChunkSize = 64 * 1024;
+    options.HugePageSize = 3 * 1024 * 1024;
+    CHECK(!memorylog::initialize(options));
+
+    options.HugePageSize = 2 * 1024 * 1024;
+    CHECK(memorylog::initialize(options));
+    CHECK(memorylog::write("love me or leave me\n", 20));
+    memorylog::Stats stats;
+    CHECK(memorylog::stats(stats));
+    CHECK(stats.Backing != memorylog::BACKING_HEAP);
+    CHECK(stats.Backing != memorylog::BACKING_FILE);
+    memorylog::finalize();
+
+    CHECK(memorylog::initialize(4096, 1024));
+    CHECK(memorylog::stats(stats));
+    CHECK_EQUAL(memorylog::BACKING_HEAP, stats.Backing);
+    CHECK_EQUAL(4096, stats.PageSize);
+}
+
+
+TEST(MEMORYLOG_LOG, INDEPENDENT_LOGS) {
+    CHECK(memorylog::initialize(1024, 256));
+    memorylog::Log events(log_options(4096, 1024));
+    memorylog::Log transitions(log_options(1024, 128));
+
+    CHECK(events.format_write("event %d\n", 1));
+    /* the transitions overwrite their own ring many times */
+    for (uint32_t i = 0; i < 1000; ++i)
+        CHECK(transitions.format_write("transition %u\n", i));
+    CHECK(events.binary_write("event %d\n", 2));
+    CHECK(memorylog::write("global record\n", 14));
+
+    CHECK(events.dump("log-dump12"));
+    CHECK(transitions.dump("log-dump13"));
+    CHECK(memorylog::dump("log-dump14"));
+    CHECK(find_string("log-dump12", "event 1\n"));
+    CHECK(find_decoded_string("log-dump12", "event 2\n"));
+    CHECK(!find_string("log-dump12", "transition"));
+    CHECK(find_string("log-dump13", "transition 999\n"));
+    CHECK(!find_string("log-dump13", "event"));
+    CHECK(find_string("log-dump14", "global record\n"));
+    CHECK(!find_string("log-dump14", "transition"));
+}
+
+
+TEST(MEMORYLOG_LOG, RESERVE_COMMIT) {
+    memorylog::Log first(log_options(1024, 256));
+    memorylog::Log second(log_options(1024, 256));
+
+    char* place = static_cast<char*>(first.reserve(32));
+    CHECK(place != nullptr);
+    CHECK(second.write("other log\n", 10));
+    memcpy(place, "reserved\n", 9);
+    CHECK(!second.commit(9));
+
+    place = static_cast<char*>(first.reserve(32));
+    memcpy(place, "reserved\n", 9);
+    CHECK(second.write("other log\n", 10));
+    CHECK(first.commit(9));
+    CHECK(first.dump("log-dump15"));
+    CHECK(find_string("log-dump15", "reserved\n"));
+}
+
+
+TEST(MEMORYLOG_LOG, SLOTS_ARE_REUSED) {
+    /* every log gets a slot of a destroyed one and the chunk the thread
+     * kept for the destroyed log is not used */
+    for (uint32_t i = 0; i < 3 * memorylog::MAX_LOGS; ++i) {
+        memorylog::Log log(log_options(1024, 256));
+        CHECK(log.format_write("log %u\n", i));
+        CHECK(log.dump("log-dump16"));
+        std::string record = "log " + std::to_string(i) + "\n";
+        CHECK(find_string("log-dump16", record.c_str()));
+    }
+}
+
+
+TEST(MEMORYLOG_LOG, TOO_MANY_LOGS) {
+    std::vector<std::unique_ptr<memorylog::Log>> logs;
+    try {
+        for (;;)
+            logs.emplace_back(new memorylog::Log(log_options(1024, 256)));
+    } catch (const std::length_error&) {
+    }
+    CHECK_EQUAL(memorylog::MAX_LOGS, logs.size());
+    CHECK(!memorylog::initialize(1024, 256));
+    logs.pop_back();
+    CHECK(memorylog::initialize(1024, 256));
+
+    bool thrown = false;
+    try {
+        memorylog::Log log(log_options(1000, 256));
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+
+TEST(MEMORYLOG_LOG, THREAD_EXIT_RETURNS_CHUNKS) {
+    /* two chunks per log, each thread takes one of each and returns
+     * them at exit, so the next thread finds free chunks */
+    memorylog::Log first(log_options(512, 256));
+    memorylog::Log second(log_options(512, 256));
+    for (int i = 0; i < 10; ++i) {
+        std::thread thread([&first, &second]() {
+            CHECK(first.write("first\n", 6));
+            CHECK(second.write("second\n", 7));
+        });
+        thread.join();
+    }
+}
+
+
+/* Decodes an image with extract_image, or with decode_image if threads
+ * is 1 and segment_size is 0 */
+static std::string extract(
+    const std::string& image, unsigned threads, size_t segment_size)
+{
+    char* buf = nullptr;
+    size_t len = 0;
+    FILE* output = open_memstream(&buf, &len);
+    if (output == nullptr)
+        throw "open_memstream";
+    bool result;
+    if (threads == 1 && segment_size == 0)
+        result = memorylog::decode_image(image.data(), image.size(), output);
+    else
+        result = memorylog::extract_image(
+            image.data(), image.size(), output, threads, segment_size);
+    fclose(output);
+    std::string extracted(buf, len);
+    free(buf);
+    if (!result)
+        throw "extract_image";
+    return extracted;
+}
+
+
+static void write_extract_records() {
+    for (uint32_t i = 0; i < 2000; ++i) {
+        if (i % 3 == 0)
+            CHECK(memorylog::binary_write("binary %u %s\n", i, "arg"));
+        else if (i % 3 == 1)
+            CHECK(memorylog::format_write("format %u\n", i));
+        else
+            CHECK(memorylog::write("text with\nnewline\n", 18));
+    }
+}
+
+
+TEST(MEMORYLOG_EXTRACT, SAME_AS_DECODE) {
+    CHECK(memorylog::initialize(65536, 1024));
+    write_extract_records();
+    CHECK(memorylog::dump("log-extract1"));
+
+    std::string image = read_file("log-extract1");
+    std::string decoded = extract(image, 1, 0);
+    CHECK(decoded.find("binary 1998 arg\n") != std::string::npos);
+    CHECK(decoded.find("format 1999\n") != std::string::npos);
+    CHECK(decoded == extract(image, 4, 4096));
+    CHECK(decoded == extract(image, 3, 1040));
+    CHECK(decoded == extract(image, 2, 16));
+    CHECK(decoded == extract(image, 0, 0));
+}
+
+
+TEST(MEMORYLOG_EXTRACT, SAME_AS_DECODE_WITH_HEADERS) {
+    memorylog::Options options;
+    options.TotalBufferSize = 65536;
+    options.ChunkSize = 1024;
+    options.RecordHeader = true;
+    CHECK(memorylog::initialize(options));
+    write_extract_records();
+    CHECK(memorylog::dump("log-extract2"));
+
+    std::string image = read_file("log-extract2");
+    std::string decoded = extract(image, 1, 0);
+    CHECK(decoded.compare(0, 3, "[20") == 0);
+    CHECK(decoded == extract(image, 4, 4096));
+    CHECK(decoded == extract(image, 3, 1040));
+}
+
+
+TEST(MEMORYLOG_EXTRACT, RECORD_HIDDEN_BY_SEGMENT_START) {
+    /* A binary record at 0 ends at 144 and a text record follows at 160.
+     * The string argument of the first record holds a prefix of a fake
+     * binary record at 128 whose argument covers the text record. A scan
+     * started at 128 finds the fake record and misses the text record,
+     * a sequential scan skips the fake one. */
+    std::string image(256, 'x');
+    auto put = [&image](size_t offset, const void* data, size_t size) {
+        image.replace(offset, size, static_cast<const char*>(data), size);
+    };
+    auto put_binary = [&put](size_t offset, uint32_t string_length) {
+        uint64_t format = 0x1234;
+        char args[] = {1, memorylog::detail::ARG_STRING};
+        put(offset, memorylog::BINARY_RECORD_PREFIX,
+            memorylog::RECORD_PREFIX_SIZE);
+        put(offset + 16, &format, sizeof(format));
+        put(offset + 24, args, sizeof(args));
+        put(offset + 26, &string_length, sizeof(string_length));
+    };
+    put_binary(0, 100);
+    put_binary(128, 60);
+    put(160, memorylog::RECORD_PREFIX, memorylog::RECORD_PREFIX_SIZE);
+    put(176, "real\0", 5);
+
+    std::string decoded = extract(image, 1, 0);
+    CHECK(decoded.find("real\n") != std::string::npos);
+    CHECK(decoded == extract(image, 2, 64));
+    CHECK(decoded == extract(image, 4, 16));
+}
+
+
+TEST(MEMORYLOG_FRAME, PREFIX_IN_TEXT) {
+    CHECK(memorylog::initialize(frame_options(false)));
+
+    /* the text starts 8 bytes before an alignment boundary, so the magic
+     * in it sits where a record could start */
+    std::string text("12345678");
+    text.append(memorylog::RECORD_PREFIX, memorylog::RECORD_PREFIX_SIZE);
+    text += "not a record\n";
+    CHECK(memorylog::write(text.data(), text.size()));
+    CHECK(memorylog::format_write("format %d\n", 1));
+    CHECK(memorylog::binary_write("binary %d %s\n", 2, "two"));
+    char* reserved = static_cast<char*>(memorylog::reserve(64));
+    CHECK(reserved != nullptr);
+    memcpy(reserved, "reserved\n", 9);
+    CHECK(memorylog::commit(9));
+    CHECK(memorylog::dump("log-frame1"));
+
+    /* the buffer may hold records of earlier tests after ours */
+    std::string decoded = extract(read_file("log-frame1"), 1, 0);
+    std::string expected = text + "format 1\nbinary 2 two\nreserved\n";
+    CHECK(decoded.compare(0, expected.size(), expected) == 0);
+}
+
+
+TEST(MEMORYLOG_FRAME, WITH_HEADERS) {
+    CHECK(memorylog::initialize(frame_options(true)));
+    for (uint32_t i = 0; i < 100; ++i)
+        CHECK(memorylog::format_write("record %u\n", i));
+    CHECK(memorylog::dump("log-frame2"));
+
+    std::string image = read_file("log-frame2");
+    std::string decoded = extract(image, 1, 0);
+    CHECK(decoded.compare(0, 3, "[20") == 0);
+    CHECK(decoded.find("] record 99\n") != std::string::npos);
+    CHECK(decoded == extract(image, 3, 256));
+}
+
+
+TEST(MEMORYLOG_FRAME, DAMAGED_RECORDS_ARE_SKIPPED) {
+    CHECK(memorylog::initialize(frame_options(false)));
+    CHECK(memorylog::write("first record\n", 13));
+    CHECK(memorylog::write("second record\n", 14));
+    CHECK(memorylog::write("third record\n", 13));
+    CHECK(memorylog::dump("log-frame3"));
+
+    std::string image = read_file("log-frame3");
+    const char* all = "first record\nsecond record\nthird record\n";
+    CHECK(extract(image, 1, 0).compare(0, strlen(all), all) == 0);
+
+    /* a changed byte breaks the checksum, a too long frame does not fit
+     * the image; the records around are still decoded */
+    size_t second = image.find("second record");
+    CHECK(second != std::string::npos);
+    std::string changed = image;
+    changed[second] = 'S';
+    const char* without_second = "first record\nthird record\n";
+    CHECK(extract(changed, 1, 0).compare(
+              0, strlen(without_second), without_second) == 0);
+
+    size_t third = image.find("third record");
+    std::string truncated = image;
+    uint32_t length = 1 << 30;
+    memcpy(&truncated[third - sizeof(memorylog::RecordFrame)],
+           &length, sizeof(length));
+    std::string decoded = extract(truncated, 1, 0);
+    CHECK(decoded.compare(0, 27, "first record\nsecond record\n") == 0);
+    CHECK(decoded.find("third record") == std::string::npos);
+}
+
+
+TEST(MEMORYLOG_TAIL, TAIL_SINCE_CURSOR) {
+    CHECK(memorylog::initialize(4096, 1024));
+    memorylog::TailCursor cursor;
+    Collected collected;
+    CHECK(memorylog::tail(cursor, collect, &collected));
+    CHECK(collected.Texts.empty());
+
+    CHECK(memorylog::format_write("first %d\n", 1));
+    CHECK(memorylog::binary_write("second %d %s\n", 2, "two"));
+    CHECK(memorylog::format_write("third\n"));
+    CHECK(memorylog::tail(cursor, collect, &collected));
+    CHECK_EQUAL(3u, collected.Texts.size());
+    CHECK(collected.Texts[0] == "first 1\n");
+    CHECK(collected.Texts[1] == "second 2 two\n");
+    CHECK(collected.Texts[2] == "third\n");
+
+    CHECK(memorylog::format_write("fourth\n"));
+    CHECK(memorylog::tail(cursor, collect, &collected));
+    CHECK_EQUAL(4u, collected.Texts.size());
+    CHECK(collected.Texts[3] == "fourth\n");
+
+    CHECK(memorylog::tail(cursor, collect, &collected));
+    CHECK_EQUAL(4u, collected.Texts.size());
+    CHECK_EQUAL(0u, cursor.missed());
+}
+
+
+TEST(MEMORYLOG_TAIL, CALLBACK_STOPS) {
+    CHECK(memorylog::initialize(4096, 1024));
+    for (int i = 0; i < 5; ++i)
+        CHECK(memorylog::format_write("record %d\n", i));
+
+    memorylog::TailCursor cursor;
+    Collected collected;
+    collected.Limit = 2;
+    CHECK(memorylog::tail(cursor, collect, &collected));
+    CHECK_EQUAL(2u, collected.Texts.size());
+
+    collected.Limit = 100;
+    CHECK(memorylog::tail(cursor, collect, &collected));
+    CHECK_EQUAL(5u, collected.Texts.size());
+    for (int i = 0; i < 5; ++i)
+        CHECK(collected.Texts[i] == "record " + std::to_string(i) + "\n");
+}
+
+
+TEST(MEMORYLOG_TAIL, HEADERS_AND_FRAMES) {
+    memorylog::Options options;
+    options.TotalBufferSize = 4096;
+    options.ChunkSize = 1024;
+    options.RecordHeader = true;
+    options.RecordFrame = true;
+    memorylog::Log log(options);
+    CHECK(log.write("text\0with zero\n", 16));
+    CHECK(log.binary_write("binary %u\n", 7u));
+
+    memorylog::TailCursor cursor;
+    Collected collected;
+    CHECK(!memorylog::tail(cursor, collect, &collected));
+    CHECK(log.tail(cursor, collect, &collected));
+    CHECK_EQUAL(2u, collected.Texts.size());
+    CHECK(collected.Texts[0] == std::string("text\0with zero\n", 16));
+    CHECK(collected.Texts[1] == "binary 7\n");
+    CHECK(collected.Records[0].Timestamp != 0);
+    CHECK(collected.Records[0].ThreadId != 0);
+    CHECK_EQUAL(collected.Records[0].Sequence + 1,
+                collected.Records[1].Sequence);
+}
+
+
+TEST(MEMORYLOG_TAIL, DAMAGED_FRAME_IS_SKIPPED) {
+    memorylog::Options options;
+    options.TotalBufferSize = 4096;
+    options.ChunkSize = 1024;
+    options.RecordFrame = true;
+    CHECK(memorylog::initialize(options));
+    CHECK(memorylog::write("first\n", 6));
+    char* second = static_cast<char*>(memorylog::reserve(7));
+    CHECK(second != nullptr);
+    memcpy(second, "second\n", 7);
+    CHECK(memorylog::commit(7));
+    CHECK(memorylog::write("third\n", 6));
+
+    /* the frame of the second record is longer than the rest of the chunk */
+    uint32_t length = 1 << 30;
+    memcpy(second - sizeof(memorylog::RecordFrame), &length, sizeof(length));
+
+    memorylog::TailCursor cursor;
+    Collected collected;
+    CHECK(memorylog::tail(cursor, collect, &collected));
+    CHECK_EQUAL(2u, collected.Texts.size());
+    CHECK(collected.Texts[0] == "first\n");
+    CHECK(collected.Texts[1] == "third\n");
+}
+
+
+TEST(MEMORYLOG_TAIL, FORGED_BINARY_PREFIX) {
+    CHECK(memorylog::initialize(65536, 4096));
+    /* an unframed text holding the prefix of a binary record at an
+     * aligned offset, followed by an address of no format */
+    char payload[48];
+    memset(payload, 'x', 16);
+    memcpy(payload + 16, memorylog::BINARY_RECORD_PREFIX,
+           memorylog::RECORD_PREFIX_SIZE);
+    memset(payload + 32, 0x41, 8);
+    memset(payload + 40, 0, 8);
+    CHECK(memorylog::write(payload, sizeof(payload)));
+    CHECK(memorylog::binary_write("after %d\n", 7));
+
+    memorylog::TailCursor cursor;
+    Collected collected;
+    CHECK(memorylog::tail(cursor, collect, &collected));
+    CHECK_EQUAL(3u, collected.Texts.size());
+    CHECK(collected.Texts[0] == std::string(16, 'x'));
+    CHECK(collected.Texts[1] == "<unknown format 0x4141414141414141>");
+    CHECK(collected.Texts[2] == "after 7\n");
+}
+
+
+TEST(MEMORYLOG_TAIL, BATCH) {
+    memorylog::Options options;
+    options.TotalBufferSize = 4096;
+    options.ChunkSize = 1024;
+    options.RecordHeader = true;
+    options.RecordFrame = true;
+    memorylog::Log log(options);
+    char first[] = "first\n";
+    char second[] = "second\0with zero\n";
+    char third[] = "third\n";
+    struct iovec records[] = {
+        {first, strlen(first)},
+        {second, sizeof(second) - 1},
+        {third, strlen(third)},
+    };
+    CHECK(log.write_batch(records, 3));
+
+    memorylog::TailCursor cursor;
+    Collected collected;
+    CHECK(log.tail(cursor, collect, &collected));
+    CHECK_EQUAL(3u, collected.Texts.size());
+    CHECK(collected.Texts[0] == "first\n");
+    CHECK(collected.Texts[1] == std::string(second, sizeof(second) - 1));
+    CHECK(collected.Texts[2] == "third\n");
+    CHECK_EQUAL(collected.Records[0].Sequence + 1,
+                collected.Records[1].Sequence);
+    CHECK_EQUAL(collected.Records[1].Sequence + 1,
+                collected.Records[2].Sequence);
+}
+
+
+TEST(MEMORYLOG_TAIL, CONCURRENT_WRITERS) {
+    /* a small ring is reused all the time while the reader follows it,
+     * every record it gets must be whole */
+    CHECK(memorylog::initialize(4096, 256));
+    std::atomic<bool> stop(false);
+    auto writer = [&stop]() {
+        for (uint32_t i = 0; !stop.load(); ++i)
+            memorylog::format_write("value %u check %u\n", i, i * 7);
+    };
+    std::thread writers[2] = {std::thread(writer), std::thread(writer)};
+
+    memorylog::TailCursor cursor;
+    size_t records = 0;
+    size_t errors = 0;
+    auto read = [&]() {
+        Collected collected;
+        CHECK(memorylog::tail(cursor, collect, &collected));
+        for (const auto& text : collected.Texts) {
+            unsigned value, check;
+            if (sscanf(text.c_str(), "value %u check %u\n", &value, &check)
+                != 2 || check != value * 7)
+                ++errors;
+        }
+        records += collected.Texts.size();
+    };
+    for (int round = 0; round < 100000 && records < 10000; ++round) {
+        read();
+        std::this_thread::yield();
+    }
+    stop = true;
+    for (auto& thread : writers)
+        thread.join();
+    read();
+
+    CHECK_EQUAL(0u, errors);
+    CHECK(records > 0);
+}
+
+
+TEST(MEMORYLOG_LOG, EXITED_THREADS_CHUNKS_ARE_RESUMED) {
+    /* four chunks and twenty short threads: each thread goes on in the
+     * chunk of the previous one, so no record is overwritten */
+    memorylog::Log log(log_options(4096, 1024));
+    for (int i = 0; i < 20; ++i) {
+        std::thread thread([&log, i]() {
+            CHECK(log.format_write("thread %d\n", i));
+        });
+        thread.join();
+    }
+
+    memorylog::Stats stats;
+    CHECK(log.stats(stats));
+    CHECK_EQUAL(19u, stats.ResumedChunks);
+    CHECK_EQUAL(0u, stats.FilledChunks);
+    CHECK_EQUAL(0u, stats.WastedBytes);
+
+    memorylog::TailCursor cursor;
+    std::vector<std::string> texts;
+    CHECK(log.tail(cursor, [](void* arg, const memorylog::TailRecord& record) {
+        static_cast<std::vector<std::string>*>(arg)->emplace_back(
+            record.Text, record.Size);
+        return true;
+    }, &texts));
+    CHECK_EQUAL(20u, texts.size());
+    for (int i = 0; i < 20; ++i)
+        CHECK(texts[i] == "thread " + std::to_string(i) + "\n");
+}
+
+
+TEST(MEMORYLOG_LOG, WASTED_BYTES) {
+    /* a record takes 64 bytes (16 prefix, 40 text, aligned), a chunk has
+     * 240 bytes after its header: 3 records and 48 bytes wasted */
+    memorylog::Log log(log_options(4096, 256));
+    char record[40];
+    memset(record, 'x', sizeof(record));
+    for (int i = 0; i < 7; ++i)
+        CHECK(log.write(record, sizeof(record)));
+
+    memorylog::Stats stats;
+    CHECK(log.stats(stats));
+    CHECK_EQUAL(2u, stats.FilledChunks);
+    CHECK_EQUAL(96u, stats.WastedBytes);
+    CHECK_EQUAL(0u, stats.ResumedChunks);
+}
+
+
+TEST(MEMORYLOG_INIT, INVALID_LARGE_CHUNK_SIZE) {
+    memorylog::Options options;
+    options.TotalBufferSize = 16384;
+    options.ChunkSize = 1024;
+    options.LargeChunkSize = 1024;
+    CHECK(!memorylog::initialize(options));
+    options.LargeChunkSize = 1536;
+    CHECK(!memorylog::initialize(options));
+    options.LargeChunkSize = 16384;
+    CHECK(!memorylog::initialize(options));
+    options.LargeChunkSize = 8192;
+    CHECK(memorylog::initialize(options));
+    memorylog::finalize();
+}
+
+
+TEST(MEMORYLOG_LOG, HOT_THREAD_GETS_LARGE_CHUNKS) {
+    /* a record takes 224 bytes: the first small chunk is filled by
+     * 4 records at once, the rest go to large chunks of 36 records */
+    auto options = log_options(65536, 1024);
+    options.LargeChunkSize = 8192;
+    memorylog::Log log(options);
+    char record[200];
+    memset(record, 'x', sizeof(record));
+    for (int i = 0; i < 100; ++i)
+        CHECK(log.write(record, sizeof(record)));
+
+    memorylog::Stats stats;
+    CHECK(log.stats(stats));
+    CHECK_EQUAL(4u, stats.TakenChunks);
+    CHECK_EQUAL(3u, stats.TakenLargeChunks);
+
+    memorylog::TailCursor cursor;
+    size_t records = 0;
+    CHECK(log.tail(cursor, [](void* arg, const memorylog::TailRecord& record) {
+        if (record.Size >= 200 && record.Text[0] == 'x' &&
+            record.Text[199] == 'x')
+            ++*static_cast<size_t*>(arg);
+        return true;
+    }, &records));
+    CHECK_EQUAL(100u, records);
+}
+
+
+TEST(MEMORYLOG_LOG, QUIET_THREAD_KEEPS_SMALL_CHUNKS) {
+    /* a small chunk has room for 4 records, the thread writes a record
+     * every 2 milliseconds and is never hot */
+    auto options = log_options(65536, 1024);
+    options.LargeChunkSize = 4096;
+    memorylog::Log log(options);
+    char record[200];
+    memset(record, 'x', sizeof(record));
+    for (int i = 0; i < 10; ++i) {
+        CHECK(log.write(record, sizeof(record)));
+        usleep(2000);
+    }
+
+    memorylog::Stats stats;
+    CHECK(log.stats(stats));
+    CHECK_EQUAL(3u, stats.TakenChunks);
+    CHECK_EQUAL(0u, stats.TakenLargeChunks);
+}
+
+
+TEST(MEMORYLOG_LOG, SLOWED_DOWN_THREAD_GOES_BACK_TO_SMALL_CHUNKS) {
+    /* a large chunk has room for 18 records: it is taken after 4 quick
+     * records and filled in about 24 milliseconds, more than 4 times slower
+     * than the rate of a hot thread; the last 8 records go to 2 small
+     * chunks */
+    auto options = log_options(65536, 1024);
+    options.LargeChunkSize = 4096;
+    memorylog::Log log(options);
+    char record[200];
+    memset(record, 'x', sizeof(record));
+    for (int i = 0; i < 10; ++i)
+        CHECK(log.write(record, sizeof(record)));
+    for (int i = 0; i < 20; ++i) {
+        CHECK(log.write(record, sizeof(record)));
+        usleep(2000);
+    }
+
+    memorylog::Stats stats;
+    CHECK(log.stats(stats));
+    CHECK_EQUAL(4u, stats.TakenChunks);
+    CHECK_EQUAL(1u, stats.TakenLargeChunks);
+}
+
+
+TEST(MEMORYLOG_LOG, WRITE_COUNTERS) {
+    /* 3 records fit into a chunk of 256 bytes (see WASTED_BYTES) */
+    memorylog::Log log(log_options(4096, 256));
+    char record[40];
+    memset(record, 'x', sizeof(record));
+    for (int i = 0; i < 7; ++i)
+        CHECK(log.write(record, sizeof(record)));
+    char large[300] = {};
+    CHECK(!log.write(large, sizeof(large)));
+
+    /* the write takes the reserved place */
+    CHECK(log.reserve(16) != nullptr);
+    CHECK(log.write(record, sizeof(record)));
+    CHECK(!log.commit(16));
+
+    /* does not fit into the 112 bytes left in the third chunk */
+    CHECK(log.format_write("%s\n", std::string(100, 'y').c_str()));
+
+    memorylog::Stats stats;
+    CHECK(log.stats(stats));
+    CHECK_EQUAL(9u, stats.Writes.Records);
+    CHECK_EQUAL(8u * 40 + 101, stats.Writes.Bytes);
+    CHECK_EQUAL(1u, stats.Writes.DroppedTooLarge);
+    CHECK_EQUAL(0u, stats.Writes.DroppedNoChunk);
+    CHECK_EQUAL(1u, stats.Writes.DroppedReservations);
+    CHECK_EQUAL(3u, stats.Writes.ChunkSwitches);
+    CHECK_EQUAL(0u, stats.Writes.QueueFailures);
+    CHECK_EQUAL(1u, stats.Writes.FormatRetries);
+}
+
+
+TEST(MEMORYLOG_LOG, WRITE_BATCH) {
+    /* 3 records fit into a chunk of 256 bytes (see WASTED_BYTES), the
+     * batch takes three chunks */
+    memorylog::Log log(log_options(4096, 256));
+    char texts[7][41];
+    char large[300] = {};
+    struct iovec records[8];
+    for (int i = 0; i < 7; ++i) {
+        snprintf(texts[i], sizeof(texts[i]), "batch record %d %024d\n", i, 0);
+        records[i < 4 ? i : i + 1] = {texts[i], 40};
+    }
+    records[4] = {large, sizeof(large)};
+
+    /* the record too large for a chunk is dropped, the others are not */
+    CHECK(!log.write_batch(records, 8));
+    CHECK(log.write_batch(records, 0));
+
+    memorylog::Stats stats;
+    CHECK(log.stats(stats));
+    CHECK_EQUAL(7u, stats.Writes.Records);
+    CHECK_EQUAL(7u * 40, stats.Writes.Bytes);
+    CHECK_EQUAL(1u, stats.Writes.DroppedTooLarge);
+    CHECK_EQUAL(2u, stats.Writes.ChunkSwitches);
+
+    const char* filename = "log-dump-batch";
+    CHECK(log.dump(filename));
+    for (int i = 0; i < 7; ++i)
+        CHECK(find_decoded_string(filename, texts[i]));
+
+    /* there is no global log */
+    CHECK(!memorylog::write_batch(records, 1));
+}
+
+
+TEST(MEMORYLOG_LOG, THREAD_STATS) {
+    /* two chunks: the thread keeps one, the main thread the other, so
+     * the third thread has none */
+    memorylog::Log log(log_options(512, 256));
+    std::atomic<bool> written(false), done(false);
+    std::thread keeper([&]() {
+        for (int i = 0; i < 3; ++i)
+            CHECK(log.write("kept\n", 5));
+        written = true;
+        while (!done)
+            std::this_thread::yield();
+    });
+    while (!written)
+        std::this_thread::yield();
+    CHECK(log.write("main\n", 5));
+    std::thread([&log]() {
+        CHECK(!log.write("none\n", 5));
+    }).join();
+
+    std::vector<memorylog::ThreadStats> threads;
+    CHECK(log.thread_stats(threads));
+    CHECK_EQUAL(2u, threads.size());
+    uint64_t records = 0;
+    for (const auto& thread : threads) {
+        CHECK(thread.ThreadId != 0);
+        records += thread.Writes.Records;
+    }
+    CHECK_EQUAL(4u, records);
+
+    done = true;
+    keeper.join();
+    CHECK(log.thread_stats(threads));
+    CHECK_EQUAL(1u, threads.size());
+    CHECK_EQUAL(1u, threads[0].Writes.Records);
+    CHECK_EQUAL((uint32_t)getpid(), threads[0].ThreadId);
+
+    memorylog::Stats stats;
+    CHECK(log.stats(stats));
+    CHECK_EQUAL(4u, stats.Writes.Records);
+    CHECK_EQUAL(20u, stats.Writes.Bytes);
+    CHECK_EQUAL(1u, stats.Writes.DroppedNoChunk);
+}
+
+
+TEST(MEMORYLOG_LOG, RECORD_LARGER_THAN_RESUMED_CHUNK) {
+    /* the exited thread leaves 48 bytes, the record goes to a free chunk */
+    memorylog::Log log(log_options(4096, 256));
+    std::thread([&log]() {
+        char record[40];
+        memset(record, 'x', sizeof(record));
+        for (int i = 0; i < 3; ++i)
+            CHECK(log.write(record, sizeof(record)));
+    }).join();
+    char record[100];
+    memset(record, 'y', sizeof(record));
+    CHECK(log.write(record, sizeof(record)));
+
+    memorylog::Stats stats;
+    CHECK(log.stats(stats));
+    CHECK_EQUAL(1u, stats.ResumedChunks);
+    CHECK_EQUAL(4u, stats.Writes.Records);
+    CHECK_EQUAL(0u, stats.Writes.DroppedTooLarge);
+}
+
+
+static void check_lz_round_trip(const std::string& data) {
+    std::vector<char> compressed(data.size() + data.size() / 8 + 16);
+    size_t size = memorylog::lz_compress(
+        data.data(), data.size(), compressed.data(), compressed.size());
+    CHECK(size != 0);
+    std::vector<char> restored(data.size() + 1);
+    CHECK(memorylog::lz_decompress(
+        compressed.data(), size, restored.data(), data.size()));
+    CHECK(std::string(restored.data(), data.size()) == data);
+}
+
+
+TEST(LZ_CODEC, ROUND_TRIP) {
+    check_lz_round_trip("");
+    check_lz_round_trip("abc");
+    check_lz_round_trip(std::string(100000, 'a'));
+
+    std::string records;
+    for (int i = 0; i < 1000; ++i)
+        records += "state " + std::to_string(i % 7) + " -> " +
+            std::to_string(i % 5) + " user " + std::to_string(i * 31) + "\n";
+    check_lz_round_trip(records);
+
+    std::string noise;
+    uint32_t seed = 1;
+    for (int i = 0; i < 5000; ++i) {
+        seed = seed * 1103515245 + 12345;
+        noise.push_back(seed >> 16);
+    }
+    check_lz_round_trip(noise);
+}
+
+
+TEST(LZ_CODEC, COMPRESSES_RECORDS) {
+    std::string records;
+    for (int i = 0; i < 1000; ++i)
+        records += "connection " + std::to_string(i % 16) +
+            " state CONNECTED -> IDLE, queued requests 0\n";
+    std::vector<char> compressed(records.size());
+    size_t size = memorylog::lz_compress(
+        records.data(), records.size(), compressed.data(), compressed.size());
+    CHECK(size != 0);
+    CHECK(size * 5 < records.size());
+}
+
+
+TEST(LZ_CODEC, NOT_FITTING_OR_MALFORMED) {
+    std::string noise;
+    uint32_t seed = 1;
+    for (int i = 0; i < 1000; ++i) {
+        seed = seed * 1103515245 + 12345;
+        noise.push_back(seed >> 16);
+    }
+    char compressed[2048];
+    CHECK_EQUAL(0u, memorylog::lz_compress(
+        noise.data(), noise.size(), compressed, 500));
+
+    std::string text(2000, 'x');
+    size_t size = memorylog::lz_compress(
+        text.data(), text.size(), compressed, sizeof(compressed));
+    CHECK(size != 0);
+    char restored[2000];
+    /* truncated, a wrong size, a match before the start */
+    CHECK(!memorylog::lz_decompress(compressed, size - 1, restored, 2000));
+    CHECK(!memorylog::lz_decompress(compressed, size, restored, 1999));
+    const char bad_offset[] = {0x10, 'x', 0x05, 0x00};
+    CHECK(!memorylog::lz_decompress(bad_offset, 4, restored, 6));
+}
+
+
+TEST(MEMORYLOG_INIT, INVALID_COMPRESSED_BUFFER_SIZE) {
+    memorylog::Options options;
+    options.TotalBufferSize = 16384;
+    options.ChunkSize = 1024;
+    options.CompressedBufferSize = 1024;
+    CHECK(!memorylog::initialize(options));
+    options.CompressedBufferSize = 4096;
+    options.DrainPath = "log-compress-drain";
+    CHECK(!memorylog::initialize(options));
+    options.DrainPath = nullptr;
+    CHECK(memorylog::initialize(options));
+    memorylog::finalize();
+}
+
+
+TEST(MEMORYLOG_COMPRESS, RECORDS_ARE_DECODED_FROM_BLOCKS) {
+    /* about 12 chunks of records, all of them fit into the buffer */
+    CHECK(memorylog::initialize(compress_options(65536)));
+    for (uint32_t i = 0; i < 1500; ++i) {
+        if (i % 3 == 0)
+            CHECK(memorylog::binary_write("squeezed %u\n", i));
+        else
+            CHECK(memorylog::format_write("squeezed %u\n", i));
+    }
+    memorylog::Stats stats = wait_for_compressor();
+    CHECK(stats.CompressedChunks >= 10);
+    CHECK_EQUAL(stats.FilledChunks, stats.CompressedChunks);
+    CHECK_EQUAL(0u, stats.EvictedBlocks);
+    CHECK(stats.CompressedBytes * 2 < stats.CompressedRawBytes);
+    CHECK(memorylog::dump("log-compress1"));
+
+    /* every record once: from a block or from a chunk not yet full */
+    std::string image = read_file("log-compress1");
+    std::string decoded = "\n" + extract(image, 1, 0);
+    for (uint32_t i = 0; i < 1500; ++i) {
+        std::string line = "\nsqueezed " + std::to_string(i) + "\n";
+        size_t found = decoded.find(line);
+        CHECK(found != std::string::npos);
+        CHECK(decoded.find(line, found + 1) == std::string::npos);
+    }
+    CHECK(decoded.substr(1) == extract(image, 3, 4096));
+    CHECK(decoded.substr(1) == extract(image, 2, 1040));
+}
+
+
+TEST(MEMORYLOG_COMPRESS, OLDEST_BLOCKS_ARE_EVICTED) {
+    CHECK(memorylog::initialize(compress_options(8192)));
+    for (uint32_t i = 0; i < 5000; ++i) {
+        CHECK(memorylog::format_write("evicted %u\n", i));
+        if (i % 100 == 0)
+            wait_for_compressor();
+    }
+    memorylog::Stats stats = wait_for_compressor();
+    CHECK(stats.EvictedBlocks > 0);
+    CHECK(memorylog::dump("log-compress2"));
+
+    /* the newest records are there, nothing torn or repeated */
+    std::string decoded = "\n" + read_decoded("log-compress2");
+    CHECK(decoded.find("\nevicted 4999\n") != std::string::npos);
+    size_t records = 0;
+    for (size_t pos = decoded.find("\nevicted "); pos != std::string::npos;
+         pos = decoded.find("\nevicted ", pos + 1))
+    {
+        size_t end = decoded.find('\n', pos + 1);
+        CHECK(end != std::string::npos);
+        std::string line = decoded.substr(pos, end - pos + 1);
+        CHECK(decoded.find(line, pos + 1) == std::string::npos);
+        ++records;
+    }
+    CHECK(records > 0 && records < 5000);
+}
+
+
+enum class ConnState : uint8_t { IDLE, OPEN, CLOSED };
+
+static const memorylog::Schema<uint32_t, ConnState, ConnState, int16_t>
+    TRANSITION("connection %u: %d -> %d (%hd)\n");
+
+static const memorylog::Schema<int8_t, uint64_t, int64_t, float, double, bool>
+    ALL_FIELDS("%hhd %llu %lld %.1f %.3f %d\n");
+
+static const memorylog::Schema<> NO_FIELDS("no fields\n");
+
+static_assert(decltype(TRANSITION)::SIZE == 8, "fields are packed");
+
+
+TEST(MEMORYLOG_SCHEMA, WRITE_AND_DECODE) {
+    CHECK(memorylog::initialize(4096, 1024));
+    CHECK(memorylog::schema_write(
+        TRANSITION, 7, ConnState::IDLE, ConnState::OPEN, -3));
+    CHECK(memorylog::schema_write(
+        ALL_FIELDS, -100, 1ull << 63, -(1ll << 40), 2.5f, 0.125, true));
+    CHECK(memorylog::schema_write(NO_FIELDS));
+    CHECK(MEMORYLOG_SCHEMA(
+        INFO, 0, TRANSITION, 8, ConnState::OPEN, ConnState::CLOSED, 0));
+    CHECK(memorylog::dump("log-schema1"));
+
+    std::string expected =
+        "connection 7: 0 -> 1 (-3)\n"
+        "-100 9223372036854775808 -1099511627776 2.5 0.125 1\n"
+        "no fields\n"
+        "connection 8: 1 -> 2 (0)\n";
+    CHECK_EQUAL(expected,
+                read_decoded("log-schema1").substr(0, expected.size()));
+}
+
+
+TEST(MEMORYLOG_SCHEMA, RECORDS_ARE_THE_FIELDS) {
+    CHECK(memorylog::initialize(4096, 1024));
+    CHECK(memorylog::schema_write(
+        TRANSITION, 1, ConnState::OPEN, ConnState::CLOSED, 5));
+    memorylog::Stats stats;
+    CHECK(memorylog::stats(stats));
+    CHECK_EQUAL(1u, stats.Writes.Records);
+    /* the type id and the fields, nothing else */
+    CHECK_EQUAL(4u + 8u, stats.Writes.Bytes);
+}
+
+
+TEST(MEMORYLOG_SCHEMA, EVERY_LOG_GETS_THE_MANIFEST) {
+    memorylog::Options options;
+    options.TotalBufferSize = 4096;
+    options.ChunkSize = 1024;
+    options.RecordHeader = true;
+    options.RecordFrame = true;
+    for (int round = 0; round < 2; ++round) {
+        memorylog::Log log(options);
+        CHECK(log.schema_write(
+            TRANSITION, round, ConnState::CLOSED, ConnState::IDLE, 1));
+        CHECK(MEMORYLOG_LOG_SCHEMA(
+            log, INFO, 0, TRANSITION, 10, ConnState::IDLE, ConnState::IDLE, 2));
+        CHECK(log.dump("log-schema2"));
+        std::string decoded = read_decoded("log-schema2");
+        std::string first = "] connection " + std::to_string(round) +
+            ": 2 -> 0 (1)\n";
+        CHECK(decoded.find(first) != std::string::npos);
+        CHECK(decoded.find("] connection 10: 0 -> 0 (2)\n") !=
+              std::string::npos);
+    }
+}
+
+
+TEST(MEMORYLOG_SCHEMA, TAIL) {
+    CHECK(memorylog::initialize(4096, 1024));
+    memorylog::TailCursor cursor;
+    std::vector<std::string> texts;
+    auto collect = [](void* arg, const memorylog::TailRecord& record) {
+        static_cast<std::vector<std::string>*>(arg)->emplace_back(
+            record.Text, record.Size);
+        return true;
+    };
+    CHECK(memorylog::schema_write(
+        TRANSITION, 3, ConnState::OPEN, ConnState::OPEN, 4));
+    CHECK(memorylog::format_write("text\n"));
+    CHECK(memorylog::tail(cursor, collect, &texts));
+    CHECK_EQUAL(2u, texts.size());
+    CHECK_EQUAL(std::string("connection 3: 1 -> 1 (4)\n"), texts[0]);
+    CHECK_EQUAL(std::string("text\n"), texts[1]);
+}
+
+
+TEST(MEMORYLOG_SCHEMA, UNKNOWN_OR_MALFORMED) {
+    char payload[8] = {7, 0, 0, 0, 1, 2, 3, 4};
+    std::string text;
+    size_t size = 0;
+    CHECK(memorylog::format_schema_record(
+        payload, sizeof(payload), nullptr, 0, nullptr, text, size));
+    CHECK_EQUAL(std::string("<unknown schema 7>"), text);
+    CHECK_EQUAL(4u, size);
+
+    /* a field past the end of the record and a field of unknown type */
+    const unsigned char wide[] = {memorylog::detail::FIELD_UINT64};
+    CHECK(!memorylog::format_schema_record(
+        payload, sizeof(payload), wide, 1, "%llu", text, size));
+    const unsigned char bad[] = {99};
+    CHECK(!memorylog::format_schema_record(
+        payload, sizeof(payload), bad, 1, "%d", text, size));
+}
+
+
+TEST(MEMORYLOG_CRASH, RECORDS_ARE_WRITTEN_ON_ABORT) {
+    int status = crash_child("log-crash1", []() {
+        memorylog::format_write("before the abort %d\n", 1);
+        memorylog::binary_write("binary before the abort %d\n", 2);
+        abort();
+    });
+    CHECK(WIFSIGNALED(status));
+    CHECK_EQUAL(SIGABRT, WTERMSIG(status));
+    CHECK_EQUAL(std::string("before the abort 1\nbinary before the abort 2\n"),
+                read_decoded("log-crash1"));
+}
+
+
+TEST(MEMORYLOG_CRASH, RECORDS_ARE_WRITTEN_ON_SEGFAULT) {
+    int status = crash_child("log-crash2", []() {
+        for (int i = 0; i < 300; ++i)
+            memorylog::format_write("record %d\n", i);
+        *static_cast<volatile int*>(nullptr) = 1;
+    });
+    CHECK(WIFSIGNALED(status));
+    CHECK_EQUAL(SIGSEGV, WTERMSIG(status));
+    /* the buffer keeps the last chunks only */
+    std::string decoded = "\n" + read_decoded("log-crash2");
+    CHECK(decoded.find("\nrecord 299\n") != std::string::npos);
+    CHECK(decoded.find("\nrecord 0\n") == std::string::npos);
+}
+
+
+static void exit_on_abort(int) {
+    _exit(42);
+}
+
+
+TEST(MEMORYLOG_CRASH, PREVIOUS_HANDLER_IS_CALLED) {
+    int status = crash_child("log-crash3", []() {
+        memorylog::format_write("chained\n");
+        abort();
+    }, exit_on_abort);
+    CHECK(WIFEXITED(status));
+    CHECK_EQUAL(42, WEXITSTATUS(status));
+    CHECK_EQUAL(std::string("chained\n"), read_decoded("log-crash3"));
+}
+
+
+TEST(MEMORYLOG_CRASH, CRASH_DUMP_SEALS_THE_LOG) {
+    CHECK(!memorylog::crash_dump(1));
+    CHECK(memorylog::initialize(4096, 1024));
+    for (int i = 0; i < 5; ++i)
+        CHECK(memorylog::format_write("sealed %d\n", i));
+
+    int fd = open("log-crash4", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    CHECK(memorylog::crash_dump(fd));
+    close(fd);
+    CHECK_EQUAL(
+        std::string("sealed 0\nsealed 1\nsealed 2\nsealed 3\nsealed 4\n"),
+        read_decoded("log-crash4"));
+
+    /* the current chunk still takes records, no new chunk is given */
+    CHECK(memorylog::format_write("after the dump\n"));
+    char big[900];
+    memset(big, 'x', sizeof(big));
+    CHECK(!memorylog::write(big, sizeof(big)));
+    CHECK(!memorylog::crash_dump(-1));
+}
+
+
+/* Formats with the engine and checks it against vsnprintf */
+static std::string engine_format(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    char text[512];
+    memset(text, '#', sizeof(text));
+    ptrdiff_t size = memorylog::format_text(text, 8, format, args);
+    std::string result;
+    if (size >= 0) {
+        /* the text past the size given is measured, not written */
+        CHECK_EQUAL('#', text[std::min<ptrdiff_t>(size, 8)]);
+        result.resize(size + 1, '#');
+        char* end = memorylog::format_to(&result[0], format, args);
+        CHECK_EQUAL(size, end - &result[0]);
+        CHECK_EQUAL('#', result[size]);
+        result.resize(size);
+        CHECK_EQUAL(0, memcmp(text, result.data(), std::min<ptrdiff_t>(size, 8)));
+
+        char expected[512];
+        va_list args_copy;
+        va_copy(args_copy, args);
+        vsnprintf(expected, sizeof(expected), format, args_copy);
+        va_end(args_copy);
+        STRCMP_EQUAL(expected, result.c_str());
+    }
+    va_end(args);
+    return size < 0 ? "<unsupported>" : result;
+}
+
+
+TEST(FORMAT_ENGINE, INTEGERS) {
+    engine_format("%d %i %u %x %X %o", 0, -1, 3000000000u, 0xbeef, 0xbeef, 8);
+    engine_format("[%5d] [%-5d] [%05d] [%+d] [% d] [%.3d] [%8.3d]",
+        42, 42, -42, 42, 42, 7, -7);
+    engine_format("%ld %lld %lu %llx %zu %zd %jd %td",
+        std::numeric_limits<long>::min(),
+        std::numeric_limits<long long>::max(),
+        std::numeric_limits<unsigned long>::max(),
+        0x0123456789abcdefull, (size_t)12345, (ssize_t)-12345,
+        (intmax_t)-1, (ptrdiff_t)99);
+    engine_format("%hhd %hhu %hd %hu", 300, 300, 70000, 70000);
+    engine_format("%#x %#X %#o %#x %#o %.0d|%.0x", 255, 255, 8, 0, 0, 0, 0);
+    engine_format("%*d|%-*d|%.*d|%*d", 6, 1, 6, 2, 4, 3, -6, 4);
+}
+
+
+TEST(FORMAT_ENGINE, STRINGS_AND_POINTERS) {
+    int value = 0;
+    engine_format("%s|%10s|%-10s|%.3s|%c|%3c|%%", "abc", "abc", "abc",
+        "abcdef", 'x', 'y');
+    engine_format("%.*s|%s", 2, "not terminated", "");
+    engine_format("%p %20p %-20p|", &value, &value, (void*)nullptr);
+}
+
+
+TEST(FORMAT_ENGINE, FLOATS) {
+    engine_format("%f %f %f %f", 0.0, -0.0, 1.5, -123.456);
+    engine_format("%.0f %.0f %.0f %.0f %.1f", 0.5, 1.5, 2.5, 3.5, 0.05);
+    engine_format("%e %E %.0e %#.0e %.10e", 12345.678, 0.125, 0.5,
+        1e18, 1.0 / 3);
+    engine_format("%g %g %g %g %g %G", 100000.0, 1000000.0, 0.0001220703125,
+        0.00000762939453125, 0.3, 1.5e19);
+    engine_format("%#g %.3g %.0g %#.3g %g", 1.0, 3.14159, 0.5, 100.0, 0.0);
+    engine_format("%f %e %g %F %E %G", 1.0 / 0.0, -1.0 / 0.0, 0.0 / 0.0,
+        1.0 / 0.0, 1.0 / 0.0, -(0.0 / 0.0));
+    engine_format("[%12.4f] [%-12.4e] [%012.4f] [%+g] [% g]",
+        3.25, -3.25, -3.25, 3.25, 3.25);
+    engine_format("%.20f %.17g %.0f", 0.1, 0.1, 18446744073709549568.0);
+    engine_format("%.3f", (double)1.5f);
+}
+
+
+TEST(FORMAT_ENGINE, FLOAT_RANGE) {
+    const std::string unsupported = "<unsupported>";
+    /* the ends of the fixed point range: 2^-60, the 53 bits mantissa with
+     * 60 bits after the binary point and the largest double below 2^64 */
+    double least = ldexp(1, -60);
+    CHECK(engine_format("%.70f %.30e %.25g", least, least, least)
+          != unsupported);
+    double full = ldexp((double)((1ull << 53) - 1), -60);
+    CHECK(engine_format("%.70f %.5e %g", full, full, full) != unsupported);
+    CHECK(engine_format("%.400f", full) != unsupported);
+    double largest = 18446744073709549568.0;
+    CHECK(engine_format("%e %.30g", largest, largest) != unsupported);
+    /* the digit past the precision is a 5 and the digits after it decide */
+    CHECK(engine_format("%.0f %.0f %.1f %.2e %.3g", 0.5000000000000001, 2.5,
+                        0.25, 1.125, 1.0625) != unsupported);
+    CHECK(engine_format("%.15f %.16e %.17g", 0.1 + 0.2, 0.1 + 0.2, 0.1 + 0.2)
+          != unsupported);
+}
+
+
+TEST(FORMAT_ENGINE, UNSUPPORTED) {
+    STRCMP_EQUAL("<unsupported>", engine_format("%a", 1.0).c_str());
+    STRCMP_EQUAL("<unsupported>", engine_format("%Lf", 1.0L).c_str());
+    STRCMP_EQUAL("<unsupported>", engine_format("%1$d", 1).c_str());
+    STRCMP_EQUAL("<unsupported>", engine_format("%ls", L"x").c_str());
+    STRCMP_EQUAL("<unsupported>", engine_format("%'d", 1000).c_str());
+    STRCMP_EQUAL("<unsupported>", engine_format("%q", 1).c_str());
+    /* doubles out of the fixed point range */
+    STRCMP_EQUAL("<unsupported>", engine_format("%g", 1e300).c_str());
+    STRCMP_EQUAL("<unsupported>", engine_format("%f", 0.000123).c_str());
+    STRCMP_EQUAL("<unsupported>", engine_format("%e", 5e-324).c_str());
+    STRCMP_EQUAL("<unsupported>",
+        engine_format("%d %g", 1, ldexp(1, 64)).c_str());
+    STRCMP_EQUAL("<unsupported>",
+        engine_format("%g", ldexp((double)((1ull << 53) - 1), -61)).c_str());
+}
+
+
+TEST(MEMORYLOG_LOG, UNSUPPORTED_FORMAT_FALLS_BACK) {
+    memorylog::Log log(log_options(4096, 256));
+    char record[40];
+    memset(record, 'x', sizeof(record));
+    for (int i = 0; i < 5; ++i)
+        CHECK(log.write(record, sizeof(record)));
+
+    /* the text does not fit into the 112 bytes left in the second chunk,
+     * vsnprintf formats it once more in the next one */
+    CHECK(log.format_write("%s %La\n", std::string(110, 'y').c_str(), 1.0L));
+    CHECK(log.format_write("%d %.2f\n", 42, 2.5));
+
+    memorylog::Stats stats;
+    CHECK(log.stats(stats));
+    CHECK_EQUAL(7u, stats.Writes.Records);
+    CHECK_EQUAL(1u, stats.Writes.FormatRetries);
+
+    const char* filename = "log-dump-format-fallback";
+    CHECK(log.dump(filename));
+    CHECK(find_decoded_string(filename, " 0x8p-3\n"));
+    CHECK(find_decoded_string(filename, "42 2.50\n"));
+}
+
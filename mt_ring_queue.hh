@@ -31,12 +31,23 @@ SOFTWARE.
 
 /* This is a multiple producers multiple consumers lock-free queue.
  * No strong order guarantee but in practice it is ordered in most cases.
- * It is almost wait-free, but there is a very little chance for live-lock. */
+ * It is almost wait-free, but there is a very little chance for live-lock.
+ *
+ * Memory ordering: a successful put of an element into a slot releases
+ * and taking it acquires, so everything a producer did with the pointed
+ * object before enqueue is visible to the consumer. The semaphores are
+ * released after a slot is filled (emptied) and acquired when a place is
+ * booked, so a thread that booked an element (space) finds it in a slot.
+ * Head and Tail only hand out slot numbers and can be relaxed. */
 
 
 namespace memorylog {
 
 
+/* Hot counters are kept this far apart to avoid false sharing */
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+
 template <typename PTR_TYPE>
 struct Deleter {
     static inline void delete_pointer(PTR_TYPE elem) {
@@ -57,10 +68,11 @@ class RingPtrQueue {
 public:
     RingPtrQueue(size_t size)
         : Size(size)
-        , ElemSemaphore(size)
         , Buffer(new std::atomic<PTR_TYPE>[size])
+        , ElemSemaphore(size)
     {
-        memset(&Buffer[0], 0, sizeof(PTR_TYPE) * size);
+        for (size_t i = 0; i < size; ++i)
+            Buffer[i].store(nullptr, std::memory_order_relaxed);
     }
 
 
@@ -81,15 +93,16 @@ public:
 
         /* Ok, there is a space for a new element, let's find it */
         for (;;) {
-            size_t slot = Tail.fetch_add(1, std::memory_order_seq_cst);
+            size_t slot = Tail.fetch_add(1, std::memory_order_relaxed);
             slot %= Size;
 
             PTR_TYPE expect = nullptr;
             bool put = Buffer[slot].compare_exchange_strong(
-                expect, elem, std::memory_order_seq_cst);
+                expect, elem,
+                std::memory_order_release, std::memory_order_relaxed);
 
             if (put) {
-                ElemSemaphore.fetch_sub(1, std::memory_order_seq_cst);
+                ElemSemaphore.fetch_sub(1, std::memory_order_release);
                 return true;
             }
         }
@@ -102,14 +115,14 @@ public:
 
         /* Ok, there is at least one element in the buffer, let's find it */
         for (;;) {
-            size_t slot = Head.fetch_add(1, std::memory_order_seq_cst);
+            size_t slot = Head.fetch_add(1, std::memory_order_relaxed);
             slot %= Size;
 
             PTR_TYPE elem =
-                Buffer[slot].exchange(nullptr, std::memory_order_seq_cst);
+                Buffer[slot].exchange(nullptr, std::memory_order_acquire);
 
             if (elem != nullptr) {
-                SpaceSemaphore.fetch_sub(1, std::memory_order_seq_cst);
+                SpaceSemaphore.fetch_sub(1, std::memory_order_release);
                 return elem;
             }
         }
@@ -119,30 +132,39 @@ public:
 private:
     bool book_space() {
         size_t let_me_pass =
-            SpaceSemaphore.fetch_add(1, std::memory_order_seq_cst) + 1;
+            SpaceSemaphore.fetch_add(1, std::memory_order_acquire) + 1;
         if (let_me_pass <= Size)
             return true;
-        SpaceSemaphore.fetch_sub(1, std::memory_order_seq_cst);
+        SpaceSemaphore.fetch_sub(1, std::memory_order_relaxed);
         return false;
     }
 
 
     bool book_elem() {
         size_t let_me_pass =
-            ElemSemaphore.fetch_add(1, std::memory_order_seq_cst) + 1;
+            ElemSemaphore.fetch_add(1, std::memory_order_acquire) + 1;
         if (let_me_pass <= Size)
             return true;
-        ElemSemaphore.fetch_sub(1, std::memory_order_seq_cst);
+        ElemSemaphore.fetch_sub(1, std::memory_order_relaxed);
         return false;
     }
 
 
+    using Counter = std::atomic<size_t>;
+
+    /* the read-only fields are next to each other and a cache line apart
+     * from the counters, the counters are a line apart from each other */
     size_t const Size;
-    std::atomic<size_t> SpaceSemaphore = {0};
-    std::atomic<size_t> ElemSemaphore;
-    std::atomic<size_t> Head = {0};
-    std::atomic<size_t> Tail = {0};
     std::unique_ptr<std::atomic<PTR_TYPE>[]> const Buffer;
+    char Padding0[CACHE_LINE_SIZE];
+    Counter SpaceSemaphore = {0};
+    char Padding1[CACHE_LINE_SIZE - sizeof(Counter)];
+    Counter ElemSemaphore;
+    char Padding2[CACHE_LINE_SIZE - sizeof(Counter)];
+    Counter Head = {0};
+    char Padding3[CACHE_LINE_SIZE - sizeof(Counter)];
+    Counter Tail = {0};
+    char Padding4[CACHE_LINE_SIZE - sizeof(Counter)];
 };
 
 
@@ -25,6 +25,8 @@ SOFTWARE.
 #include <CppUTest/TestHarness.h>
 
 #include "mt_ring_queue.hh"
+#include "sharded_queue.hh"
+#include "bounded_queue.hh"
 #include <thread>
 #include <atomic>
 
@@ -33,10 +35,16 @@ SOFTWARE.
 
 
 using memorylog::RingPtrQueue;
+using memorylog::ShardedPtrQueue;
+using memorylog::BoundedPtrQueue;
 
 
 TEST_GROUP(MT_RING_QUEUE) {};
 
+TEST_GROUP(SHARDED_QUEUE) {};
+
+TEST_GROUP(BOUNDED_QUEUE) {};
+
 
 TEST(MT_RING_QUEUE, ENQUEUE_DEQUEUE_ONE_ELEM) {
     RingPtrQueue<void*, false> queue(1);
@@ -101,7 +109,7 @@ TEST(MT_RING_QUEUE, MULTIPLE_PRODUCERS_MULTIPLE_CONSUMERS) {
     RingPtrQueue<void*, false> queue(1000000);
     SyncStart greenlight(10);
     std::atomic<uintptr_t> total_sum(0);
-    std::atomic<uint8_t> active_producers;
+    std::atomic<uint8_t> active_producers(0);
 
     auto producer_lambda = [&](uintptr_t start_number = 1) {
         ++active_producers;
@@ -118,17 +126,18 @@ TEST(MT_RING_QUEUE, MULTIPLE_PRODUCERS_MULTIPLE_CONSUMERS) {
 
         uintptr_t local_sum = 0;
         for (;;) {
+            /* the queue is drained only if it is empty after all
+             * producers are done */
+            bool last_round =
+                active_producers.load(std::memory_order_acquire) == 0;
             auto elem = queue.dequeue();
             if (elem == nullptr) {
-                if (active_producers.load(std::memory_order_acquire) == 0)
+                if (last_round)
                     break;
             } else {
                 local_sum += (uintptr_t)elem;
             }
         }
-        auto elem = queue.dequeue();
-        if (elem != nullptr)
-            local_sum += (uintptr_t)elem;
 
         //std::cout << local_sum << std::endl;
         total_sum.fetch_add(local_sum, std::memory_order_seq_cst);
@@ -151,3 +160,256 @@ TEST(MT_RING_QUEUE, MULTIPLE_PRODUCERS_MULTIPLE_CONSUMERS) {
 
     CHECK_EQUAL(total_sum.load(std::memory_order_acquire), 12502500);
 }
+
+
+/* Elements are passed around like chunks: whoever takes an element owns
+ * the pointed memory and must see what the previous owner wrote there */
+TEST(MT_RING_QUEUE, OWNERSHIP_HANDOFF) {
+    struct Payload {
+        uint64_t Value;
+        uint64_t Check;
+    };
+    Payload payloads[16];
+    RingPtrQueue<Payload*, false> queue(16);
+    for (auto& payload : payloads) {
+        payload.Value = 0;
+        payload.Check = 0;
+        queue.enqueue(&payload);
+    }
+
+    SyncStart greenlight(4);
+    std::atomic<uint64_t> errors(0);
+
+    auto thread_lambda = [&]() {
+        greenlight.WaitForGreenLight();
+        for (uint32_t i = 0; i < 100000; ++i) {
+            Payload* payload = queue.dequeue();
+            if (payload == nullptr)
+                continue;
+            if (payload->Check != payload->Value * 3)
+                ++errors;
+            ++payload->Value;
+            payload->Check = payload->Value * 3;
+            queue.enqueue(payload);
+        }
+    };
+
+    std::thread threads[4];
+    for (auto& thread : threads)
+        thread = std::thread(thread_lambda);
+    greenlight.Start();
+    for (auto& thread : threads)
+        thread.join();
+
+    CHECK_EQUAL(errors.load(), 0u);
+}
+
+TEST(SHARDED_QUEUE, ONE_SHARD_IS_FIFO) {
+    ShardedPtrQueue<void*> queue(1, 10);
+
+    for (uintptr_t i = 1; i <= 10; ++i)
+        CHECK(queue.enqueue((void*)i, 0));
+    CHECK(!queue.enqueue((void*)11, 0));
+
+    for (uintptr_t i = 1; i <= 10; ++i)
+        CHECK((void*)i == queue.dequeue(0));
+    CHECK(queue.dequeue(0) == nullptr);
+}
+
+
+TEST(SHARDED_QUEUE, STEAL_FROM_NEIGHBOURS) {
+    ShardedPtrQueue<void*> queue(4, 8);
+
+    /* all elements go to the shard 1 and overflow to the next ones */
+    for (uintptr_t i = 1; i <= 8; ++i)
+        CHECK(queue.enqueue((void*)i, 1));
+
+    uintptr_t sum = 0;
+    for (uintptr_t i = 1; i <= 8; ++i) {
+        auto elem = queue.dequeue(3);
+        CHECK(elem != nullptr);
+        sum += (uintptr_t)elem;
+    }
+    CHECK_EQUAL(sum, 36u);
+    CHECK(queue.dequeue(0) == nullptr);
+}
+
+
+TEST(SHARDED_QUEUE, MULTIPLE_PRODUCERS_MULTIPLE_CONSUMERS) {
+    ShardedPtrQueue<void*> queue(4, 5000);
+    SyncStart greenlight(8);
+    std::atomic<uintptr_t> total_sum(0);
+    std::atomic<uint8_t> active_producers(4);
+
+    auto producer_lambda = [&](uintptr_t start_number, size_t shard) {
+        greenlight.WaitForGreenLight();
+        for (uintptr_t i = start_number; i < 1250 + start_number; ++i)
+            CHECK(queue.enqueue((void*)i, shard));
+        --active_producers;
+    };
+
+    auto consumer_lambda = [&](size_t shard) {
+        greenlight.WaitForGreenLight();
+
+        uintptr_t local_sum = 0;
+        for (;;) {
+            bool last_round =
+                active_producers.load(std::memory_order_acquire) == 0;
+            auto elem = queue.dequeue(shard);
+            if (elem != nullptr)
+                local_sum += (uintptr_t)elem;
+            else if (last_round)
+                break;
+        }
+        total_sum.fetch_add(local_sum, std::memory_order_seq_cst);
+    };
+
+    std::thread producers[4];
+    std::thread consumers[4];
+
+    for (uint8_t i = 0; i < 4; ++i) {
+        producers[i] = std::thread(producer_lambda, 1 + 1250 * i, i);
+        consumers[i] = std::thread(consumer_lambda, 3 - i);
+    }
+
+    greenlight.Start();
+
+    for (uint8_t i = 0; i < 4; ++i) {
+        producers[i].join();
+        consumers[i].join();
+    }
+
+    CHECK_EQUAL(total_sum.load(std::memory_order_acquire), 12502500u);
+}
+
+
+TEST(BOUNDED_QUEUE, FIFO_AND_BOUNDS) {
+    BoundedPtrQueue<void*> queue(10);
+    CHECK_EQUAL(16u, queue.capacity());
+    CHECK(queue.dequeue() == nullptr);
+
+    for (uintptr_t i = 1; i <= 16; ++i)
+        CHECK(queue.enqueue((void*)i));
+    CHECK(!queue.enqueue((void*)17));
+
+    for (uintptr_t i = 1; i <= 16; ++i)
+        CHECK((void*)i == queue.dequeue());
+    CHECK(queue.dequeue() == nullptr);
+
+    /* the next round of the ring */
+    CHECK(queue.enqueue((void*)18));
+    CHECK((void*)18 == queue.dequeue());
+}
+
+
+TEST(BOUNDED_QUEUE, MULTIPLE_PRODUCERS_MULTIPLE_CONSUMERS) {
+    BoundedPtrQueue<void*> queue(1024);
+    SyncStart greenlight(10);
+    std::atomic<uintptr_t> total_sum(0);
+    std::atomic<uint8_t> active_producers(5);
+
+    /* an operation may fail under contention, the producers retry */
+    auto producer_lambda = [&](uintptr_t start_number) {
+        greenlight.WaitForGreenLight();
+        for (uintptr_t i = start_number; i < 1000 + start_number; ++i)
+            while (!queue.enqueue((void*)i))
+                std::this_thread::yield();
+        --active_producers;
+    };
+
+    auto consumer_lambda = [&]() {
+        greenlight.WaitForGreenLight();
+
+        uintptr_t local_sum = 0;
+        for (;;) {
+            bool last_round =
+                active_producers.load(std::memory_order_acquire) == 0;
+            auto elem = queue.dequeue();
+            if (elem != nullptr)
+                local_sum += (uintptr_t)elem;
+            else if (last_round)
+                break;
+        }
+        total_sum.fetch_add(local_sum, std::memory_order_seq_cst);
+    };
+
+    std::thread producers[5];
+    std::thread consumers[5];
+    for (uint8_t i = 0; i < 5; ++i) {
+        producers[i] = std::thread(producer_lambda, 1 + 1000 * i);
+        consumers[i] = std::thread(consumer_lambda);
+    }
+
+    greenlight.Start();
+
+    for (uint8_t i = 0; i < 5; ++i) {
+        producers[i].join();
+        consumers[i].join();
+    }
+
+    CHECK_EQUAL(total_sum.load(std::memory_order_acquire), 12502500);
+    CHECK(queue.dequeue() == nullptr);
+}
+
+
+TEST(BOUNDED_QUEUE, OWNERSHIP_HANDOFF) {
+    struct Payload {
+        uint64_t Value;
+        uint64_t Check;
+    };
+    Payload payloads[16];
+    BoundedPtrQueue<Payload*> queue(16);
+    for (auto& payload : payloads) {
+        payload.Value = 0;
+        payload.Check = 0;
+        CHECK(queue.enqueue(&payload));
+    }
+
+    SyncStart greenlight(4);
+    std::atomic<uint64_t> errors(0);
+
+    auto thread_lambda = [&]() {
+        greenlight.WaitForGreenLight();
+        for (uint32_t i = 0; i < 100000; ++i) {
+            Payload* payload = queue.dequeue();
+            if (payload == nullptr)
+                continue;
+            if (payload->Check != payload->Value * 3)
+                ++errors;
+            ++payload->Value;
+            payload->Check = payload->Value * 3;
+            while (!queue.enqueue(payload))
+                std::this_thread::yield();
+        }
+    };
+
+    std::thread threads[4];
+    for (auto& thread : threads)
+        thread = std::thread(thread_lambda);
+    greenlight.Start();
+    for (auto& thread : threads)
+        thread.join();
+
+    CHECK_EQUAL(errors.load(), 0u);
+    size_t left = 0;
+    while (queue.dequeue() != nullptr)
+        ++left;
+    CHECK_EQUAL(16u, left);
+}
+
+
+TEST(SHARDED_QUEUE, BOUNDED_SHARDS) {
+    ShardedPtrQueue<void*, BoundedPtrQueue<void*>> queue(4, 8);
+
+    for (uintptr_t i = 1; i <= 8; ++i)
+        CHECK(queue.enqueue((void*)i, 1));
+
+    uintptr_t sum = 0;
+    for (uintptr_t i = 1; i <= 8; ++i) {
+        auto elem = queue.dequeue(3);
+        CHECK(elem != nullptr);
+        sum += (uintptr_t)elem;
+    }
+    CHECK_EQUAL(sum, 36u);
+    CHECK(queue.dequeue(0) == nullptr);
+}
@@ -0,0 +1,248 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/* Layout of the records in the memory buffer. It is shared by the logger
+ * and the decoder, so both sides always agree on what a record looks like.
+ *
+ * Every record starts at RECORD_ALIGNMENT boundary with a 16 bytes magic
+ * prefix. If the byte at RECORD_FRAME_POS is RECORD_FRAME_FLAG instead of
+ * ' ', the prefix is followed by a RecordFrame: the length of the rest of
+ * the record and its checksum, so a reader goes from one record to the
+ * next without looking at the bytes in between. If the byte at
+ * RECORD_HEADER_POS is RECORD_HEADER_FLAG instead of '0', the prefix (and
+ * the frame) is followed by a RecordHeader (a timestamp, a thread id and
+ * a per-thread sequence number). The byte at RECORD_KIND_POS tells what
+ * follows the prefix (and the frame and the header):
+ *   'F' - a text record, the text runs up to the next record or to the
+ *         end of the frame
+ *   'B' - a binary record:
+ *           uint64_t  address of the format string
+ *           uint8_t   number of arguments
+ *           uint8_t   type of each argument (BinaryArgType)
+ *           ...       raw bytes of each argument, strings are stored
+ *                     as uint32_t length followed by the characters
+ *   'T' - a schema record (see memorylog::Schema):
+ *           uint32_t  type id of the schema
+ *           ...       raw bytes of each field, packed
+ *   'S' - a format string entry (see FormatEntryHeader), these live
+ *         in the format arena right after the chunks
+ *   'M' - a schema entry of the manifest (see SchemaEntryHeader) in the
+ *         format arena, it gives the fields and the format of a type id
+ *   'C' - a clock calibration entry (see ClockCalibration) in the format
+ *         arena, it maps record timestamps to CLOCK_REALTIME
+ *   'Z' - a block of records of a full chunk compressed by the background
+ *         compressor (see CompressedBlockHeader), these live in the
+ *         compressed region after the format arena */
+
+
+namespace memorylog {
+
+
+constexpr size_t RECORD_PREFIX_SIZE = 16;
+constexpr size_t RECORD_ALIGNMENT = 16;
+constexpr size_t RECORD_HEADER_POS = 13;
+constexpr size_t RECORD_KIND_POS = 14;
+constexpr size_t RECORD_FRAME_POS = 15;
+
+constexpr char RECORD_HEADER_FLAG = 'H';
+constexpr char RECORD_FRAME_FLAG = 'L';
+
+constexpr char RECORD_KIND_TEXT = 'F';
+constexpr char RECORD_KIND_BINARY = 'B';
+constexpr char RECORD_KIND_SCHEMA = 'T';
+constexpr char RECORD_KIND_FORMAT = 'S';
+constexpr char RECORD_KIND_SCHEMA_ENTRY = 'M';
+constexpr char RECORD_KIND_CLOCK = 'C';
+constexpr char RECORD_KIND_COMPRESSED = 'Z';
+
+/* This is a magic string at the begining of each record */
+static const char RECORD_PREFIX[RECORD_PREFIX_SIZE] = {
+   '\n', 'i', 'P', 'a', 'o', '2', 'i', 'j',
+    'S', 'a', 'h', 'b', 'e', '0', 'F', ' ',
+};
+
+static const char BINARY_RECORD_PREFIX[RECORD_PREFIX_SIZE] = {
+   '\n', 'i', 'P', 'a', 'o', '2', 'i', 'j',
+    'S', 'a', 'h', 'b', 'e', '0', 'B', ' ',
+};
+
+static const char SCHEMA_RECORD_PREFIX[RECORD_PREFIX_SIZE] = {
+   '\n', 'i', 'P', 'a', 'o', '2', 'i', 'j',
+    'S', 'a', 'h', 'b', 'e', '0', 'T', ' ',
+};
+
+static const char FORMAT_ENTRY_PREFIX[RECORD_PREFIX_SIZE] = {
+   '\n', 'i', 'P', 'a', 'o', '2', 'i', 'j',
+    'S', 'a', 'h', 'b', 'e', '0', 'S', ' ',
+};
+
+static const char SCHEMA_ENTRY_PREFIX[RECORD_PREFIX_SIZE] = {
+   '\n', 'i', 'P', 'a', 'o', '2', 'i', 'j',
+    'S', 'a', 'h', 'b', 'e', '0', 'M', ' ',
+};
+
+static const char CLOCK_ENTRY_PREFIX[RECORD_PREFIX_SIZE] = {
+   '\n', 'i', 'P', 'a', 'o', '2', 'i', 'j',
+    'S', 'a', 'h', 'b', 'e', '0', 'C', ' ',
+};
+
+static const char COMPRESSED_BLOCK_PREFIX[RECORD_PREFIX_SIZE] = {
+   '\n', 'i', 'P', 'a', 'o', '2', 'i', 'j',
+    'S', 'a', 'h', 'b', 'e', '0', 'Z', ' ',
+};
+
+/* fixed part of a binary record: format address and number of arguments */
+constexpr size_t BINARY_RECORD_HEADER_SIZE = sizeof(uint64_t) + 1;
+
+struct FormatEntryHeader {
+    uint64_t Address;
+    uint32_t Length;
+    uint32_t Reserved;
+};
+
+/* fixed part of a schema record: the type id */
+constexpr size_t SCHEMA_RECORD_HEADER_SIZE = sizeof(uint32_t);
+
+/* Fields bytes follow the header, the type of each field
+ * (detail::SchemaFieldType), then Length bytes of the format and
+ * a terminating zero */
+struct SchemaEntryHeader {
+    uint32_t Id;
+    uint32_t Fields;
+    uint32_t Length;
+    uint32_t Reserved;
+};
+
+/* Length is the number of bytes after the frame (the header and the
+ * payload), Checksum is record_checksum of these bytes */
+struct RecordFrame {
+    uint32_t Length;
+    uint32_t Checksum;
+};
+
+/* Size bytes follow the header, they are the records of a chunk (RawSize
+ * bytes from its start point) compressed by lz_compress or stored as they
+ * are if Method is COMPRESSION_NONE. The stored bytes are XORed with
+ * COMPRESSED_BYTES_MASK, so the literals of the compressed stream never
+ * look like record prefixes to a scan of the image. Checksum is
+ * record_checksum of the stored bytes. */
+struct CompressedBlockHeader {
+    uint32_t Size;
+    uint32_t RawSize;
+    uint32_t Checksum;
+    uint32_t Method;
+};
+
+constexpr uint32_t COMPRESSION_NONE = 0;
+constexpr uint32_t COMPRESSION_LZ77 = 1;
+constexpr unsigned char COMPRESSED_BYTES_MASK = 0xa5;
+
+struct RecordHeader {
+    uint64_t Timestamp;
+    uint32_t ThreadId;
+    uint32_t Sequence;
+};
+
+/* Two samples of the record clock and CLOCK_REALTIME taken at the same
+ * moments, they give both the offset and the rate of the clock */
+struct ClockCalibration {
+    uint64_t Ticks[2];
+    uint64_t Nanoseconds[2];
+};
+
+
+/* Returns the kind of a record starting at ptr or 0 if there is no record */
+inline char record_kind(const char* ptr) {
+    if (memcmp(ptr, RECORD_PREFIX, RECORD_HEADER_POS) != 0)
+        return 0;
+    if (ptr[RECORD_HEADER_POS] != RECORD_PREFIX[RECORD_HEADER_POS] &&
+        ptr[RECORD_HEADER_POS] != RECORD_HEADER_FLAG)
+        return 0;
+    if (ptr[RECORD_FRAME_POS] != RECORD_PREFIX[RECORD_FRAME_POS] &&
+        ptr[RECORD_FRAME_POS] != RECORD_FRAME_FLAG)
+        return 0;
+    return ptr[RECORD_KIND_POS];
+}
+
+
+inline bool record_has_header(const char* ptr) {
+    return ptr[RECORD_HEADER_POS] == RECORD_HEADER_FLAG;
+}
+
+
+inline bool record_has_frame(const char* ptr) {
+    return ptr[RECORD_FRAME_POS] == RECORD_FRAME_FLAG;
+}
+
+
+/* Text records without a frame have no length, the text ends where the next record
+ * starts or at the first zero byte */
+inline size_t text_record_size(const char* payload, const char* end) {
+    const char* pos = payload;
+    while (pos < end) {
+        const char* block_end = pos + RECORD_ALIGNMENT;
+        if (block_end > end)
+            block_end = end;
+        const void* zero = memchr(pos, 0, block_end - pos);
+        if (zero != nullptr)
+            return static_cast<const char*>(zero) - payload;
+        pos = block_end;
+        if (end - pos >= (ptrdiff_t)RECORD_PREFIX_SIZE && record_kind(pos) != 0)
+            break;
+    }
+    return pos - payload;
+}
+
+
+/* A cheap checksum of a record for RecordFrame: a Fletcher-like pair of
+ * sums over 8 bytes words, the second sum makes it depend on the order
+ * of the words. It costs an add per word on the write path and catches
+ * torn and stale records, not attacks. */
+inline uint32_t record_checksum(const char* data, size_t size) {
+    uint64_t sum = size;
+    uint64_t sum_of_sums = 0;
+    size_t pos = 0;
+    for (; pos + sizeof(uint64_t) <= size; pos += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + pos, sizeof(word));
+        sum += word;
+        sum_of_sums += sum;
+    }
+    uint64_t tail = 0;
+    for (size_t i = pos; i < size; ++i)
+        tail |= (uint64_t)(unsigned char)data[i] << (8 * (i - pos));
+    sum += tail;
+    sum_of_sums += sum;
+    uint64_t hash = (sum ^ (sum_of_sums << 32 | sum_of_sums >> 32)) *
+        0x9e3779b97f4a7c15ull;
+    return static_cast<uint32_t>(hash >> 32);
+}
+
+
+} // namespace memorylog
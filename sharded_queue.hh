@@ -0,0 +1,99 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+#include <stddef.h>
+#include <memory>
+#include <vector>
+#include "mt_ring_queue.hh"
+
+
+/* A set of RingPtrQueue shards, e.g. one shard per CPU. A producer puts
+ * an element into its own shard, a consumer takes an element from its own
+ * shard and steals from the neighbouring shards when its shard is empty.
+ * Threads running on different CPUs do not touch the same counters until
+ * they run out of local elements.
+ * With a single shard it behaves exactly as the shard queue, RingPtrQueue
+ * or BoundedPtrQueue. */
+
+
+namespace memorylog {
+
+
+template <typename PTR_TYPE,
+          typename SHARD_TYPE = RingPtrQueue<PTR_TYPE, false>>
+class ShardedPtrQueue {
+public:
+    /* capacity is the total number of elements the queue must hold */
+    ShardedPtrQueue(size_t shards, size_t capacity) {
+        /* leave some slack in each shard, so a shard does not overflow
+         * when elements are not evenly distributed */
+        size_t shard_capacity = (capacity + shards - 1) / shards;
+        if (shards > 1)
+            shard_capacity *= 2;
+        if (shard_capacity > capacity)
+            shard_capacity = capacity;
+
+        Shards.reserve(shards);
+        for (size_t i = 0; i < shards; ++i)
+            Shards.emplace_back(new Shard(shard_capacity));
+    }
+
+
+    size_t shards() const {
+        return Shards.size();
+    }
+
+
+    bool enqueue(PTR_TYPE elem, size_t shard) {
+        for (size_t i = 0; i < Shards.size(); ++i) {
+            if (Shards[shard]->enqueue(elem))
+                return true;
+            if (++shard == Shards.size())
+                shard = 0;
+        }
+        return false;
+    }
+
+
+    PTR_TYPE dequeue(size_t shard) {
+        for (size_t i = 0; i < Shards.size(); ++i) {
+            PTR_TYPE elem = Shards[shard]->dequeue();
+            if (elem != nullptr)
+                return elem;
+            if (++shard == Shards.size())
+                shard = 0;
+        }
+        return nullptr;
+    }
+
+
+private:
+    using Shard = SHARD_TYPE;
+
+    std::vector<std::unique_ptr<Shard>> Shards;
+};
+
+
+} // namespace memorylog
@@ -0,0 +1,266 @@
+/*
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 Vitaliy Manushkin.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "memorylog_internal.hh"
+#include "memorylog_decode.hh"
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+
+namespace memorylog {
+
+
+namespace {
+
+
+/* a chunk reused this many times while its records are copied is left
+ * for the next call */
+constexpr int COPY_ATTEMPTS = 3;
+
+
+} // anonymous namespace
+
+
+namespace detail {
+
+
+struct TailCursorState {
+    struct ChunkPosition {
+        uint64_t Generation;
+        /* offset of the first record not read yet from the chunk start */
+        size_t Offset;
+    };
+
+    /* the log the positions belong to */
+    uint64_t LogId = 0;
+    std::vector<ChunkPosition> Chunks;
+    std::unique_ptr<char[]> Staging;
+    /* the formatted text of a binary or a schema record */
+    std::string Text;
+    uint64_t Missed = 0;
+
+    void bind(GlobalContext& ctx) {
+        if (LogId == ctx.Id && !Chunks.empty())
+            return;
+        LogId = ctx.Id;
+        Chunks.assign(ctx.chunks(), ChunkPosition{0, 0});
+        Staging.reset(new char[ctx.MaxChunkSize]);
+    }
+
+    bool read_chunk(
+        GlobalContext& ctx, size_t index,
+        TailCallback callback, void* arg);
+
+    bool pass_records(
+        const GlobalContext& ctx, ChunkPosition& position, size_t size,
+        TailCallback callback, void* arg);
+};
+
+
+/* Copies the new records of the chunk and passes them to the callback,
+ * returns false if the callback asked to stop */
+bool TailCursorState::read_chunk(
+    GlobalContext& ctx, size_t index, TailCallback callback, void* arg)
+{
+    MemoryBufferChunk* chunk = ctx.chunk(index);
+    ChunkPosition& position = Chunks[index];
+    char* start = chunk->start_point();
+
+    for (int attempt = 0; attempt < COPY_ATTEMPTS; ++attempt) {
+        uint64_t generation = chunk->get_generation();
+        size_t offset = generation == position.Generation ? position.Offset : 0;
+        size_t fill = chunk->end_point() - start;
+        if (generation == position.Generation && fill == offset)
+            return true;
+        /* the chunk was reset between the loads above */
+        if (fill < offset)
+            continue;
+
+        size_t size = fill - offset;
+        memcpy(Staging.get(), start + offset, size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (chunk->get_generation() != generation)
+            continue;
+
+        if (generation != position.Generation) {
+            if (position.Generation != 0)
+                Missed += generation - position.Generation - 1;
+            position.Generation = generation;
+        }
+        position.Offset = offset;
+        return pass_records(ctx, position, size, callback, arg);
+    }
+    return true;
+}
+
+
+/* Parses the records copied to the staging buffer, they start at
+ * position.Offset in the chunk. The position moves past every record
+ * passed to the callback. */
+bool TailCursorState::pass_records(
+    const GlobalContext& ctx, ChunkPosition& position, size_t size,
+    TailCallback callback, void* arg)
+{
+    const size_t first = position.Offset;
+    const char* const base = Staging.get();
+    const char* const end = base + size;
+    const char* pos = base;
+
+    while (end - pos >= (ptrdiff_t)RECORD_PREFIX_SIZE) {
+        char kind = record_kind(pos);
+        if (kind != RECORD_KIND_TEXT && kind != RECORD_KIND_BINARY &&
+            kind != RECORD_KIND_SCHEMA)
+        {
+            pos += RECORD_ALIGNMENT;
+            continue;
+        }
+
+        /* the frame and the header have to fit into the copy, as in
+         * check_frame of the decoder */
+        const char* payload = pos + RECORD_PREFIX_SIZE;
+        const char* limit = end;
+        if (record_has_frame(pos)) {
+            RecordFrame frame;
+            if ((size_t)(end - payload) < sizeof(frame)) {
+                pos += RECORD_ALIGNMENT;
+                continue;
+            }
+            memcpy(&frame, payload, sizeof(frame));
+            payload += sizeof(frame);
+            if ((size_t)(end - payload) < frame.Length) {
+                pos += RECORD_ALIGNMENT;
+                continue;
+            }
+            limit = payload + frame.Length;
+        }
+
+        TailRecord record;
+        record.Timestamp = 0;
+        record.ThreadId = 0;
+        record.Sequence = 0;
+        if (record_has_header(pos)) {
+            if ((size_t)(limit - payload) < sizeof(RecordHeader)) {
+                pos += RECORD_ALIGNMENT;
+                continue;
+            }
+            RecordHeader header;
+            memcpy(&header, payload, sizeof(header));
+            payload += sizeof(header);
+            record.Timestamp = header.Timestamp;
+            record.ThreadId = header.ThreadId;
+            record.Sequence = header.Sequence;
+        }
+
+        /* the records are below the fill point and complete, but an
+         * unframed text may hold the prefix of a binary or a schema
+         * record, so the bytes after it are anything */
+        size_t record_size;
+        if (kind == RECORD_KIND_TEXT) {
+            record_size = record_has_frame(pos)
+                ? limit - payload : text_record_size(payload, end);
+            record.Text = payload;
+            record.Size = record_size;
+        } else {
+            Text.clear();
+            bool formatted;
+            size_t available = limit - payload;
+            if (kind == RECORD_KIND_BINARY) {
+                /* the format is in this process, it is the address itself
+                 * if the registry of the log knows it; an address it does
+                 * not know is printed as an unknown format */
+                const char* format = available < sizeof(uint64_t)
+                    ? nullptr
+                    : ctx.Formats.find(binary_record_format(payload));
+                formatted = format_binary_record(
+                    payload, available, format, Text, record_size);
+            } else {
+                /* and so is the schema of a type id */
+                const detail::SchemaInfo* schema =
+                    available < sizeof(uint32_t)
+                    ? nullptr : find_schema(schema_record_id(payload));
+                formatted = format_schema_record(
+                    payload, limit - payload,
+                    schema != nullptr ? schema->Types : nullptr,
+                    schema != nullptr ? schema->FieldCount : 0,
+                    schema != nullptr ? schema->Format : nullptr,
+                    Text, record_size);
+            }
+            if (!formatted) {
+                pos += RECORD_ALIGNMENT;
+                continue;
+            }
+            record.Text = Text.data();
+            record.Size = Text.size();
+        }
+
+        /* offsets in the chunk are aligned like the addresses */
+        size_t next = (record_has_frame(pos) ? limit : payload + record_size)
+            - base + RECORD_ALIGNMENT - 1;
+        next -= next % RECORD_ALIGNMENT;
+        pos = base + std::min(next, size);
+        position.Offset = first + (pos - base);
+        if (!callback(arg, record))
+            return false;
+    }
+    return true;
+}
+
+
+bool tail_records(
+    GlobalContext* ctx, TailCursor& cursor, TailCallback callback, void* arg)
+{
+    if (ctx == nullptr)
+        return false;
+
+    TailCursorState& state = *cursor.State;
+    state.bind(*ctx);
+    for (size_t index = 0; index < ctx->chunks(); ++index) {
+        if (!state.read_chunk(*ctx, index, callback, arg))
+            break;
+    }
+    return true;
+}
+
+
+} // namespace detail
+
+
+TailCursor::TailCursor()
+    : State(new detail::TailCursorState)
+{
+}
+
+
+TailCursor::~TailCursor() {
+    delete State;
+}
+
+
+uint64_t TailCursor::missed() const {
+    return State->Missed;
+}
+
+
+} // namespace memorylog